@@ -11,11 +11,33 @@ int main(int argc, char **argv)
 {
 	if (argc < 4)
 	{
-		std::cerr << "usage: <sboxes> <key> <output_file>\n";
+		std::cerr << "usage: <sboxes> <key> <output_file> [key_schedule] [permutation]\n";
 		return EXIT_FAILURE;
 	}
 	
 	SPN spn;
+	if (argc > 4)
+	{
+		KeySchedule key_schedule;
+		if (!key_schedule.load(argv[4]))
+		{
+			std::cerr << "Error: bad key schedule\n";
+			return EXIT_FAILURE;
+		}
+		spn.setKeySchedule(key_schedule);
+	}
+
+	if (argc > 5)
+	{
+		BitPermutation permutation;
+		if (!permutation.load(argv[5]))
+		{
+			std::cerr << "Error: bad permutation\n";
+			return EXIT_FAILURE;
+		}
+		spn.setPermutation(permutation);
+	}
+
 	if (!spn.keysched(argv[2]))
 	{
 		std::cerr << "Error: bad key\n";
@@ -31,20 +53,28 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	std::vector<uint16_t> pt(0x10000);
 	for (uint32_t x = 0; x < 0x10000; x++)
 	{
-		uint16_t pt = (uint16_t)x;
-		uint16_t ct = spn.encrypt(pt);
-		uint16_t pt2 = spn.decrypt(ct);
+		pt[x] = (uint16_t)x;
+	}
+
+	std::vector<uint16_t> ct(pt.size());
+	std::vector<uint16_t> pt2(pt.size());
+	spn.encryptBlocks(pt.data(), ct.data(), pt.size());
+	spn.decryptBlocks(ct.data(), pt2.data(), ct.size());
 
-		if (pt != pt2)
+	for (uint32_t x = 0; x < 0x10000; x++)
+	{
+		// The bitsliced circuits have to agree with the tables
+		if (pt[x] != pt2[x] || ct[x] != spn.encrypt(pt[x]))
 		{
 			std::cerr << "Error: 0xBAAD\n";
 			fclose(out);
 			return EXIT_FAILURE;
 		}
 
-		fprintf(out, "%04hx\n", ct);
+		fprintf(out, "%04hx\n", ct[x]);
 	}
 
 	std::cerr << "ok\n";
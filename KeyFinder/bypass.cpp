@@ -0,0 +1,228 @@
+// bypass.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// First round bypass for key[4] (1R + trail + 1R).
+//
+// The differential engine needs a characteristic through the sboxes of rounds 1 to 3 for the pairs to reach the
+// last round right. With the whole codebook the first round doesn't have to be paid for: if the key[0] nibbles
+// of the sboxes active in round 1 are guessed (g), for every plaintext p the one that makes exactly the wanted
+// sbox output difference v1 of round 1 is
+//		p' = isubst(subst(p ^ g) ^ v1) ^ g
+// (the inactive nibbles stay the same), so only rounds 2 and 3 are probabilistic. The price is counting every
+// key[0] guess, the key[4] values are counted for each guess on its own and the right one should stand out
+// under the right guess only, so a key[4] value gets the count of its best guess.
+//
+// The guesses aren't tried one by one though. Plaintexts that only differ in the active nibbles (a structure)
+// can only be a right pair if their ciphertexts are equal outside the counted sboxes, so every structure is
+// sorted by that and only the pairs with a match are looked at. The guesses that get such a pair to v1 come
+// from the DDT nibble by nibble (x with S(x) ^ S(x ^ d) = v1, g = x ^ p), so the work hardly depends on how
+// many sboxes are active in round 1.
+//
+#include "keyfinder.hpp"
+
+#include <algorithm>
+
+
+namespace
+{
+	// Nibbles of the given sboxes next to each other and back
+	size_t PackNibbles(uint16_t x, const std::vector<uint16_t>& sboxes)
+	{
+		size_t r = 0;
+		for (uint16_t sbox_index : sboxes)
+		{
+			r = (r << 4) | KeyFinder::SboxValue(sbox_index, x);
+		}
+		return r;
+	}
+
+	uint16_t UnpackNibbles(uint16_t r, const std::vector<uint16_t>& sboxes)
+	{
+		uint16_t x = 0;
+		for (size_t i = 0; i < sboxes.size(); ++i)
+		{
+			x |= KeyFinder::MakeSbox(sboxes[i], r >> (4 * (sboxes.size() - 1 - i)));
+		}
+		return x;
+	}
+}
+
+
+std::vector<KeyFinder::Path> KeyFinder::genBypassPath(const SboxState& wanted_sbox) const
+{
+	std::vector<Path> paths;
+	for (uint16_t u : genActiveValues(wanted_sbox))
+	{
+		uint16_t prev_round_in_diff = u;
+		double probability = 1.0;
+		for (size_t r = SPN::Nr - 1; r >= 2; --r)
+		{
+			prev_round_in_diff = findPathForRound(r, prev_round_in_diff, probability, false);
+		}
+
+		// Sbox output difference of round 1, each of its sboxes multiplies the key[0] guesses by 16
+		uint16_t first_out_diff = m_spn.itransp(prev_round_in_diff);
+		if (SboxCount(first_out_diff) > BYPASS_MAX_FIRST_SBOXES)
+		{
+			continue;
+		}
+
+		KF_LOG_VERY("bypass: v1=%04hx u%zd=%04hx, probability %lf\n", first_out_diff, SPN::Nr, u, probability);
+
+		paths.push_back(Path(first_out_diff, u, probability));
+	}
+
+	return findBestPaths(paths);
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::getBypassSubkey(const Path& path, const SubkeyCandidates& candidates) const
+{
+	uint16_t output_mask = Mask(path.output_diff);
+	uint16_t first_mask = Mask(path.input_diff);
+	const auto first_sboxes = FindSbox(first_mask);
+	const auto last_sboxes = FindSbox(output_mask);
+
+	// solutions[n][d] - nibble values x of sbox n (of round 1) with S(x) ^ S(x ^ d) = the difference of v1 there
+	std::vector<std::vector<std::vector<uint16_t>>> solutions(4, std::vector<std::vector<uint16_t>>(16));
+	for (uint16_t n : first_sboxes)
+	{
+		for (uint16_t x = 0; x <= 0xf; ++x)
+		{
+			for (uint16_t d = 1; d <= 0xf; ++d)
+			{
+				if (((m_spn.subst(x) ^ m_spn.subst(x ^ d)) & 0xf) == SboxValue(n, path.input_diff))
+				{
+					solutions[n][d].push_back(x);
+				}
+			}
+		}
+	}
+
+	// Counters of every key[0] guess and key[4] value, both packed to their nibbles
+	const SubkeyCandidates first_candidates = getConstraints(0, false);
+	const auto subkeys = genCandidateSubkeys(output_mask, SPN::Nr, candidates);
+	std::vector<uint16_t> subkey_list(subkeys.begin(), subkeys.end());
+	size_t guess_count = static_cast<size_t>(1) << (4 * first_sboxes.size());
+	size_t subkey_count = static_cast<size_t>(1) << (4 * last_sboxes.size());
+	std::vector<uint32_t> counts(guess_count * subkey_count, 0);
+
+	// Same as the differential filter, a ciphertext nibble difference the sbox can't make from the one of u4 is no pair
+	const auto& diff_table = m_spn.getDiffTable();
+	auto feasible = [&](uint16_t ct_diff)
+	{
+		for (uint16_t n : last_sboxes)
+		{
+			if (diff_table[SboxValue(n, path.output_diff)][SboxValue(n, ct_diff)] == 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+
+	const auto actives = genSubkeysSet(first_mask);
+	std::vector<std::pair<uint16_t, uint16_t>> structure;
+	structure.reserve(actives.size());
+	size_t pair_count = 0;
+
+	for (uint32_t constant = 0; constant <= 0xffff; ++constant)
+	{
+		if ((constant & first_mask) != 0)
+		{
+			continue;
+		}
+
+		// Right pairs have equal ciphertexts outside the counted sboxes
+		structure.clear();
+		for (uint16_t a : actives)
+		{
+			uint16_t pt = static_cast<uint16_t>(constant) | a;
+			structure.push_back(std::make_pair(static_cast<uint16_t>(m_pc1[pt] & ~output_mask), pt));
+		}
+		std::sort(structure.begin(), structure.end());
+
+		for (size_t i = 0; i < structure.size(); ++i)
+		{
+			for (size_t j = i + 1; j < structure.size() && structure[j].first == structure[i].first; ++j)
+			{
+				uint16_t pt1 = structure[i].second;
+				uint16_t pt2 = structure[j].second;
+				uint16_t d = pt1 ^ pt2;
+				if (!feasible(m_pc1[pt1] ^ m_pc1[pt2]))
+				{
+					continue;
+				}
+
+				// Every key[0] guess that gets the pair to v1, nibble by nibble
+				std::vector<uint16_t> guesses(1, 0);
+				for (uint16_t n : first_sboxes)
+				{
+					std::vector<uint16_t> next;
+					for (uint16_t x : solutions[n][SboxValue(n, d)])
+					{
+						for (uint16_t g : guesses)
+						{
+							next.push_back(g | MakeSbox(n, x ^ SboxValue(n, pt1)));
+						}
+					}
+					guesses.swap(next);
+				}
+
+				if (guesses.empty())
+				{
+					continue;
+				}
+				++pair_count;
+
+				uint16_t ct1 = m_pc1[pt1];
+				uint16_t ct2 = m_pc1[pt2];
+				for (uint16_t g : guesses)
+				{
+					if (!first_candidates.allows(g, first_mask))
+					{
+						continue;
+					}
+
+					uint32_t* row = counts.data() + PackNibbles(g, first_sboxes) * subkey_count;
+					for (uint16_t sk : subkey_list)
+					{
+						if (((isubstBlock(ct1 ^ sk) ^ isubstBlock(ct2 ^ sk)) & output_mask) == path.output_diff)
+						{
+							++row[PackNibbles(sk, last_sboxes)];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// A key[4] value gets the count of its best key[0] guess
+	std::map<uint16_t, size_t> hist;
+	std::map<uint16_t, uint16_t> best_guess;
+	for (size_t g = 0; g < guess_count; ++g)
+	{
+		for (uint16_t sk : subkey_list)
+		{
+			uint32_t c = counts[g * subkey_count + PackNibbles(sk, last_sboxes)];
+			if (c != 0 && c > hist[sk])
+			{
+				hist[sk] = c;
+				best_guess[sk] = UnpackNibbles(static_cast<uint16_t>(g), first_sboxes);
+			}
+		}
+	}
+
+	KF_LOG(VERBOSE_MEDIUM, "bypass: %zd key[0] guesses, valid pc pairs: %zd\n", guess_count, pair_count);
+
+	if (Log::enabled(VERBOSE_MEDIUM))
+	{
+		for (const HistReturn& r : findMaxInHist(hist))
+		{
+			Log::write("bypass: key[%zd] %04hx with key[0] %04hx, %zd pairs\n", SPN::Nr, r.key, best_guess[r.key], r.value);
+		}
+	}
+
+	return hist;
+}
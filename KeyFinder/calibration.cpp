@@ -0,0 +1,192 @@
+// calibration.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+#include "calibration.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "spn.hpp"
+
+
+namespace
+{
+	// Every value of 0-15 exactly once
+	bool IsPermutation(const std::vector<uint16_t>& values)
+	{
+		std::vector<uint16_t> sorted = values;
+		std::sort(sorted.begin(), sorted.end());
+		for (size_t i = 0; i < sorted.size(); ++i)
+		{
+			if (sorted[i] != i)
+			{
+				return false;
+			}
+		}
+		return sorted.size() == 16;
+	}
+}
+
+
+const Calibration::PathStats* Calibration::findPath(size_t round_num, uint16_t input_diff, uint16_t output_diff) const
+{
+	auto it = rounds.find(round_num);
+	if (it == rounds.end())
+	{
+		return nullptr;
+	}
+
+	for (const PathStats& p : it->second.paths)
+	{
+		if (p.input_diff == input_diff && p.output_diff == output_diff)
+		{
+			return &p;
+		}
+	}
+
+	return nullptr;
+}
+
+
+// Format:
+//
+//	sbox 6 10 11 15 12 2 13 5 3 8 0 1 14 7 4 9
+//	permutation 0 4 8 12 1 5 9 13 2 6 10 14 3 7 11 15
+//	round <round> <max_active_sboxes> <stop_margin[0]> .. <stop_margin[4]>
+//	path <round> <input> <output> <active> <predicted> <observed> <correct_count> <correct_rank> <wrong_mean> <wrong_stddev> <wrong_max> <useful>
+//
+bool Calibration::save(const std::string& filename) const
+{
+	FILE* out = fopen(filename.c_str(), "w");
+	if (out == nullptr)
+	{
+		return false;
+	}
+
+	fprintf(out, "sbox");
+	for (uint16_t s : sbox)
+	{
+		fprintf(out, " %hu", s);
+	}
+	fputc('\n', out);
+
+	fprintf(out, "permutation");
+	for (uint16_t p : permutation)
+	{
+		fprintf(out, " %hu", p);
+	}
+	fputc('\n', out);
+
+	for (const auto& r : rounds)
+	{
+		fprintf(out, "round %zd %zd", r.first, r.second.max_active_sboxes);
+		for (double m : r.second.stop_margin)
+		{
+			fprintf(out, " %lf", m);
+		}
+		fputc('\n', out);
+
+		for (const PathStats& p : r.second.paths)
+		{
+			fprintf(out, "path %zd %04hx %04hx %zd %lf %zd %zd %zd %lf %lf %zd %d\n",
+				r.first,
+				p.input_diff,
+				p.output_diff,
+				p.active_sboxes,
+				p.predicted,
+				p.observed,
+				p.correct_count,
+				p.correct_rank,
+				p.wrong_mean,
+				p.wrong_stddev,
+				p.wrong_max,
+				p.useful ? 1 : 0);
+		}
+	}
+
+	fclose(out);
+
+	return true;
+}
+
+
+bool Calibration::load(const std::string& filename)
+{
+	std::ifstream in(filename);
+	if (!in.is_open())
+	{
+		return false;
+	}
+
+	sbox.clear();
+	permutation = BitPermutation().getPositions();
+	rounds.clear();
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		const char* s = line.c_str();
+
+		if (line.compare(0, 5, "sbox ") == 0)
+		{
+			char* p = const_cast<char*>(s + 5);
+			for (size_t i = 0; i < 16; ++i)
+			{
+				sbox.push_back(static_cast<uint16_t>(strtol(p, &p, 10)));
+			}
+		}
+		else if (line.compare(0, 12, "permutation ") == 0)
+		{
+			char* p = const_cast<char*>(s + 12);
+			permutation.clear();
+			for (size_t i = 0; i < 16; ++i)
+			{
+				permutation.push_back(static_cast<uint16_t>(strtol(p, &p, 10)));
+			}
+		}
+		else if (line.compare(0, 6, "round ") == 0)
+		{
+			size_t round_num = 0;
+			RoundStats r;
+			if (sscanf(s, "round %zd %zd %lf %lf %lf %lf %lf", &round_num, &r.max_active_sboxes,
+				&r.stop_margin[0], &r.stop_margin[1], &r.stop_margin[2], &r.stop_margin[3], &r.stop_margin[4]) != 7 ||
+				round_num > SPN::Nr || r.max_active_sboxes > 4)
+			{
+				return false;
+			}
+
+			rounds[round_num] = r;
+		}
+		else if (line.compare(0, 5, "path ") == 0)
+		{
+			size_t round_num = 0;
+			int useful = 0;
+			PathStats p;
+			if (sscanf(s, "path %zd %hx %hx %zd %lf %zd %zd %zd %lf %lf %zd %d",
+				&round_num,
+				&p.input_diff,
+				&p.output_diff,
+				&p.active_sboxes,
+				&p.predicted,
+				&p.observed,
+				&p.correct_count,
+				&p.correct_rank,
+				&p.wrong_mean,
+				&p.wrong_stddev,
+				&p.wrong_max,
+				&useful) != 12 ||
+				round_num > SPN::Nr)
+			{
+				return false;
+			}
+
+			p.useful = useful != 0;
+			rounds[round_num].paths.push_back(p);
+		}
+	}
+
+	return IsPermutation(sbox) && IsPermutation(permutation);
+}
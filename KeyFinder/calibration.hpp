@@ -0,0 +1,66 @@
+// calibration.hpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Measurements taken by KeyFinder::calibrate on a codebook with a known key.
+//
+// They are saved into a small text file and loaded back for real attacks with the same S-box and permutation,
+// where they decide how many active sboxes to count per round (instead of guessing --heur3/--heur4),
+// when it's safe to stop counting early and which paths are only adding noise.
+//
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "permutation.hpp"
+
+
+struct Calibration
+{
+	struct PathStats
+	{
+		uint16_t input_diff;
+		uint16_t output_diff;
+		// Number of sboxes active in the state the path was generated for
+		size_t active_sboxes;
+		// path.probability * number of pairs
+		double predicted;
+		// Real right pairs in the codebook under the known key
+		size_t observed;
+		// Count the correct subkey got in the histogram of this path and its rank (1 = best, ties don't count)
+		size_t correct_count;
+		size_t correct_rank;
+		// Count distribution of all the other candidate subkeys
+		double wrong_mean;
+		double wrong_stddev;
+		size_t wrong_max;
+		// Correct subkey is among the maximums, so the path actually votes for it
+		bool useful;
+	};
+
+	struct RoundStats
+	{
+		// Smallest number of active sboxes after which all nibbles were guessed right, 0 = never
+		size_t max_active_sboxes{ 0 };
+		// stop_margin[n] - after counting states with n active sboxes, it's safe to stop if the margin
+		// of every nibble is above this, < 0 = never stop
+		double stop_margin[5]{ -1.0, -1.0, -1.0, -1.0, -1.0 };
+		std::vector<PathStats> paths;
+	};
+
+	std::vector<uint16_t> sbox;
+	// Bit positions of the permutation layer (BitPermutation), files without it were made with the transpose
+	std::vector<uint16_t> permutation;
+	std::map<size_t, RoundStats> rounds;
+
+	bool empty() const { return rounds.empty(); }
+	const PathStats* findPath(size_t round_num, uint16_t input_diff, uint16_t output_diff) const;
+
+	bool save(const std::string& filename) const;
+	// False unless the sbox and the permutation are both permutations of 0-15, every round is at most SPN::Nr and
+	// counts at most 4 sboxes
+	bool load(const std::string& filename);
+};
@@ -0,0 +1,247 @@
+// constraints.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Partially known subkeys.
+//
+// Some bits of a subkey (--constraint key[i]=mask:value) or a short list of what it can be (--candidates) can be
+// known from somewhere else, e.g. an earlier partial run. Both end up in a SubkeyCandidates per round, which the
+// enumerators and kernels already go through for pruneImpossible, so nothing outside of them is ever counted.
+//
+// The permutation only moves bits around, so known bits and whole subkeys go through itransp exactly for the engines
+// guessing itransp(subkey) in the middle rounds, only the per nibble values have to be computed again.
+//
+#include "keyfinder.hpp"
+
+#include <algorithm>
+
+
+bool KeyFinder::SubkeyCandidates::constrain(uint16_t mask, uint16_t value)
+{
+	if (((known_value ^ value) & known_mask & mask) != 0)
+	{
+		return false;
+	}
+
+	known_mask |= mask;
+	known_value = (known_value & ~mask) | (value & mask);
+
+	for (size_t i = 0; i < 4; ++i)
+	{
+		uint16_t m = SboxValue(i, mask);
+		uint16_t v = SboxValue(i, value);
+
+		for (uint16_t x = 0; x <= 0xf; ++x)
+		{
+			if (((x ^ v) & m) != 0)
+			{
+				nibble[i] &= ~(1 << x);
+			}
+		}
+	}
+
+	return true;
+}
+
+
+bool KeyFinder::SubkeyCandidates::restrict(const std::vector<uint16_t>& list)
+{
+	std::vector<uint16_t> left;
+	for (uint16_t k : list)
+	{
+		if (allows(k, 0xffff))
+		{
+			left.push_back(k);
+		}
+	}
+
+	if (left.empty())
+	{
+		return false;
+	}
+
+	std::sort(left.begin(), left.end());
+	left.erase(std::unique(left.begin(), left.end()), left.end());
+	subkeys = left;
+
+	for (size_t i = 0; i < 4; ++i)
+	{
+		uint16_t projection = 0;
+		for (uint16_t k : subkeys)
+		{
+			projection |= 1 << SboxValue(i, k);
+		}
+		nibble[i] &= projection;
+	}
+
+	return true;
+}
+
+
+bool KeyFinder::addConstraint(size_t round_num, uint16_t mask, uint16_t value)
+{
+	if (round_num > SPN::Nr)
+	{
+		return false;
+	}
+
+	SubkeyCandidates& c = m_constraints[round_num];
+
+	// The list has to agree with the new bits too
+	SubkeyCandidates updated = c;
+	if (!updated.constrain(mask, value) || (!updated.subkeys.empty() && !updated.restrict(updated.subkeys)))
+	{
+		return false;
+	}
+
+	c = updated;
+
+	return true;
+}
+
+
+bool KeyFinder::addCandidates(size_t round_num, const std::vector<uint16_t>& subkeys)
+{
+	if (round_num > SPN::Nr)
+	{
+		return false;
+	}
+
+	return m_constraints[round_num].restrict(subkeys);
+}
+
+
+KeyFinder::SubkeyCandidates KeyFinder::getConstraints(size_t round_num, bool permuted) const
+{
+	const SubkeyCandidates& c = m_constraints[round_num];
+	if (!permuted || round_num == 0 || round_num == SPN::Nr)
+	{
+		return c;
+	}
+
+	SubkeyCandidates p;
+	p.permuted = true;
+	p.constrain(m_spn.itransp(c.known_mask), m_spn.itransp(c.known_value));
+
+	if (!c.subkeys.empty())
+	{
+		std::vector<uint16_t> list;
+		for (uint16_t k : c.subkeys)
+		{
+			list.push_back(m_spn.itransp(k));
+		}
+		p.restrict(list);
+	}
+
+	return p;
+}
+
+
+bool KeyFinder::learnSubkey(size_t round_num, uint16_t subkey)
+{
+	m_subkeys[round_num] = subkey;
+
+	const KeySchedule& key_schedule = m_spn.getKeySchedule();
+
+	bool consistent = true;
+	for (size_t b = 0; b < 16; ++b)
+	{
+		KeyEquation equation;
+		equation.row = key_schedule.getRow(round_num, b);
+		equation.value = ((subkey >> b) & 1) != 0;
+
+		// Gauss-Jordan, every pivot is only in its own row
+		for (const KeyEquation& e : m_key_equations)
+		{
+			if (equation.row[e.pivot])
+			{
+				equation.row ^= e.row;
+				equation.value ^= e.value;
+			}
+		}
+
+		if (equation.row.none())
+		{
+			consistent = consistent && !equation.value;
+			continue;
+		}
+
+		equation.pivot = 0;
+		while (!equation.row[equation.pivot])
+		{
+			++equation.pivot;
+		}
+
+		for (KeyEquation& e : m_key_equations)
+		{
+			if (e.row[equation.pivot])
+			{
+				e.row ^= equation.row;
+				e.value ^= equation.value;
+			}
+		}
+
+		m_key_equations.push_back(equation);
+	}
+
+	if (!consistent)
+	{
+		KF_LOG(VERBOSE_NONE, "key schedule: key[%zd]=%04hx contradicts the subkeys before it\n", round_num, subkey);
+	}
+
+	// Every subkey bit the equations give is a constraint now
+	for (size_t r = 0; r <= SPN::Nr; ++r)
+	{
+		uint16_t mask = 0;
+		uint16_t value = 0;
+		for (size_t b = 0; b < 16; ++b)
+		{
+			KeySchedule::Row row = key_schedule.getRow(r, b);
+			bool bit = false;
+			for (const KeyEquation& e : m_key_equations)
+			{
+				if (row[e.pivot])
+				{
+					row ^= e.row;
+					bit ^= e.value;
+				}
+			}
+
+			if (row.none())
+			{
+				mask |= 1 << b;
+				value |= bit ? 1 << b : 0;
+			}
+		}
+
+		if (r != round_num && (mask & ~m_constraints[r].known_mask) != 0)
+		{
+			KF_LOG(VERBOSE_INFO, "key schedule: key[%zd] & %04hx = %04hx\n", r, mask, value);
+		}
+
+		if (!addConstraint(r, mask, value))
+		{
+			KF_LOG(VERBOSE_NONE, "key schedule: key[%zd] & %04hx = %04hx contradicts the constraints\n", r, mask, value);
+			consistent = false;
+		}
+	}
+
+	return consistent;
+}
+
+
+bool KeyFinder::getMasterKey(KeySchedule::Row& master) const
+{
+	if (m_key_equations.size() != m_spn.getKeySchedule().getKeyBits())
+	{
+		return false;
+	}
+
+	master.reset();
+	for (const KeyEquation& e : m_key_equations)
+	{
+		master[e.pivot] = e.value;
+	}
+
+	return true;
+}
@@ -0,0 +1,298 @@
+// elastic.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+#include "elastic.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+
+namespace
+{
+	int64_t NowMs()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Cores of the affinity mask, empty if it can't be read
+	std::vector<int> AffinityCpus()
+	{
+		std::vector<int> cpus;
+#ifdef __linux__
+		cpu_set_t set;
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			{
+				if (CPU_ISSET(cpu, &set))
+				{
+					cpus.push_back(cpu);
+				}
+			}
+		}
+#endif
+		return cpus;
+	}
+
+	// "max 100000" or "<quota> <period>" in microseconds, 0 = no quota
+	double QuotaOf(const std::string& dir)
+	{
+		std::ifstream in(dir + "/cpu.max");
+		std::string quota;
+		double period = 0.0;
+		if (!(in >> quota >> period) || quota == "max" || period <= 0.0)
+		{
+			return 0.0;
+		}
+
+		return atof(quota.c_str()) / period;
+	}
+}
+
+
+// std::chrono takes it by reference
+const size_t ElasticWorkers::PARK_MS;
+
+
+ElasticWorkers::ElasticWorkers(size_t max_workers) :
+	m_max_workers{ std::max<size_t>(1, max_workers) },
+	m_cpus{ AffinityCpus() },
+	m_cores{ m_cpus.empty() ? std::max<size_t>(1, std::thread::hardware_concurrency()) : m_cpus.size() },
+	m_limit{ m_max_workers },
+	m_lowest{ m_max_workers },
+	m_highest{ 0 }
+{
+	// Every ancestor can have a quota too, the tightest one is what the workers run into
+	std::string own = CgroupDir();
+	m_cgroup = own;
+	double tightest = 0.0;
+	for (std::string dir = own; dir.size() > std::string("/sys/fs/cgroup").size(); dir = dir.substr(0, dir.rfind('/')))
+	{
+		double quota = QuotaOf(dir);
+		if (quota > 0.0 && (tightest == 0.0 || quota < tightest))
+		{
+			tightest = quota;
+			m_cgroup = dir;
+		}
+	}
+
+	m_has_stat = !m_cgroup.empty() && readCpuStat(m_start_stat);
+
+	std::lock_guard<std::mutex> lock(m_refresh_mutex);
+	refresh();
+}
+
+
+std::string ElasticWorkers::CgroupDir()
+{
+	// cgroup v2 has a single line "0::/path"
+	std::ifstream in("/proc/self/cgroup");
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.compare(0, 3, "0::") == 0)
+		{
+			std::string path = line.substr(3);
+			return "/sys/fs/cgroup" + (path == "/" ? std::string() : path);
+		}
+	}
+
+	return std::string();
+}
+
+
+double ElasticWorkers::readQuota() const
+{
+	return m_cgroup.empty() ? 0.0 : QuotaOf(m_cgroup);
+}
+
+
+bool ElasticWorkers::readCpuStat(CpuStat& stat) const
+{
+	std::ifstream in(m_cgroup + "/cpu.stat");
+	if (!in.is_open())
+	{
+		return false;
+	}
+
+	std::string key;
+	uint64_t value = 0;
+	while (in >> key >> value)
+	{
+		if (key == "nr_periods")
+		{
+			stat.periods = value;
+		}
+		else if (key == "nr_throttled")
+		{
+			stat.throttled = value;
+		}
+		else if (key == "throttled_usec")
+		{
+			stat.throttled_usec = value;
+		}
+	}
+
+	return true;
+}
+
+
+bool ElasticWorkers::readCoreTimes(CoreTimes& times) const
+{
+#ifdef __linux__
+	// "cpu3 user nice system idle iowait irq softirq steal guest guest_nice" in clock ticks, guest is in user already
+	std::ifstream in("/proc/stat");
+	if (!in.is_open())
+	{
+		return false;
+	}
+
+	const double tick = 1.0 / static_cast<double>(sysconf(_SC_CLK_TCK));
+	times = CoreTimes();
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.compare(0, 3, "cpu") != 0)
+		{
+			continue;
+		}
+
+		// The first line sums up every core, it's only used without the mask
+		std::istringstream fields(line.substr(3));
+		int cpu = -1;
+		if (line.size() > 3 && line[3] != ' ' && !(fields >> cpu))
+		{
+			continue;
+		}
+		if (m_cpus.empty() ? cpu != -1 : !std::binary_search(m_cpus.begin(), m_cpus.end(), cpu))
+		{
+			continue;
+		}
+
+		uint64_t value[8] = { 0 };
+		for (uint64_t& v : value)
+		{
+			fields >> v;
+		}
+
+		double idle = static_cast<double>(value[3] + value[4]);
+		double total = 0.0;
+		for (uint64_t v : value)
+		{
+			total += static_cast<double>(v);
+		}
+		times.busy += (total - idle) * tick;
+		times.total += total * tick;
+	}
+
+	struct rusage usage;
+	if (times.total == 0.0 || getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return false;
+	}
+
+	times.own = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	return true;
+#else
+	(void)times;
+	return false;
+#endif
+}
+
+
+size_t ElasticWorkers::limit()
+{
+	int64_t now = NowMs();
+	if (now >= m_next_refresh.load() && m_refresh_mutex.try_lock())
+	{
+		// Someone else could have refreshed between the check and the lock
+		if (now >= m_next_refresh.load())
+		{
+			refresh();
+		}
+		m_refresh_mutex.unlock();
+	}
+
+	return m_limit.load();
+}
+
+
+void ElasticWorkers::refresh()
+{
+	m_next_refresh = NowMs() + static_cast<int64_t>(REFRESH_MS);
+
+	m_quota = readQuota();
+
+	// Cores the others kept busy since the last refresh, half of it is the one before
+	CoreTimes times;
+	if (readCoreTimes(times))
+	{
+		double elapsed = (times.total - m_last_times.total) / static_cast<double>(m_cores);
+		if (m_times_known && elapsed > 0.0)
+		{
+			double others = std::max(0.0, (times.busy - m_last_times.busy) - (times.own - m_last_times.own)) / elapsed;
+			m_others = (m_others + others) / 2;
+		}
+		m_last_times = times;
+		m_times_known = true;
+	}
+
+	size_t target = m_max_workers;
+	if (m_quota > 0.0)
+	{
+		target = std::min(target, std::max<size_t>(1, static_cast<size_t>(std::llround(m_quota))));
+	}
+
+	double idle = static_cast<double>(m_cores) - m_others;
+	target = std::min(target, std::max<size_t>(1, static_cast<size_t>(std::max(0.0, std::floor(idle + 0.5)))));
+
+	if (target != m_limit.load())
+	{
+		++m_changes;
+		KF_LOG(VERBOSE_INFO, "elastic: %zd of %zd workers (quota %.2f cores, others keep %.1f of our %zd cores busy)\n",
+			target, m_max_workers, m_quota, m_others, m_cores);
+	}
+
+	m_limit = target;
+	m_lowest = std::min(m_lowest, target);
+	m_highest = std::max(m_highest, target);
+}
+
+
+void ElasticWorkers::log() const
+{
+	std::lock_guard<std::mutex> lock(m_refresh_mutex);
+
+	std::ostringstream quota;
+	if (m_quota > 0.0)
+	{
+		quota << "quota " << m_quota << " cores (" << m_cgroup << ")";
+	}
+	else
+	{
+		quota << "no cgroup v2 cpu quota";
+	}
+
+	KF_LOG(VERBOSE_NONE, "elastic: %zd-%zd of %zd workers, %zd changes, %s\n",
+		m_lowest, m_highest, m_max_workers, m_changes, quota.str().c_str());
+
+	CpuStat now;
+	if (m_has_stat && readCpuStat(now))
+	{
+		KF_LOG(VERBOSE_NONE, "elastic: throttled in %llu of %llu periods, %.3fs\n",
+			static_cast<unsigned long long>(now.throttled - m_start_stat.throttled),
+			static_cast<unsigned long long>(now.periods - m_start_stat.periods),
+			(now.throttled_usec - m_start_stat.throttled_usec) / 1e6);
+	}
+}
@@ -0,0 +1,109 @@
+// elastic.hpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// How many of the -t counting threads should run right now (--elastic).
+//
+// -t is only the most there can be. The limit is the CPU quota of the cgroup (cgroup v2 cpu.max, quota / period
+// cores, rounded) and the cores of the affinity mask other tasks leave idle, whichever is lower. Other tasks are
+// measured on those cores only: their busy time in /proc/stat since the last refresh minus the CPU time of this
+// process (getrusage), smoothed. Load on cores the process can't run on doesn't count. It's read again every
+// REFRESH_MS while counting. The work is split into chunks and a worker only asks before taking the next one, so the
+// pool grows and shrinks between chunks and a worker over the limit sleeps until it grows again or the chunks run out.
+//
+// Throttling of the cgroup (cpu.stat) is counted from the start and reported by log() with the limits used.
+// Without cgroup v2 or /proc only -t and the cores of the affinity mask are left.
+//
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+class ElasticWorkers
+{
+public:
+	static const size_t REFRESH_MS{ 250 };
+	// How long a worker over the limit sleeps before asking again
+	static const size_t PARK_MS{ 5 };
+
+	explicit ElasticWorkers(size_t max_workers);
+
+	size_t maxWorkers() const { return m_max_workers; }
+
+	// Between 1 and maxWorkers
+	size_t limit();
+
+	// Called by worker (0 = first) before each chunk, sleeps while it's over the limit. false if work_left says
+	// there's nothing left.
+	template <typename F>
+	bool admit(size_t worker, F work_left)
+	{
+		while (worker >= limit())
+		{
+			if (!work_left())
+			{
+				return false;
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(PARK_MS));
+		}
+
+		return true;
+	}
+
+	// Limits used so far and throttling since the start, at VERBOSE_NONE like the other timings
+	void log() const;
+
+private:
+	struct CpuStat
+	{
+		uint64_t periods{ 0 };
+		uint64_t throttled{ 0 };
+		uint64_t throttled_usec{ 0 };
+	};
+
+	// Busy and all time of the cores in m_cpus in seconds, own is the CPU time of this process
+	struct CoreTimes
+	{
+		double busy{ 0.0 };
+		double total{ 0.0 };
+		double own{ 0.0 };
+	};
+
+	// Directory of the cgroup v2 of the process, empty if there's none
+	static std::string CgroupDir();
+	// Cores of the quota, 0 = no quota
+	double readQuota() const;
+	bool readCpuStat(CpuStat& stat) const;
+	bool readCoreTimes(CoreTimes& times) const;
+
+	void refresh();
+
+	size_t m_max_workers;
+	// The affinity mask, empty if it can't be read (then every core of the machine)
+	std::vector<int> m_cpus;
+	size_t m_cores;
+	std::string m_cgroup;
+	CpuStat m_start_stat;
+	bool m_has_stat{ false };
+
+	std::atomic<size_t> m_limit;
+	std::atomic<int64_t> m_next_refresh{ 0 };
+	mutable std::mutex m_refresh_mutex;
+
+	// Everything below is guarded by m_refresh_mutex
+	double m_quota{ 0.0 };
+	double m_others{ 0.0 };
+	CoreTimes m_last_times;
+	bool m_times_known{ false };
+	size_t m_lowest;
+	size_t m_highest;
+	size_t m_changes{ 0 };
+};
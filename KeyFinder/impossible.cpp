@@ -0,0 +1,206 @@
+// impossible.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Impossible differentials.
+//
+// A zero in the DDT means the sbox can never map that input difference to that output difference, whatever the
+// key is. Pushing the set of reachable differences of a plaintext difference through the rounds (only looking at
+// which DDT entries are non-zero) leaves some nibble differences at the sbox input of a round that no pair can
+// ever have. So if a candidate subkey nibble decrypts any pair into one of them, it's wrong.
+//
+// Unlike the right pairs of a path, every pair with the plaintext difference can do this, and it costs one pass
+// over the codebook per difference, so it runs before the expensive states of recoverRoundSubkey and they only
+// count the subkeys that survived (see SubkeyCandidates).
+//
+#include "keyfinder.hpp"
+
+
+void KeyFinder::prepareImpossible()
+{
+	m_impossible_diffs.assign(SPN::Nr + 1, std::map<uint16_t, std::vector<uint16_t>>());
+
+	// Backward rounds start at the plaintext and go through sbox + permutation, key[0] starts at the ciphertext
+	// and goes through the inverse sbox (transposed DDT) + inverse permutation, both single sbox differences
+	for (bool forward : { false, true })
+	{
+		const auto& diff_table = forward ? m_spn.getTransposedDiffTable() : m_spn.getDiffTable();
+
+		for (size_t sbox_index = 0; sbox_index < 4; ++sbox_index)
+		{
+			for (uint16_t dx = 1; dx <= 0xf; ++dx)
+			{
+				uint16_t input_diff = MakeSbox(sbox_index, dx);
+
+				std::vector<bool> reachable(0x10000, false);
+				reachable[input_diff] = true;
+
+				for (size_t layer = 1; layer < SPN::Nr; ++layer)
+				{
+					for (size_t n = 0; n < 4; ++n)
+					{
+						std::vector<bool> next(0x10000, false);
+						for (uint32_t d = 0; d <= 0xffff; ++d)
+						{
+							if (!reachable[d])
+							{
+								continue;
+							}
+
+							uint16_t in = SboxValue(n, static_cast<uint16_t>(d));
+							uint16_t rest = static_cast<uint16_t>(d) & ~SboxMask(n);
+							for (uint16_t out = 0; out <= 0xf; ++out)
+							{
+								if (diff_table[in][out] != 0)
+								{
+									next[rest | MakeSbox(n, out)] = true;
+								}
+							}
+						}
+						reachable.swap(next);
+					}
+
+					std::vector<bool> next(0x10000, false);
+					for (uint32_t d = 0; d <= 0xffff; ++d)
+					{
+						if (reachable[d])
+						{
+							next[forward ? m_spn.itransp(static_cast<uint16_t>(d)) : m_spn.transp(static_cast<uint16_t>(d))] = true;
+						}
+					}
+					reachable.swap(next);
+
+					// Backward: sbox input of round layer + 1, forward: sbox output of the first round after
+					// going through all the other rounds
+					size_t round_num = forward ? 0 : layer + 1;
+					if (forward && layer != SPN::Nr - 1)
+					{
+						continue;
+					}
+
+					std::vector<uint16_t> impossible(4, 0xffff);
+					for (uint32_t d = 0; d <= 0xffff; ++d)
+					{
+						if (reachable[d])
+						{
+							for (size_t j = 0; j < 4; ++j)
+							{
+								impossible[j] &= ~(1 << SboxValue(j, static_cast<uint16_t>(d)));
+							}
+						}
+					}
+
+					if (impossible[0] != 0 || impossible[1] != 0 || impossible[2] != 0 || impossible[3] != 0)
+					{
+						m_impossible_diffs[round_num][input_diff] = impossible;
+					}
+				}
+			}
+		}
+	}
+}
+
+
+KeyFinder::SubkeyCandidates KeyFinder::pruneImpossible(size_t round_num, const SubkeyCandidates& start) const
+{
+	SubkeyCandidates candidates = start;
+	bool forward = round_num == 0;
+	const PeeledTexts peeled = peeledTexts(forward ? SPN::Nr : round_num);
+
+	for (size_t j = 0; j < 4; ++j)
+	{
+		// The nibble of every text the subkey nibble gets XORed with
+		std::vector<uint16_t> texts(m_pc1.size());
+		for (size_t i = 0; i < m_pc1.size(); ++i)
+		{
+			texts[i] = SboxValue(j, forward ? m_pc1_forward[i] : peeled.permuted(i));
+		}
+
+		for (const auto& p : m_impossible_diffs[round_num])
+		{
+			uint16_t impossible = p.second[j];
+			if (impossible == 0)
+			{
+				continue;
+			}
+
+			for (uint32_t i = 0; i < texts.size() && candidates.count(j) > 1; ++i)
+			{
+				uint32_t other = i ^ p.first;
+				if (other < i)
+				{
+					continue;
+				}
+
+				for (uint16_t k = 0; k <= 0xf; ++k)
+				{
+					if ((candidates.nibble[j] & (1 << k)) == 0)
+					{
+						continue;
+					}
+
+					uint16_t d = forward ?
+						(m_spn.subst(texts[i] ^ k) ^ m_spn.subst(texts[other] ^ k)) & 0xf :
+						(m_spn.isubst(texts[i] ^ k) ^ m_spn.isubst(texts[other] ^ k)) & 0xf;
+
+					if ((impossible & (1 << d)) != 0)
+					{
+						candidates.nibble[j] &= ~(1 << k);
+					}
+				}
+			}
+		}
+
+		// Only happens when the subkeys we peeled with (or the constraints) are wrong
+		if (candidates.nibble[j] == 0)
+		{
+			KF_LOG(VERBOSE_NONE, "impossible: every value of key[%zd] nibble %zd is impossible, not pruning it\n", round_num, j);
+			candidates.nibble[j] = start.nibble[j];
+		}
+	}
+
+	KF_LOG(VERBOSE_INFO, "impossible: key[%zd] candidates left per nibble: %zd %zd %zd %zd\n",
+		round_num, candidates.count(0), candidates.count(1), candidates.count(2), candidates.count(3));
+
+	return candidates;
+}
+
+
+std::set<uint16_t> KeyFinder::genCandidateSubkeys(uint16_t mask, size_t round_num, const SubkeyCandidates& candidates) const
+{
+	std::set<uint16_t> subkeys = genSubkeysSet(mask);
+
+	// Candidates for nibbles of itransp(subkey) only say something about whole subkeys, known bits and listed subkeys
+	// go back through the permutation bit by bit though
+	bool permuted = candidates.permuted && round_num != 0 && round_num != SPN::Nr;
+	if (permuted && mask != 0xffff)
+	{
+		SubkeyCandidates bits;
+		bits.constrain(m_spn.transp(candidates.known_mask), m_spn.transp(candidates.known_value));
+		for (uint16_t k : candidates.subkeys)
+		{
+			bits.subkeys.push_back(m_spn.transp(k));
+		}
+
+		for (auto it = subkeys.begin(); it != subkeys.end();)
+		{
+			it = bits.allows(*it, mask) ? std::next(it) : subkeys.erase(it);
+		}
+
+		return subkeys;
+	}
+
+	for (auto it = subkeys.begin(); it != subkeys.end();)
+	{
+		if (candidates.allows(permuted ? m_spn.itransp(*it) : *it, mask))
+		{
+			++it;
+		}
+		else
+		{
+			it = subkeys.erase(it);
+		}
+	}
+
+	return subkeys;
+}
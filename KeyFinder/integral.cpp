@@ -0,0 +1,271 @@
+// integral.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Integral (square) attack on the outer rounds.
+//
+// Take all the plaintexts that differ only in a few "active" nibbles (a structure, the codebook has every one
+// of them). With one active nibble, the S-box input of the last round XORs to zero over the 16 texts of the
+// structure, so for the right key[4] nibble the partially decrypted nibbles sum to 0 in every structure while
+// a wrong one only does so in about 1/16 of them.
+//
+// One round further in the zero sum is useless: every nibble value shows up an odd number of times or an even
+// number of times all together, so any key guess sums to zero (the same goes for bigger structures). What does
+// hold there is that only one bit of every nibble of u2 changes, so the nibbles of u3 take values from an
+// affine subspace, and a wrong key[3] guess usually breaks that. Two active nibbles do the same for key[2].
+//
+// Which structure and property work for which round and nibble depends on the S-box and the permutation,
+// so it's checked on random keys before the attack (prepareIntegral) instead of being hardcoded. For a given key
+// the structures can still let wrong values through in all of them, getIntegralSubkey checks that on the codebook.
+//
+#include "keyfinder.hpp"
+
+#include <random>
+
+
+namespace
+{
+	// Do the values (bit i set = value i is there) make an affine subspace
+	bool IsAffine(uint32_t present)
+	{
+		uint16_t base = 0;
+		while ((present & (1u << base)) == 0)
+		{
+			++base;
+		}
+
+		for (uint16_t a = 0; a <= 0xf; ++a)
+		{
+			for (uint16_t b = 0; b <= 0xf; ++b)
+			{
+				if ((present & (1u << a)) != 0 && (present & (1u << b)) != 0 && (present & (1u << (a ^ b ^ base))) == 0)
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	bool PropertyHolds(KeyFinder::IntegralProperty property, const uint16_t* values, size_t count)
+	{
+		uint16_t sum = 0;
+		uint32_t present = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			sum ^= values[i];
+			present |= 1u << values[i];
+		}
+
+		return property == KeyFinder::INTEGRAL_AFFINE ? IsAffine(present) : sum == 0;
+	}
+}
+
+
+void KeyFinder::prepareIntegral()
+{
+	m_integral_structures.assign(SPN::Nr + 1, std::vector<IntegralStructure>(4));
+
+	std::mt19937 rng(0x5eed);
+	std::uniform_int_distribution<uint32_t> dist(0, 0xffff);
+
+	for (size_t round_num = 2; round_num <= SPN::Nr; ++round_num)
+	{
+		for (size_t sbox_index = 0; sbox_index < 4; ++sbox_index)
+		{
+			IntegralStructure& found = m_integral_structures[round_num][sbox_index];
+
+			// Smallest structures first, all of the same size that hold are used, because for a fixed key
+			// a single one may never catch some wrong keys
+			for (size_t active_count = 1; active_count <= 3 && found.states.empty(); ++active_count)
+			{
+				for (IntegralProperty property : { INTEGRAL_ZERO_SUM, INTEGRAL_AFFINE })
+				{
+					std::vector<uint16_t> states;
+					// Bit delta set = key ^ delta failed at least once
+					uint32_t wrong_failed = 0;
+
+					for (uint16_t state = 1; state <= 0xf; ++state)
+					{
+						SboxState s(state);
+						if (s.active.count() != active_count)
+						{
+							continue;
+						}
+
+						bool holds = true;
+						size_t state_passed = 0;
+						size_t state_tried = 0;
+						uint32_t state_failed = 0;
+
+						for (size_t trial = 0; trial < INTEGRAL_CHECK_KEYS && holds; ++trial)
+						{
+							std::vector<uint16_t> subkeys(SPN::Nr + 1);
+							for (uint16_t& k : subkeys)
+							{
+								k = static_cast<uint16_t>(dist(rng));
+							}
+
+							uint16_t constant = static_cast<uint16_t>(dist(rng)) & ~s.mask;
+
+							// What the attacker sees is sbox(nibble of the sbox input of round_num) ^ key
+							std::vector<uint16_t> seen;
+							for (uint16_t a : genSubkeysSet(s.mask))
+							{
+								uint16_t x = (constant | a) ^ subkeys[0];
+								for (size_t r = 1; r < round_num; ++r)
+								{
+									x = m_spn.transp(m_spn.subst(x)) ^ subkeys[r];
+								}
+								seen.push_back(m_spn.subst(SboxValue(sbox_index, x)) & 0xf);
+							}
+
+							// Right key (delta = 0) and every wrong one
+							std::vector<uint16_t> values(seen.size());
+							for (uint16_t delta = 0; delta <= 0xf; ++delta)
+							{
+								for (size_t i = 0; i < seen.size(); ++i)
+								{
+									values[i] = m_spn.isubst(seen[i] ^ delta) & 0xf;
+								}
+
+								bool passed = PropertyHolds(property, values.data(), values.size());
+								if (delta == 0)
+								{
+									holds = passed;
+								}
+								else
+								{
+									++state_tried;
+									state_passed += passed ? 1 : 0;
+									state_failed |= passed ? 0 : 1u << delta;
+								}
+							}
+						}
+
+						// Structures where wrong keys pass too often only add noise
+						if (holds && state_passed * 2 < state_tried)
+						{
+							states.push_back(state);
+							wrong_failed |= state_failed;
+						}
+					}
+
+					// Together they have to tell every wrong key apart
+					if (!states.empty() && wrong_failed == 0xfffe)
+					{
+						found.states = states;
+						found.property = property;
+						break;
+					}
+				}
+			}
+
+			if (Log::enabled(VERBOSE_MEDIUM))
+			{
+				Log::write("integral: key[%zd] nibble %zd uses %s on structures", round_num, sbox_index, found.property == INTEGRAL_AFFINE ? "affine" : "zero sum");
+				for (uint16_t state : found.states)
+				{
+					Log::write(" %04hx", SboxState(state).mask);
+				}
+				Log::write("\n");
+			}
+		}
+	}
+}
+
+
+bool KeyFinder::isIntegralRound(size_t round_num) const
+{
+	if (round_num >= m_integral_structures.size())
+	{
+		return false;
+	}
+
+	for (const IntegralStructure& structure : m_integral_structures[round_num])
+	{
+		if (structure.states.empty())
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::getIntegralSubkey(size_t round_num, const SboxState& wanted_sbox, const SubkeyCandidates& candidates) const
+{
+	std::map<uint16_t, size_t> hist;
+
+	size_t sbox_index = FindSbox(wanted_sbox.mask)[0];
+	const IntegralStructure& structure = m_integral_structures[round_num][sbox_index];
+	size_t per_state = (INTEGRAL_STRUCTURES + structure.states.size() - 1) / structure.states.size();
+
+	const PeeledTexts peeled = peeledTexts(round_num);
+	std::vector<uint16_t> seen;
+	std::vector<uint16_t> values;
+	size_t counted = 0;
+
+	for (uint16_t state : structure.states)
+	{
+		SboxState active(state);
+		auto active_values = genSubkeysSet(active.mask);
+
+		// Spread the structures evenly over the constants of the inactive nibbles
+		auto constants = genSubkeysSet(static_cast<uint16_t>(~active.mask));
+		size_t step = std::max<size_t>(1, constants.size() / per_state);
+
+		KF_LOG(VERBOSE_INFO, "integral: key[%zd] nibble %zd with %zd structures of %zd texts\n",
+			round_num, sbox_index, std::min(constants.size(), per_state), active_values.size());
+
+		values.resize(active_values.size());
+
+		size_t index = 0;
+		for (uint16_t constant : constants)
+		{
+			if ((index++ % step) != 0)
+			{
+				continue;
+			}
+
+			++counted;
+			seen.clear();
+			for (uint16_t a : active_values)
+			{
+				seen.push_back(SboxValue(sbox_index, peeled.permuted(constant | a)));
+			}
+
+			for (uint16_t k = 0; k <= 0xf; ++k)
+			{
+				for (size_t i = 0; i < seen.size(); ++i)
+				{
+					values[i] = m_spn.isubst(seen[i] ^ k) & 0xf;
+				}
+
+				if (PropertyHolds(structure.property, values.data(), values.size()))
+				{
+					hist[MakeSbox(sbox_index, k)] += 1;
+				}
+			}
+		}
+	}
+
+	candidates.filter(hist, wanted_sbox.mask);
+
+	// The right value holds in every structure, so does a wrong one the structures can't tell from it for this key
+	size_t held = 0;
+	for (const auto& p : hist)
+	{
+		held += p.second == counted ? 1 : 0;
+	}
+
+	if (held != 1)
+	{
+		KF_LOG(VERBOSE_INFO, "integral: key[%zd] nibble %zd holds for %zd values in all %zd structures\n", round_num, sbox_index, held, counted);
+		hist.clear();
+	}
+
+	return hist;
+}
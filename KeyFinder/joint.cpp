@@ -0,0 +1,146 @@
+// joint.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Joint differential and linear ranking of the outer subkey nibbles.
+//
+// Every nibble is counted by both engines on the paths to its own sbox, the right pairs of the differential
+// paths and the correlations of the linear ones. Neither has to be enough on its own: each count becomes the log
+// likelihood ratio of the value being the right one against a wrong one, and as the two statistics come from
+// different properties of the texts, the ratios of a value just add up.
+//
+// Differential: the count of a value is Poisson, a wrong one gets lambda_w right pairs by chance (the median of
+// the values, most of them are wrong) and the right one p * pairs on top of that:
+//		LLR = count * ln(lambda_r / lambda_w) - (lambda_r - lambda_w)
+// Linear: the count is |C| over T texts, C is normal with variance T around 0 for a wrong value and around
+// +-T * c for the right one:
+//		LLR = ln cosh(|C| * c) - T * c^2 / 2
+//
+// The sum goes back as a histogram like the other engines return (shifted to start at 0, JOINT_SCALE per nat), so
+// the margins, getProbableSboxBits and checkSubkey rank the values by it as they are.
+//
+#include "keyfinder.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+// std::max takes it by reference
+constexpr double KeyFinder::JOINT_MIN_WRONG_PAIRS;
+
+
+namespace
+{
+	double LogCosh(double x)
+	{
+		x = std::abs(x);
+		return x + std::log1p(std::exp(-2.0 * x)) - std::log(2.0);
+	}
+
+	double Median(std::vector<double> values)
+	{
+		std::sort(values.begin(), values.end());
+		size_t half = values.size() / 2;
+		return values.size() % 2 == 1 ? values[half] : (values[half - 1] + values[half]) / 2;
+	}
+}
+
+
+bool KeyFinder::isJointRound(size_t round_num) const
+{
+	return round_num == 0 || round_num == SPN::Nr;
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::getJointSubkey(size_t round_num, const SboxState& wanted_sbox, const SubkeyCandidates& candidates) const
+{
+	size_t sbox_index = FindSbox(wanted_sbox.mask)[0];
+	double texts = static_cast<double>(m_pc1.size());
+
+	std::vector<uint16_t> values;
+	for (uint16_t v = 0; v <= 0xf; ++v)
+	{
+		if (candidates.allows(MakeSbox(sbox_index, v), wanted_sbox.mask))
+		{
+			values.push_back(v);
+		}
+	}
+
+	std::map<uint16_t, size_t> hist;
+	if (values.empty())
+	{
+		return hist;
+	}
+
+	double llr[16] = { 0.0 };
+	for (Engine engine : { ENGINE_DIFFERENTIAL, ENGINE_LINEAR })
+	{
+		bool forward = false;
+		size_t path_round_num = round_num;
+		double engine_llr[16] = { 0.0 };
+
+		for (const Path& path : selectPaths(round_num, wanted_sbox, forward, path_round_num, engine))
+		{
+			std::map<uint16_t, size_t> counted = countPath(round_num, path_round_num, path, forward, engine, candidates);
+
+			double counts[16] = { 0.0 };
+			for (const auto& p : counted)
+			{
+				counts[SboxValue(sbox_index, p.first)] = static_cast<double>(p.second);
+			}
+
+			if (engine == ENGINE_DIFFERENTIAL)
+			{
+				std::vector<double> allowed_counts;
+				for (uint16_t v : values)
+				{
+					allowed_counts.push_back(counts[v]);
+				}
+
+				// A wrong value with no pairs at all would make a single pair infinitely likely
+				double wrong = std::max(Median(allowed_counts), JOINT_MIN_WRONG_PAIRS);
+				double right = wrong + path.probability * texts / 2;
+
+				for (uint16_t v : values)
+				{
+					engine_llr[v] += counts[v] * std::log(right / wrong) - (right - wrong);
+				}
+			}
+			else
+			{
+				for (uint16_t v : values)
+				{
+					engine_llr[v] += LogCosh(counts[v] * path.probability) - texts * path.probability * path.probability / 2;
+				}
+			}
+		}
+
+		if (Log::enabled(VERBOSE_MEDIUM))
+		{
+			Log::write("joint: key[%zd] nibble %zd %s LLR", round_num, sbox_index, engine == ENGINE_LINEAR ? "linear" : "differential");
+			for (uint16_t v : values)
+			{
+				Log::write(" %x:%.1lf", v, engine_llr[v]);
+			}
+			Log::write("\n");
+		}
+
+		for (uint16_t v : values)
+		{
+			llr[v] += engine_llr[v];
+		}
+	}
+
+	double lowest = llr[values[0]];
+	for (uint16_t v : values)
+	{
+		lowest = std::min(lowest, llr[v]);
+	}
+
+	for (uint16_t v : values)
+	{
+		hist[MakeSbox(sbox_index, v)] = static_cast<size_t>(std::llround((llr[v] - lowest) * JOINT_SCALE));
+	}
+
+	return hist;
+}
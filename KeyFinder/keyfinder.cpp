@@ -10,43 +10,84 @@
 #include <iostream>
 #include <chrono>
 #include <thread>
+#include <atomic>
 #include <mutex>
+#include <algorithm>
+#include <cmath>
 
 
-KeyFinder::KeyFinder(const std::string& ct_file, SPN& spn, size_t num_of_threads, bool compute_3_sboxes, bool compute_4_sboxes) :
+KeyFinder::KeyFinder(const std::string& ct_file, SPN& spn, size_t num_of_threads, bool compute_3_sboxes, bool compute_4_sboxes, bool shared_cache) :
+	KeyFinder(ReadCodebook(ct_file), spn, num_of_threads, compute_3_sboxes, compute_4_sboxes, shared_cache)
+{
+}
+
+
+KeyFinder::KeyFinder(const std::vector<uint16_t>& ciphertexts, SPN& spn, size_t num_of_threads, bool compute_3_sboxes, bool compute_4_sboxes, bool shared_cache) :
 	m_spn{ spn },
+	m_pc1{ ciphertexts },
 	m_pc1_forward { std::vector<uint16_t>(65536, 0) },
 	m_subkeys{ std::vector<uint16_t>(SPN::Nr + 1, 0) },
 	m_compute_3_sboxes{ compute_3_sboxes },
 	m_compute_4_sboxes{ compute_4_sboxes },
-	m_num_of_threads{ num_of_threads }
+	m_num_of_threads{ num_of_threads },
+	m_constraints{ std::vector<SubkeyCandidates>(SPN::Nr + 1) }
+{
+	for (size_t pt = 0; pt < m_pc1.size(); ++pt)
+	{
+		m_pc1_forward[m_pc1[pt]] = static_cast<uint16_t>(pt);
+	}
+
+	if (shared_cache)
+	{
+		attachSharedCache();
+	}
+
+	planMemory();
+
+	// Only the expensive states are worth pruning for, see planRound
+	if (m_compute_3_sboxes && m_impossible_diffs.empty())
+	{
+		prepareImpossible();
+	}
+}
+
+
+std::vector<uint16_t> KeyFinder::ReadCodebook(const std::string& ct_file)
 {
 	std::ifstream ct_list(ct_file);
 	if (!ct_list.is_open())
 	{
-		std::cerr << "could not open file " << ct_file << '\n';
+		KF_LOG(VERBOSE_NONE, "could not open file %s\n", ct_file.c_str());
 		exit(0xdeadf00d);
 	}
 
+	std::vector<uint16_t> ciphertexts;
 	std::string line;
-	uint16_t pt = 0;
 	while (std::getline(ct_list, line))
 	{
 		uint16_t ct = 0;
 		if (sscanf(line.c_str(), "%04hx", &ct) != 1)
 		{
-			std::cerr << "could not parse line\n";
+			KF_LOG(VERBOSE_NONE, "could not parse line\n");
 			exit(0xcafebabe);
 		}
 
-		m_pc1.push_back(ct);
-		m_pc1_forward[ct] = pt++;
+		ciphertexts.push_back(ct);
 	}
+
+	return ciphertexts;
 }
 
 
 std::string KeyFinder::getKeyStr() const
 {
+	// With a real key schedule the master key, if the subkeys give all of it
+	KeySchedule::Row master;
+	if (!m_spn.getKeySchedule().isIndependent() && getMasterKey(master))
+	{
+		return m_spn.getKeySchedule().keyStr(master);
+	}
+
 	std::string key;
 
 	for (uint16_t subkey : m_subkeys)
@@ -64,65 +105,110 @@ bool KeyFinder::testKey(const std::string& key) const
 {
 	m_spn.keysched(key.c_str());
 
-	for (size_t i = 0; i < m_pc1.size(); ++i)
+	std::vector<uint16_t> texts(m_pc1.size());
+	for (size_t i = 0; i < texts.size(); ++i)
 	{
-		if (m_spn.encrypt(static_cast<uint16_t>(i)) != m_pc1[i])
-		{
-			return false;
-		}
+		texts[i] = static_cast<uint16_t>(i);
 	}
+	m_spn.encryptBlocks(texts.data(), texts.data(), texts.size());
 
-	return true;
+	return texts == m_pc1;
 }
 
 
-uint16_t KeyFinder::recoverFirstSubkey()
+bool KeyFinder::recoverFirstSubkey(uint16_t& subkey)
 {
 	if (m_compute_3_sboxes || m_compute_4_sboxes)
 	{
-		if (m_verbose)
-		{
-			fprintf(stderr, "turning off 3 and 4 sboxes for key[0] for performance reasons\n");
-		}
+		KF_LOG(VERBOSE_INFO, "turning off 3 and 4 sboxes for key[0] for performance reasons\n");
 
 		m_compute_3_sboxes = false;
 		m_compute_4_sboxes = false;
 	}
 
-	uint16_t subkey = recoverRoundSubkey(0);
+	bool recovered = recoverRoundSubkey(0, subkey);
 
 	m_compute_3_sboxes = true;
 	m_compute_4_sboxes = true;
 
-	return subkey;
+	return recovered;
 }
 
 
 uint16_t KeyFinder::recoverSecondSubkey() const
 {
-	std::cerr << "looking for key[1]..\n";
+	KF_LOG(VERBOSE_NONE, "looking for key[1]..\n");
 
 	auto start = std::chrono::steady_clock::now();
 
-	std::vector<uint16_t> subkeys = m_subkeys;
-	uint16_t key1 = 0;
+	std::vector<uint16_t> candidates;
 	for (uint32_t x = 0; x <= 0xffff; ++x)
 	{
-		subkeys[1] = x;
-		uint16_t ct = m_pc1[x];
-		if (m_spn.decryptWithKeys(ct, subkeys) == x)
+		if (isAllowedSubkey(1, static_cast<uint16_t>(x)))
 		{
-			fprintf(stderr, "found key[1] = %04hx\n", static_cast<uint16_t>(x));
-			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
-			std::cerr << "took: " << elapsed.count() / 1000.0f << "s\n";
+			candidates.push_back(static_cast<uint16_t>(x));
+		}
+	}
 
-			return x;
+	// Bitsliced, lane i decrypts the ciphertext of plaintext x with key[1] = x, the right one gets x back
+	const SboxCircuit& circuit = m_spn.getInverseCircuit();
+	uint16_t key1 = 0;
+	for (size_t first = 0; first < candidates.size(); first += 64)
+	{
+		size_t n = std::min<size_t>(64, candidates.size() - first);
+		const uint16_t* keys = &candidates[first];
+
+		uint16_t texts[64];
+		for (size_t i = 0; i < n; ++i)
+		{
+			texts[i] = m_pc1[keys[i]];
+		}
+
+		uint64_t x[16];
+		uint64_t y[16];
+		uint64_t key1_slices[16];
+		SPN::ToSlices(texts, n, x);
+		SPN::ToSlices(keys, n, key1_slices);
+
+		SPN::XorKeySliced(x, m_subkeys[SPN::Nr]);
+		SPN::SubstSliced(circuit, x);
+		for (size_t r = SPN::Nr - 1; r >= 1; --r)
+		{
+			if (r == 1)
+			{
+				for (size_t i = 0; i < 16; ++i)
+				{
+					x[i] ^= key1_slices[i];
+				}
+			}
+			else
+			{
+				SPN::XorKeySliced(x, m_subkeys[r]);
+			}
+
+			m_spn.getPermutation().applyInverseSliced(x, y);
+			SPN::SubstSliced(circuit, y);
+			std::copy(y, y + 16, x);
+		}
+		SPN::XorKeySliced(x, m_subkeys[0]);
+
+		SPN::FromSlices(x, texts, n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (texts[i] == keys[i])
+			{
+				KF_LOG(VERBOSE_NONE, "found key[1] = %04hx\n", keys[i]);
+				auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+				KF_LOG(VERBOSE_NONE, "took: %gs\n", elapsed.count() / 1000.0f);
+
+				return keys[i];
+			}
 		}
 	}
 
-	if (m_verbose)
+	if (Log::enabled(VERBOSE_INFO))
 	{
-		std::cerr << "could not find key[1]\n";
+		Log::write("could not find key[1]\n");
 		exit(0xbabebabe);
 	}
 
@@ -130,317 +216,1144 @@ uint16_t KeyFinder::recoverSecondSubkey() const
 }
 
 
-uint16_t KeyFinder::recoverLastSubkey()
+bool KeyFinder::recoverLastSubkey(uint16_t& subkey)
 {
 	if (m_compute_3_sboxes || m_compute_4_sboxes)
 	{
-		if (m_verbose)
-		{
-			fprintf(stderr, "turning off 3 and 4 sboxes for key[0] for performance reasons\n");
-		}
+		KF_LOG(VERBOSE_INFO, "turning off 3 and 4 sboxes for key[0] for performance reasons\n");
 
 		m_compute_3_sboxes = false;
 		m_compute_4_sboxes = false;
 	}
 
-	uint16_t subkey = recoverRoundSubkey(4);
+	bool recovered = recoverRoundSubkey(4, subkey);
 
 	m_compute_3_sboxes = true;
 	m_compute_4_sboxes = true;
 
-	return subkey;
+	return recovered;
+}
+
+
+bool KeyFinder::recoverAllSubkeys()
+{
+	uint16_t key4 = 0;
+	if (!recoverLastSubkey(key4))
+	{
+		return false;
+	}
+	learnSubkey(SPN::Nr, key4);
+
+	KF_LOG(VERBOSE_NONE, "key[%zd]=%04hx\n", SPN::Nr, key4);
+
+	// Dont ever do round >= 1 here
+	for (size_t round = SPN::Nr - 1; round > 1; --round)
+	{
+		uint16_t subkey = 0;
+		if (!recoverRoundSubkey(round, subkey))
+		{
+			return false;
+		}
+		learnSubkey(round, subkey);
+		KF_LOG(VERBOSE_NONE, "key[%zd]=%04hx\n", round, subkey);
+	}
+
+	uint16_t key0 = 0;
+	if (!recoverFirstSubkey(key0))
+	{
+		return false;
+	}
+	learnSubkey(0, key0);
+
+	KF_LOG(VERBOSE_NONE, "key[0]=%04hx\n", key0);
+
+	uint16_t key1 = recoverSecondSubkey();
+	learnSubkey(1, key1);
+
+	KF_LOG(VERBOSE_NONE, "key[1]=%04hx\n", key1);
+
+	return true;
 }
 
 
-uint16_t KeyFinder::recoverRoundSubkey(size_t round_num) const
+bool KeyFinder::recoverRoundSubkey(size_t round_num, uint16_t& subkey) const
 {
 	// If you use this function with round_num = 1, you deserve what's coming
-	std::cerr << "guessing key[" << round_num << "]..\n";
+	KF_LOG(VERBOSE_NONE, "guessing key[%zd]..\n", round_num);
+
+	return recoverPlannedSubkey(round_num, planRound(round_num), subkey);
+}
+
+
+bool KeyFinder::recoverPlannedSubkey(size_t round_num, const RoundPlan& plan, uint16_t& subkey) const
+{
 	auto start = std::chrono::steady_clock::now();
 
-	std::map<uint16_t, std::map<uint16_t, size_t>> sbox_state_to_key_hist;
-	for (uint16_t state = 1; state <= 0xf; ++state)
+	// pruneImpossible and the engines other than the differential one guess itransp(subkey) in the middle rounds
+	bool middle = round_num != 0 && round_num != SPN::Nr;
+	SubkeyCandidates candidates = getConstraints(round_num, middle && (plan.prune_impossible || plan.engine != ENGINE_DIFFERENTIAL));
+	if (plan.prune_impossible)
 	{
-		SboxState s(state);
+		candidates = pruneImpossible(round_num, candidates);
+	}
 
-		switch (s.active.count())
+	// Nothing left to count
+	if (candidates.count(0) == 1 && candidates.count(1) == 1 && candidates.count(2) == 1 && candidates.count(3) == 1)
+	{
+		uint16_t only = 0;
+		for (size_t i = 0; i < 4; ++i)
 		{
-		case 1:
-		case 2:
+			for (uint16_t v = 0; v <= 0xf; ++v)
+			{
+				if ((candidates.nibble[i] & (1 << v)) != 0)
+				{
+					only |= MakeSbox(i, v);
+				}
+			}
+		}
+
+		if (candidates.permuted && middle)
 		{
-			sbox_state_to_key_hist.insert(std::make_pair(state, getProbableSubkey(round_num, s)));
-			break;
+			only = m_spn.transp(only);
 		}
-		case 3:
+
+		if (isAllowedSubkey(round_num, only))
 		{
-			if (m_compute_3_sboxes)
+			KF_LOG(VERBOSE_NONE, "guessed key[%zd] = %04hx (only candidate %s)\n", round_num, only,
+				plan.prune_impossible ? "without impossible differentials" : "allowed by the constraints");
+
+			subkey = only;
+			return true;
+		}
+	}
+
+	// Cheaper states go first, so we can stop before the expensive ones if the calibration says it's safe
+	std::map<uint16_t, std::map<uint16_t, size_t>> sbox_state_to_key_hist;
+	for (size_t active_count = 1; active_count <= plan.max_active_sboxes; ++active_count)
+	{
+		for (uint16_t state = 1; state <= 0xf; ++state)
+		{
+			SboxState s(state);
+			if (s.active.count() != active_count)
+			{
+				continue;
+			}
+
+			if (active_count >= 3)
+			{
+				KF_LOG(VERBOSE_INFO, "doing %zd sboxes for key[%zd]\n", active_count, round_num);
+			}
+
+			auto hist = getProbableSubkey(round_num, s, plan.engine, candidates);
+
+			// The structures were picked on random keys, for this one they may not decide the nibble
+			if (plan.engine == ENGINE_INTEGRAL && hist.empty())
 			{
-				fprintf(stderr, "doing 3 sboxes for key[%zd]\n", round_num);
-				sbox_state_to_key_hist.insert(std::make_pair(state, getProbableSubkey(round_num, s)));
+				KF_LOG(VERBOSE_NONE, "key[%zd]: integral structures don't decide sboxes %04hx, using differential\n", round_num, s.mask);
+				return recoverPlannedSubkey(round_num, planRound(round_num, ENGINE_DIFFERENTIAL), subkey);
 			}
-			break;
+
+			sbox_state_to_key_hist.insert(std::make_pair(state, hist));
 		}
-		case 4:
+
+		if (active_count < plan.max_active_sboxes && plan.stop_margin[active_count] >= 0)
+		{
+			double margin = 1.0;
+			for (size_t i = 0; i < 4; ++i)
+			{
+				margin = std::min(margin, getSboxMargin(i, sbox_state_to_key_hist));
+			}
+
+			KF_LOG(VERBOSE_INFO, "key[%zd] margin after %zd sboxes: %lf (calibrated: %lf)\n", round_num, active_count, margin, plan.stop_margin[active_count]);
+
+			if (margin > plan.stop_margin[active_count])
+			{
+				KF_LOG(VERBOSE_INFO, "stopping key[%zd] early after %zd sboxes\n", round_num, active_count);
+				break;
+			}
+		}
+	}
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	KF_LOG(VERBOSE_NONE, "took: %gs\n", elapsed.count() / 1000.0f);
+
+	std::vector<std::vector<HistReturn>> bits;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		bits.push_back(getProbableSboxBits(i, sbox_state_to_key_hist));
+	}
+
+	// The other engines count every nibble on its own, fixing some doesn't change the rest
+	if (plan.engine == ENGINE_DIFFERENTIAL)
+	{
+		recountAmbiguous(round_num, candidates, sbox_state_to_key_hist, bits);
+	}
+
+	uint16_t guessed = 0;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		size_t low = (3 - i) * 4;
+
+		if (bits[i].size() > 1)
 		{
-			if (m_compute_4_sboxes)
+			if (Log::enabled(VERBOSE_INFO))
 			{
-				fprintf(stderr, "doing 4 sboxes for key[%zd]\n", round_num);
-				sbox_state_to_key_hist.insert(std::make_pair(state, getProbableSubkey(round_num, s)));
+				Log::write("potential key[%zd] bits %zd-%zd values:\n", round_num, low, low + 3);
+				for (const auto& p : bits[i])
+				{
+					Log::write("\tkey=%04hx, count=%zd\n", p.key, p.value);
+				}
+
+				Log::write("using the first one\n");
 			}
-			break;
+
+			guessed |= bits[i][0].key;
 		}
-		default:
+		else if (bits[i].size() == 1)
 		{
-			// This should never happen
-			break;
+			KF_LOG(VERBOSE_INFO, "found key[%zd] bits %zd-%zd: %04hx\n", round_num, low, low + 3, bits[i][0].key);
+
+			guessed |= bits[i][0].key;
 		}
+		else
+		{
+			KF_LOG(VERBOSE_NONE, "no key[%zd] bits %zd-%zd could be guessed\n", round_num, low, low + 3);
+			return false;
 		}
 	}
 
-	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
-	std::cerr << "took: " << elapsed.count() / 1000.0f << "s\n";
+	// Other engines than the differential one guess the middle subkeys moved through the permutation
+	bool permuted = plan.engine != ENGINE_DIFFERENTIAL && round_num != 0 && round_num != SPN::Nr;
+	if (permuted)
+	{
+		KF_LOG(VERBOSE_INFO, "permuted key[%zd] = %04hx\n", round_num, guessed);
+		guessed = m_spn.transp(guessed);
+	}
+
+	KF_LOG(VERBOSE_NONE, "guessed key[%zd] = %04hx\n", round_num, guessed);
+
+	subkey = checkSubkey(round_num, guessed, sbox_state_to_key_hist, bits, permuted);
+	return true;
+}
+
+
+std::vector<KeyFinder::HistReturn> KeyFinder::getProbableSboxBits(size_t sbox_index, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist) const
+{
+	return findMaxInHist(combineSboxBits(sbox_index, sbox_state_to_key_hist));
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::combineSboxBits(size_t sbox_index, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist) const
+{
+	std::map<uint16_t, size_t> main = sbox_state_to_key_hist.at((1 << (3 - sbox_index)));
+
+	for (const auto& p : sbox_state_to_key_hist)
+	{
+		SboxState s(p.first);
+
+		// Don't do a configuration that doesn't have the wanted sbox active
+		// So, if we want sbox 0 active, don't pick 0b0001 etc.
+		if (s.active.count() < 2 || !s.active[3 - sbox_index])
+		{
+			continue;
+		}
+
+		// Combine their statistics with masked key for what we want
+		auto res = findMaxInHist(p.second);
+		for (const HistReturn& r : res)
+		{
+			main[r.key & SboxMask(sbox_index)] += r.value;
+		}
+	}
+
+	return main;
+}
+
+
+double KeyFinder::getSboxMargin(size_t sbox_index, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist) const
+{
+	size_t best = 0;
+	size_t second = 0;
+
+	for (const auto& p : combineSboxBits(sbox_index, sbox_state_to_key_hist))
+	{
+		if (p.second > best)
+		{
+			second = best;
+			best = p.second;
+		}
+		else if (p.second > second)
+		{
+			second = p.second;
+		}
+	}
+
+	if (best == 0)
+	{
+		return 0.0;
+	}
+
+	return static_cast<double>(best - second) / best;
+}
+
+
+void KeyFinder::recountAmbiguous(size_t round_num, const SubkeyCandidates& candidates, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist, std::vector<std::vector<HistReturn>>& bits) const
+{
+	// The differential kernels guess the real subkey nibbles, middle round candidates from pruneImpossible
+	// are nibbles of itransp(subkey), so only the constraints can be kept
+	SubkeyCandidates fixed = candidates.permuted ? getConstraints(round_num, false) : candidates;
+
+	uint16_t ambiguous = 0;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		if (bits[i].size() != 1 || getSboxMargin(i, sbox_state_to_key_hist) < RECOUNT_MIN_MARGIN)
+		{
+			ambiguous |= 1 << (3 - i);
+		}
+		else
+		{
+			fixed.nibble[i] = 1 << SboxValue(i, bits[i][0].key);
+		}
+	}
+
+	// Nothing to fix or nothing to recount
+	if (ambiguous == 0 || ambiguous == 0xf)
+	{
+		return;
+	}
+
+	KF_LOG(VERBOSE_INFO, "recounting key[%zd] sboxes %04hx with the others fixed\n", round_num, SboxState(ambiguous).mask);
+
+	// Every state touching an ambiguous nibble, the fixed ones only filter pairs and cost no key trials, so
+	// this goes up to 4 active sboxes as long as there are at most RECOUNT_MAX_GUESSED sboxes to guess
+	std::map<uint16_t, std::map<uint16_t, size_t>> recount;
+	for (uint16_t state = 1; state <= 0xf; ++state)
+	{
+		SboxState s(state);
+		size_t guessed = std::bitset<4>(state & ambiguous).count();
+		if (guessed == 0 || guessed > RECOUNT_MAX_GUESSED)
+		{
+			continue;
+		}
+
+		recount.insert(std::make_pair(state, getProbableSubkey(round_num, s, ENGINE_DIFFERENTIAL, fixed)));
+	}
+
+	for (size_t i = 0; i < 4; ++i)
+	{
+		if ((ambiguous & (1 << (3 - i))) == 0)
+		{
+			continue;
+		}
+
+		auto recounted = getProbableSboxBits(i, recount);
+		if (recounted.empty())
+		{
+			continue;
+		}
+
+		KF_LOG(VERBOSE_INFO, "recounted key[%zd] sbox %zd: %04hx (was %04hx, %zd candidates)\n",
+			round_num, i, recounted[0].key, bits[i].empty() ? 0 : bits[i][0].key, bits[i].size());
+
+		bits[i] = recounted;
+	}
+}
+
+
+double KeyFinder::measureSubkey(size_t round_num, uint16_t subkey, const Path& path, bool forward) const
+{
+	const auto& main = forward ? m_pc1_forward : m_pc1;
+
+	// Every unordered pair once, same as genPairs, a wrong subkey leaves about one pair in 2^16
+	size_t observed = 0;
+	for (size_t i = 0; i < main.size(); ++i)
+	{
+		if ((static_cast<uint16_t>(i) ^ path.input_diff) < i)
+		{
+			continue;
+		}
+
+		uint16_t u1 = peelToRound(main[i], round_num, subkey, forward);
+		uint16_t u2 = peelToRound(main[static_cast<uint16_t>(i) ^ path.input_diff], round_num, subkey, forward);
+
+		if ((u1 ^ u2) == path.output_diff)
+		{
+			++observed;
+		}
+	}
+
+	return observed / (path.probability * main.size() / 2);
+}
+
+
+uint16_t KeyFinder::checkSubkey(size_t round_num, uint16_t subkey, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist, const std::vector<std::vector<HistReturn>>& bits, bool permuted) const
+{
+	// A wrong nibble anywhere breaks the right pairs of a characteristic with every sbox of the round active. Going
+	// through all of those takes longer than the rest of the round, so only the ones that come from a single fully
+	// active sbox of the round before (after, going forward) are tried, the permutation spreads it over all of them.
+	bool forward = round_num == 0;
+	std::set<uint16_t> output_diffs;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		output_diffs.insert(forward ? m_spn.itransp(MakeSbox(i, 0xf)) : m_spn.transp(MakeSbox(i, 0xf)));
+	}
+
+	Path path(0, 0, 0.0);
+	for (const Path& p : genPath(forward ? SPN::Nr : round_num, output_diffs, forward))
+	{
+		if (p.probability > path.probability)
+		{
+			path = p;
+		}
+	}
+
+	if (path.probability == 0.0)
+	{
+		return subkey;
+	}
+
+	KF_LOG(VERBOSE_MEDIUM, "key[%zd] check path: input=%04hx, output=%04hx, prob=%lf\n", round_num, path.input_diff, path.output_diff, path.probability);
+
+	bool allowed = isAllowedSubkey(round_num, subkey);
+	double ratio = measureSubkey(round_num, subkey, path, forward);
+	if (allowed && ratio >= CHECK_MIN_RATIO)
+	{
+		KF_LOG(VERBOSE_INFO, "key[%zd] = %04hx passed the check, right pair ratio %lf\n", round_num, subkey, ratio);
+		return subkey;
+	}
+
+	KF_LOG(VERBOSE_NONE, "key[%zd] = %04hx %s, right pair ratio %lf, trying the next candidates\n",
+		round_num, subkey, allowed ? "failed the check" : "is not allowed by the constraints", ratio);
+
+	// Score of a nibble value is its count relative to the best count of the nibble
+	std::vector<std::map<uint16_t, double>> scores(4);
+	for (size_t i = 0; i < 4; ++i)
+	{
+		auto combined = combineSboxBits(i, sbox_state_to_key_hist);
+		size_t best = 0;
+		for (const auto& p : combined)
+		{
+			best = std::max(best, p.second);
+		}
+
+		for (const auto& p : combined)
+		{
+			scores[i][p.first] = best == 0 ? 0.0 : static_cast<double>(p.second) / best;
+		}
+
+		// The chosen ones may come from recountAmbiguous
+		for (const HistReturn& r : bits[i])
+		{
+			scores[i][r.key] = 1.0;
+		}
+	}
 
-	uint16_t subkey = 0;
+	auto score = [&scores](uint16_t key)
+	{
+		double result = 1.0;
+		for (size_t i = 0; i < 4; ++i)
+		{
+			auto it = scores[i].find(key & SboxMask(i));
+			result *= it == scores[i].end() ? 0.0 : it->second;
+		}
+		return result;
+	};
 
-	auto bits_12_15 = getProbableSboxBits(0, sbox_state_to_key_hist);
-	if (bits_12_15.size() > 1)
+	// A list of candidates from the constraints is tried whole, otherwise every combination of the top values
+	std::vector<std::pair<double, uint16_t>> combinations;
+	const auto& listed = m_constraints[round_num].subkeys;
+	if (!listed.empty())
+	{
+		for (uint16_t k : listed)
+		{
+			uint16_t key = permuted ? m_spn.itransp(k) : k;
+			combinations.push_back(std::make_pair(score(key), key));
+		}
+	}
+	else
 	{
-		if (m_verbose)
+		std::vector<std::vector<uint16_t>> ranked(4);
+		for (size_t i = 0; i < 4; ++i)
 		{
-			fprintf(stderr, "potential key[%zd] bits 12-15 values:\n", round_num);
-			for (const auto& p : bits_12_15)
+			std::vector<std::pair<double, uint16_t>> sorted;
+			for (const auto& p : scores[i])
 			{
-				fprintf(stderr, "\tkey=%04hx, count=%zd\n", p.key, p.value);
+				sorted.push_back(std::make_pair(p.second, p.first));
 			}
+			// Ties go lowest value first like in bits, the first guess is the lowest of them
+			std::sort(sorted.begin(), sorted.end(),
+				[](const std::pair<double, uint16_t>& a, const std::pair<double, uint16_t>& b) { return a.first != b.first ? a.first > b.first : a.second < b.second; });
 
-			std::cerr << "using the first one\n";
+			for (size_t j = 0; j < sorted.size() && (j < CHECK_NIBBLE_VALUES || sorted[j].first == sorted[0].first); ++j)
+			{
+				ranked[i].push_back(sorted[j].second);
+			}
 		}
 
-		subkey |= bits_12_15[0].key;
+		combinations.push_back(std::make_pair(1.0, static_cast<uint16_t>(0)));
+		for (size_t i = 0; i < 4; ++i)
+		{
+			std::vector<std::pair<double, uint16_t>> next;
+			for (const auto& c : combinations)
+			{
+				for (uint16_t v : ranked[i])
+				{
+					next.push_back(std::make_pair(0.0, static_cast<uint16_t>(c.second | v)));
+				}
+			}
+			combinations.swap(next);
+		}
+
+		for (auto& c : combinations)
+		{
+			c.first = score(c.second);
+		}
 	}
-	else if (bits_12_15.size() == 1)
+
+	std::stable_sort(combinations.begin(), combinations.end(),
+		[](const std::pair<double, uint16_t>& a, const std::pair<double, uint16_t>& b) { return a.first > b.first; });
+
+	uint16_t fallback = subkey;
+	bool have_fallback = allowed;
+	size_t tries = 0;
+	for (size_t i = 0; i < combinations.size() && tries < CHECK_MAX_TRIES; ++i)
 	{
-		if (m_verbose)
+		uint16_t candidate = permuted ? m_spn.transp(combinations[i].second) : combinations[i].second;
+		if (candidate == subkey || !isAllowedSubkey(round_num, candidate))
+		{
+			continue;
+		}
+
+		if (!have_fallback)
 		{
-			fprintf(stderr, "found key[%zd] bits 12-15: %04hx\n", round_num, bits_12_15[0].key);
+			fallback = candidate;
+			have_fallback = true;
 		}
 
-		subkey |= bits_12_15[0].key;
+		++tries;
+		ratio = measureSubkey(round_num, candidate, path, forward);
+		KF_LOG(VERBOSE_INFO, "key[%zd] = %04hx right pair ratio %lf\n", round_num, candidate, ratio);
+
+		if (ratio >= CHECK_MIN_RATIO)
+		{
+			KF_LOG(VERBOSE_NONE, "guessed key[%zd] = %04hx (next candidate that passed the check)\n", round_num, candidate);
+			return candidate;
+		}
 	}
-	else
+
+	KF_LOG(VERBOSE_NONE, "no candidate for key[%zd] passed the check, keeping %04hx\n", round_num, fallback);
+
+	return fallback;
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::getProbableSubkey(size_t round_num, const SboxState &wanted_sbox, Engine engine, const SubkeyCandidates& candidates) const
+{
+	if (engine == ENGINE_INTEGRAL)
 	{
-		fprintf(stderr, "no key[%zd] bits 12-15 could be guessed, this is probably a bug", round_num);
-		exit(0xdeadbabe);
+		return getIntegralSubkey(round_num, wanted_sbox, candidates);
 	}
 
-	auto bits_8_11 = getProbableSboxBits(1, sbox_state_to_key_hist);
-	if (bits_8_11.size() > 1)
+	if (engine == ENGINE_JOINT)
 	{
-		if (m_verbose)
+		return getJointSubkey(round_num, wanted_sbox, candidates);
+	}
+
+	bool forward = false;
+	size_t path_round_num = round_num;
+	auto paths = selectPaths(round_num, wanted_sbox, forward, path_round_num, engine);
+
+	// Every path to the sboxes may need too many key[0] guesses
+	if (engine == ENGINE_BYPASS && paths.empty())
+	{
+		KF_LOG(VERBOSE_INFO, "bypass: no path to sboxes %04hx, using differential\n", wanted_sbox.mask);
+		engine = ENGINE_DIFFERENTIAL;
+		paths = selectPaths(round_num, wanted_sbox, forward, path_round_num, engine);
+	}
+
+	// Drop paths the calibration caught voting for wrong subkeys, unless there would be nothing left
+	if (!m_calibration.empty() && engine == ENGINE_DIFFERENTIAL)
+	{
+		std::vector<Path> useful_paths;
+		for (const auto& path : paths)
 		{
-			fprintf(stderr, "potential key[%zd] bits 8-11 values:\n", round_num);
-			for (const auto& p : bits_8_11)
+			const auto* stats = m_calibration.findPath(round_num, path.input_diff, path.output_diff);
+			if (stats == nullptr || stats->useful)
 			{
-				fprintf(stderr, "\tkey=%04hx, count=%zd\n", p.key, p.value);
+				useful_paths.push_back(path);
 			}
+		}
+
+		if (!useful_paths.empty() && useful_paths.size() != paths.size())
+		{
+			KF_LOG(VERBOSE_INFO, "calibration dropped %zd/%zd paths to sboxes %04hx\n", paths.size() - useful_paths.size(), paths.size(), wanted_sbox.mask);
+			paths = useful_paths;
+		}
+	}
+
+	KF_LOG(VERBOSE_INFO, "processing paths to sboxes %04hx in round %zd: %zd\n", wanted_sbox.mask, round_num, paths.size());
+
+	size_t processed = 0;
+	size_t quantum = (paths.size() / 10) + 1;
+
+	std::map<uint16_t, size_t> probable_keys;
+	for (const auto& path : paths)
+	{
+		if ((processed % quantum) == 0)
+		{
+			KF_LOG(VERBOSE_INFO, "processed: %zd/%zd\n", processed, paths.size());
+		}
+
+		KF_LOG(VERBOSE_MEDIUM, "path input=%04hx, output=%04hx, mask=%04hx, prob=%lf\n", path.input_diff, path.output_diff, Mask(path.output_diff), path.probability);
+
+		auto hist = countPath(round_num, path_round_num, path, forward, engine, candidates);
+
+		// The differential kernels skip the pruned subkeys already, the others count every nibble value
+		if (engine != ENGINE_DIFFERENTIAL)
+		{
+			candidates.filter(hist, wanted_sbox.mask);
+		}
+
+		auto res = findMaxInHist(hist);
+		for (HistReturn h : res)
+		{
+			probable_keys[h.key] += h.value;
+		}
+
+		++processed;
+	}
+
+	KF_LOG(VERBOSE_INFO, "processed: %zd/%zd\n", processed, paths.size());
+	
+	return probable_keys;
+}
+
+
+std::vector<KeyFinder::Path> KeyFinder::selectPaths(size_t round_num, const SboxState& wanted_sbox, bool& forward, size_t& path_round_num, Engine engine) const
+{
+	// If we want 0th subkey, round number is 4 because we are going backwards
+	forward = false;
+	path_round_num = round_num;
+
+	// Note: this should happen for <= 1, but it doesn't work, so eh
+	if (round_num == 0)
+	{
+		forward = true;
+		path_round_num = SPN::Nr - round_num;
+	}
+
+	if (engine == ENGINE_LINEAR)
+	{
+		return findBestPaths(genLinearPath(path_round_num, wanted_sbox, forward));
+	}
+
+	if (engine == ENGINE_TRUNCATED)
+	{
+		return genTruncatedPath(round_num, wanted_sbox);
+	}
+
+	if (engine == ENGINE_BYPASS)
+	{
+		return genBypassPath(wanted_sbox);
+	}
+
+	return findBestPaths(genPath(path_round_num, wanted_sbox, forward));
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::countPath(size_t round_num, size_t path_round_num, const Path& path, bool forward, Engine engine, const SubkeyCandidates& candidates) const
+{
+	if (engine == ENGINE_LINEAR)
+	{
+		return getLinearSubkey(round_num, path);
+	}
+
+	if (engine == ENGINE_TRUNCATED)
+	{
+		return getTruncatedSubkey(round_num, path);
+	}
+
+	if (engine == ENGINE_BYPASS)
+	{
+		return getBypassSubkey(path, candidates);
+	}
+
+	switch (round_num)
+	{
+	case 4:
+	{
+		return getProbableLastSubkey(path, candidates);
+	}
+	case 3:
+	case 2:
+	case 1:
+	{
+		return getProbableMiddleSubkey(path_round_num, path, forward, candidates);
+	}
+	case 0:
+	{
+		return getProbableFirstSubkey(path, candidates);
+	}
+	default:
+	{
+		// This should never happen
+		return std::map<uint16_t, size_t>();
+	}
+	}
+}
+
+
+uint16_t KeyFinder::peelToRound(uint16_t text, size_t round_num, uint16_t round_subkey, bool forward) const
+{
+	if (forward)
+	{
+		return substBlock(text ^ round_subkey);
+	}
+
+	if (round_num == SPN::Nr)
+	{
+		return isubstBlock(text ^ round_subkey);
+	}
+
+	return isubstItransp(peelText(text, round_num) ^ round_subkey);
+}
+
+
+uint16_t KeyFinder::peelText(uint16_t text, size_t round_num) const
+{
+	if (round_num == SPN::Nr)
+	{
+		return text;
+	}
+
+	uint16_t x = isubstBlock(text ^ m_subkeys[SPN::Nr]);
+	for (size_t i = SPN::Nr - 1; i > round_num; --i)
+	{
+		x = isubstItransp(x ^ m_subkeys[i]);
+	}
+
+	return x;
+}
+
+
+void KeyFinder::setEngine(Engine engine)
+{
+	m_engine = engine;
+
+	if ((engine == ENGINE_INTEGRAL || engine == ENGINE_AUTO) && m_integral_structures.empty())
+	{
+		prepareIntegral();
+	}
+
+	if (engine == ENGINE_TRUNCATED && m_truncated_patterns.empty())
+	{
+		prepareTruncated();
+	}
+}
+
+
+void KeyFinder::setElastic(bool elastic)
+{
+	m_elastic.reset(elastic ? new ElasticWorkers(m_num_of_threads) : nullptr);
+}
+
+
+void KeyFinder::logElastic() const
+{
+	if (m_elastic)
+	{
+		m_elastic->log();
+	}
+}
+
+
+double KeyFinder::AttackData(Engine engine, double probability)
+{
+	if (probability <= 0.0)
+	{
+		return INFINITY;
+	}
+
+	// A differential pair takes two texts
+	return engine == ENGINE_LINEAR ? AUTO_ENGINE_MIN_RIGHT_PAIRS / probability : 2 * AUTO_ENGINE_MIN_RIGHT_PAIRS / probability;
+}
+
+
+double KeyFinder::AttackWork(Engine engine, double texts, size_t max_active_sboxes)
+{
+	// The linear engine goes over the texts once and works on small tables after that, no matter how many sboxes
+	if (engine == ENGINE_LINEAR)
+	{
+		return 2 * (texts + 3 * 16 * 256);
+	}
+
+	double work = 0.0;
+	for (size_t active_count = 1; active_count <= max_active_sboxes; ++active_count)
+	{
+		work += texts * pow(16.0, static_cast<double>(active_count));
+	}
+	return work;
+}
+
+
+KeyFinder::RoundPlan KeyFinder::planRound(size_t round_num, Engine engine) const
+{
+	RoundPlan plan;
+	plan.engine = engine;
+	plan.max_active_sboxes = m_compute_4_sboxes ? 4 : (m_compute_3_sboxes ? 3 : 2);
+	std::fill(std::begin(plan.stop_margin), std::end(plan.stop_margin), -1.0);
+
+	// The integral property doesn't hold for every round, the differential engine takes the rest
+	if (plan.engine == ENGINE_INTEGRAL && !isIntegralRound(round_num))
+	{
+		KF_LOG(VERBOSE_NONE, "key[%zd]: no integral property, using differential\n", round_num);
+		plan.engine = ENGINE_DIFFERENTIAL;
+	}
+
+	// Truncated paths are only generated going backward
+	if (plan.engine == ENGINE_TRUNCATED && round_num == 0)
+	{
+		KF_LOG(VERBOSE_NONE, "key[%zd]: no truncated paths forward, using differential\n", round_num);
+		plan.engine = ENGINE_DIFFERENTIAL;
+	}
+
+	// Plaintext structures only get around the first round
+	if (plan.engine == ENGINE_BYPASS && round_num != SPN::Nr)
+	{
+		KF_LOG(VERBOSE_NONE, "key[%zd]: no first round bypass, using differential\n", round_num);
+		plan.engine = ENGINE_DIFFERENTIAL;
+	}
+
+	// Both engines have to guess the same nibbles
+	if (plan.engine == ENGINE_JOINT && !isJointRound(round_num))
+	{
+		KF_LOG(VERBOSE_NONE, "key[%zd]: no joint ranking for the middle rounds, using differential\n", round_num);
+		plan.engine = ENGINE_DIFFERENTIAL;
+	}
+
+	// Where the integral property holds, a few dozen structures per nibble beat counting any path
+	if (plan.engine == ENGINE_AUTO && isIntegralRound(round_num))
+	{
+		KF_LOG(VERBOSE_NONE, "key[%zd]: using integral\n", round_num);
+		plan.engine = ENGINE_INTEGRAL;
+	}
 
-			std::cerr << "using the first one\n";
+	// Both engines have to have enough data in the codebook for their best path, out of those the one with
+	// less work wins. Per path the differential engine tries every candidate subkey on every pair, the linear one
+	// makes one pass over the texts and a few Walsh-Hadamard transforms.
+	if (plan.engine == ENGINE_AUTO)
+	{
+		double differential = bestPathProbability(round_num, ENGINE_DIFFERENTIAL);
+		double linear = bestPathProbability(round_num, ENGINE_LINEAR);
+
+		double texts = static_cast<double>(m_pc1.size());
+		bool differential_ok = texts >= AttackData(ENGINE_DIFFERENTIAL, differential);
+		bool linear_ok = texts >= AttackData(ENGINE_LINEAR, linear);
+
+		double differential_work = AttackWork(ENGINE_DIFFERENTIAL, texts, plan.max_active_sboxes);
+		double linear_work = AttackWork(ENGINE_LINEAR, texts, plan.max_active_sboxes);
+
+		if (differential_ok && linear_ok)
+		{
+			plan.engine = linear_work < differential_work ? ENGINE_LINEAR : ENGINE_DIFFERENTIAL;
+		}
+		else if (differential_ok || linear_ok)
+		{
+			plan.engine = linear_ok ? ENGINE_LINEAR : ENGINE_DIFFERENTIAL;
 		}
+		else if (differential > 0 && linear > 0 && isJointRound(round_num))
+		{
+			// Two weak statistics together instead of one of them with (a lot) more sboxes
+			plan.engine = ENGINE_JOINT;
+		}
+		else
+		{
+			plan.engine = linear > differential ? ENGINE_LINEAR : ENGINE_DIFFERENTIAL;
+		}
+
+		KF_LOG(VERBOSE_NONE, "key[%zd]: differential needs ~%.0lf pairs, linear ~%.0lf texts, using %s\n",
+			round_num,
+			differential > 0 ? 1.0 / differential : INFINITY,
+			linear > 0 ? 1.0 / linear : INFINITY,
+			plan.engine == ENGINE_LINEAR ? "linear" : (plan.engine == ENGINE_JOINT ? "joint" : "differential"));
+	}
+
+	// The linear engine has every subkey nibble independent already, 3 and 4 sboxes would only add (lots of) paths
+	if (plan.engine == ENGINE_LINEAR)
+	{
+		plan.max_active_sboxes = std::min<size_t>(plan.max_active_sboxes, 2);
+	}
 
-		subkey |= bits_8_11[0].key;
+	// The integral, truncated and joint engines count every nibble on its own, so does the bypass, with the other
+	// ciphertext nibbles equal only a few pairs of a structure are left
+	if (plan.engine == ENGINE_INTEGRAL || plan.engine == ENGINE_TRUNCATED || plan.engine == ENGINE_JOINT || plan.engine == ENGINE_BYPASS)
+	{
+		plan.max_active_sboxes = 1;
 	}
-	else if (bits_8_11.size() == 1)
+
+	// Calibration is only done for the differential engine
+	auto it = m_calibration.rounds.find(round_num);
+	if (it != m_calibration.rounds.end() && plan.engine == ENGINE_DIFFERENTIAL)
 	{
-		if (m_verbose)
+		const Calibration::RoundStats& stats = it->second;
+
+		// The calibration knows better than --heur3/--heur4 how many sboxes it takes
+		if (stats.max_active_sboxes != 0)
 		{
-			fprintf(stderr, "found key[%zd] bits 8-11: %04hx\n", round_num, bits_8_11[0].key);
+			plan.max_active_sboxes = stats.max_active_sboxes;
 		}
 
-		subkey |= bits_8_11[0].key;
+		std::copy(std::begin(stats.stop_margin), std::end(stats.stop_margin), std::begin(plan.stop_margin));
+
+		KF_LOG(VERBOSE_INFO, "plan for key[%zd]: up to %zd sboxes\n", round_num, plan.max_active_sboxes);
 	}
-	else
+
+	// One pass over the codebook per difference is nothing next to the states with 3 and 4 sboxes
+	plan.prune_impossible = !m_impossible_diffs.empty() && plan.max_active_sboxes >= 3;
+
+	return plan;
+}
+
+
+Calibration KeyFinder::calibrate(const std::vector<uint16_t>& real_subkeys, size_t max_active_sboxes)
+{
+	Calibration calibration;
+	calibration.sbox = m_spn.getSbox();
+	calibration.permutation = m_spn.getPermutation().getPositions();
+
+	// Middle rounds peel the outer ones off with m_subkeys, pretend we got them right
+	std::vector<uint16_t> saved_subkeys = m_subkeys;
+	m_subkeys = real_subkeys;
+
+	std::vector<size_t> rounds;
+	for (size_t round_num = SPN::Nr; round_num >= 2; --round_num)
 	{
-		fprintf(stderr, "no key[%zd] bits 8-11 could be guessed, this is probably a bug", round_num);
-		exit(0xdeadbabe);
+		rounds.push_back(round_num);
 	}
+	rounds.push_back(0);
 
-	auto bits_4_7 = getProbableSboxBits(2, sbox_state_to_key_hist);
-	if (bits_4_7.size() > 1)
+	for (size_t round_num : rounds)
 	{
-		if (m_verbose)
+		KF_LOG(VERBOSE_NONE, "calibrating key[%zd] = %04hx..\n", round_num, real_subkeys[round_num]);
+
+		Calibration::RoundStats& stats = calibration.rounds[round_num];
+
+		// Same as recoverFirstSubkey/recoverLastSubkey
+		size_t round_max = max_active_sboxes;
+		if (round_num == 0 || round_num == SPN::Nr)
 		{
-			fprintf(stderr, "potential key[%zd] bits 4-7 values:\n", round_num);
-			for (const auto& p : bits_4_7)
+			round_max = std::min<size_t>(round_max, 2);
+		}
+
+		std::map<uint16_t, std::map<uint16_t, size_t>> sbox_state_to_key_hist;
+		for (size_t active_count = 1; active_count <= round_max; ++active_count)
+		{
+			for (uint16_t state = 1; state <= 0xf; ++state)
 			{
-				fprintf(stderr, "\tkey=%04hx, count=%zd\n", p.key, p.value);
-			}
+				SboxState s(state);
+				if (s.active.count() != active_count)
+				{
+					continue;
+				}
+
+				bool forward = false;
+				size_t path_round_num = round_num;
+				auto paths = selectPaths(round_num, s, forward, path_round_num);
+
+				double predicted = 0.0;
+				size_t observed = 0;
+				size_t useful = 0;
 
-			std::cerr << "using the first one\n";
-		}
+				std::map<uint16_t, size_t> probable_keys;
+				for (const auto& path : paths)
+				{
+					auto hist = countPath(round_num, path_round_num, path, forward);
+
+					Calibration::PathStats path_stats = measurePath(round_num, path, forward, hist, real_subkeys[round_num]);
+					path_stats.active_sboxes = active_count;
+					stats.paths.push_back(path_stats);
+
+					KF_LOG(VERBOSE_INFO, "\tpath %04hx -> %04hx: predicted=%.1lf, observed=%zd, correct=%zd (rank %zd), wrong mean=%.2lf, stddev=%.2lf, max=%zd\n",
+						path.input_diff,
+						path.output_diff,
+						path_stats.predicted,
+						path_stats.observed,
+						path_stats.correct_count,
+						path_stats.correct_rank,
+						path_stats.wrong_mean,
+						path_stats.wrong_stddev,
+						path_stats.wrong_max);
+
+					predicted += path_stats.predicted;
+					observed += path_stats.observed;
+					useful += path_stats.useful ? 1 : 0;
+
+					for (HistReturn h : findMaxInHist(hist))
+					{
+						probable_keys[h.key] += h.value;
+					}
+				}
 
-		subkey |= bits_4_7[0].key;
-	}
-	else if (bits_4_7.size() == 1)
-	{
-		if (m_verbose)
-		{
-			fprintf(stderr, "found key[%zd] bits 4-7: %04hx\n", round_num, bits_4_7[0].key);
-		}
+				sbox_state_to_key_hist.insert(std::make_pair(state, probable_keys));
 
-		subkey |= bits_4_7[0].key;
-	}
-	else
-	{
-		fprintf(stderr, "no key[%zd] bits 4-7 could be guessed, this is probably a bug", round_num);
-		exit(0xdeadbabe);
-	}
+				KF_LOG(VERBOSE_NONE, "sboxes %04hx: %zd paths, %zd useful, right pairs predicted=%.1lf, observed=%zd\n",
+					s.mask, paths.size(), useful, predicted, observed);
+			}
 
-	auto bits_0_3 = getProbableSboxBits(3, sbox_state_to_key_hist);
-	if (bits_0_3.size() > 1)
-	{
-		if (m_verbose)
-		{
-			fprintf(stderr, "potential key[%zd] bits 0-3 values:\n", round_num);
-			for (const auto& p : bits_0_3)
+			// Would the attack get the nibbles right if it stopped here?
+			bool all_correct = true;
+			double wrong_margin = -1.0;
+			for (size_t i = 0; i < 4; ++i)
 			{
-				fprintf(stderr, "\tkey=%04hx, count=%zd\n", p.key, p.value);
+				uint16_t real_bits = real_subkeys[round_num] & SboxMask(i);
+				auto bits = getProbableSboxBits(i, sbox_state_to_key_hist);
+				double margin = getSboxMargin(i, sbox_state_to_key_hist);
+				bool correct = !bits.empty() && bits[0].key == real_bits;
+
+				KF_LOG(VERBOSE_NONE, "key[%zd] after %zd sboxes: nibble %zd guessed %04hx, real %04hx, margin %lf%s\n",
+					round_num,
+					active_count,
+					i,
+					bits.empty() ? 0 : bits[0].key,
+					real_bits,
+					margin,
+					correct ? "" : " WRONG");
+
+				if (!correct)
+				{
+					all_correct = false;
+					wrong_margin = std::max(wrong_margin, margin);
+				}
 			}
 
-			std::cerr << "using the first one\n";
+			// Every margin we have seen above the worst wrong one came with the right guess
+			stats.stop_margin[active_count] = all_correct ? 0.0 : wrong_margin;
+
+			if (all_correct && stats.max_active_sboxes == 0)
+			{
+				stats.max_active_sboxes = active_count;
+			}
 		}
 
-		subkey |= bits_0_3[0].key;
-	}
-	else if (bits_0_3.size() == 1)
-	{
-		if (m_verbose)
+		if (stats.max_active_sboxes != 0)
 		{
-			fprintf(stderr, "found key[%zd] bits 0-3: %04hx\n", round_num, bits_0_3[0].key);
+			KF_LOG(VERBOSE_NONE, "key[%zd] needs %zd sboxes\n", round_num, stats.max_active_sboxes);
+		}
+		else
+		{
+			KF_LOG(VERBOSE_NONE, "key[%zd] was not guessed right with up to %zd sboxes\n", round_num, round_max);
 		}
-
-		subkey |= bits_0_3[0].key;
-	}
-	else
-	{
-		fprintf(stderr, "no key[%zd] bits 0-3 could be guessed, this is probably a bug", round_num);
-		exit(0xdeadbabe);
 	}
 
-	fprintf(stderr, "guessed key[%zd] = %04hx\n", round_num, subkey);
+	m_subkeys = saved_subkeys;
 
-	return subkey;
+	return calibration;
 }
 
 
-std::vector<KeyFinder::HistReturn> KeyFinder::getProbableSboxBits(size_t sbox_index, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist) const
+Calibration::PathStats KeyFinder::measurePath(size_t round_num, const Path& path, bool forward, const std::map<uint16_t, size_t>& hist, uint16_t real_subkey) const
 {
-	std::map<uint16_t, size_t> main = sbox_state_to_key_hist.at((1 << (3 - sbox_index)));
+	const auto& main = forward ? m_pc1_forward : m_pc1;
+	uint16_t output_mask = Mask(path.output_diff);
 
-	for (const auto& p : sbox_state_to_key_hist)
-	{
-		SboxState s(p.first);
+	Calibration::PathStats stats;
+	stats.input_diff = path.input_diff;
+	stats.output_diff = path.output_diff;
+	stats.active_sboxes = SboxCount(output_mask);
+	// Every unordered pair once, same as genPairs
+	stats.predicted = path.probability * main.size() / 2;
+	stats.observed = 0;
 
-		// Don't do a configuration that doesn't have the wanted sbox active
-		// So, if we want sbox 0 active, don't pick 0b0001 etc.
-		if (s.active.count() < 2 || !s.active[3 - sbox_index])
+	for (size_t i = 0; i < main.size(); ++i)
+	{
+		if ((static_cast<uint16_t>(i) ^ path.input_diff) < i)
 		{
 			continue;
 		}
 
-		// Combine their statistics with masked key for what we want
-		auto res = findMaxInHist(p.second);
-		for (const HistReturn& r : res)
+		uint16_t u1 = peelToRound(main[i], round_num, real_subkey, forward);
+		uint16_t u2 = peelToRound(main[static_cast<uint16_t>(i) ^ path.input_diff], round_num, real_subkey, forward);
+
+		if (((u1 ^ u2) & output_mask) == path.output_diff)
 		{
-			main[r.key & SboxMask(sbox_index)] += r.value;
+			++stats.observed;
 		}
 	}
 
-	return findMaxInHist(main);
-}
+	// The histograms only know the key bits under the mask
+	uint16_t correct_key = real_subkey & output_mask;
+	auto it = hist.find(correct_key);
+	stats.correct_count = it == hist.end() ? 0 : it->second;
+
+	size_t max_count = 0;
+	size_t wrong_sum = 0;
+	double wrong_sum_sq = 0.0;
+	stats.wrong_max = 0;
+	stats.correct_rank = 1;
+	for (const auto& p : hist)
+	{
+		max_count = std::max(max_count, p.second);
 
+		if (p.first == correct_key)
+		{
+			continue;
+		}
 
-std::map<uint16_t, size_t> KeyFinder::getProbableSubkey(size_t round_num, const SboxState &wanted_sbox) const
-{
-	// If we want 0th subkey, round number is 4 because we are going backwards
-	bool forward = false;
-	size_t path_round_num = round_num;
+		wrong_sum += p.second;
+		wrong_sum_sq += static_cast<double>(p.second) * p.second;
+		stats.wrong_max = std::max(stats.wrong_max, p.second);
 
-	// Note: this should happen for <= 1, but it doesn't work, so eh
-	if (round_num == 0)
-	{
-		forward = true;
-		path_round_num = SPN::Nr - round_num;
+		if (p.second > stats.correct_count)
+		{
+			++stats.correct_rank;
+		}
 	}
 
-	auto paths = findBestPaths(genPath(path_round_num, wanted_sbox, forward));
+	// Keys that never got a vote are not in the histogram, but they count too
+	double wrong_keys = static_cast<double>(genSubkeysSet(output_mask).size() - 1);
+	stats.wrong_mean = wrong_sum / wrong_keys;
+	stats.wrong_stddev = sqrt(std::max(0.0, wrong_sum_sq / wrong_keys - stats.wrong_mean * stats.wrong_mean));
+	stats.useful = stats.correct_count != 0 && stats.correct_count == max_count;
 
-	if (m_verbose)
-	{
-		fprintf(stderr, "processing paths to sboxes %04hx in round %zd: %zd\n", wanted_sbox.mask, round_num, paths.size());
-	}
+	return stats;
+}
 
-	size_t processed = 0;
-	size_t quantum = (paths.size() / 10) + 1;
 
-	std::map<uint16_t, size_t> probable_keys;
-	for (const auto& path : paths)
+std::vector<KeyFinder::Path> KeyFinder::genPath(size_t from_round, const SboxState& wanted_sbox, bool forward) const
+{
+	return genPath(from_round, genActiveValues(wanted_sbox), forward);
+}
+
+
+std::vector<KeyFinder::Path> KeyFinder::genPath(size_t from_round, const std::set<uint16_t>& output_diffs, bool forward) const
+{
+	std::vector<Path> paths;
+	for (uint16_t u : output_diffs)
 	{
-		if ((processed % quantum) == 0 && m_verbose)
-		{
-			fprintf(stderr, "processed: %zd/%zd\n", processed, paths.size());
-		}
+		KF_LOG_VERY("v%zd=%04hx u%zd=%04hx\n", from_round - 1, m_spn.itransp(u), from_round, u);
 
-		if (m_verbose >= VERBOSE_MEDIUM)
-		{
-			fprintf(stderr, "path input=%04hx, output=%04hx, mask=%04hx, prob=%lf\n", path.input_diff, path.output_diff, Mask(path.output_diff), path.probability);
-		}
-		
-		std::map<uint16_t, size_t> hist;
-		switch (round_num)
-		{
-		case 4:
-		{
-			hist = getProbableLastSubkey(path);
-			break;
-		}
-		case 3:
-		case 2:
-		case 1:
-		{
-			hist = getProbableMiddleSubkey(path_round_num, path, forward);
-			break;
-		}
-		case 0:
-		{
-			hist = getProbableFirstSubkey(path);
-			break;
-		}
-		default:
+		uint16_t prev_round_in_diff = u;
+		double probability = 1.0f;
+		// from_round - 1 because we already did one round
+		for (size_t r = from_round - 1; r >= 1; --r)
 		{
-			// This should never happen
-			break;
-		}
+			uint16_t round_in_diff = findPathForRound(r, prev_round_in_diff, probability, forward);
+			prev_round_in_diff = round_in_diff;
 		}
 
-		auto res = findMaxInHist(hist);
-		for (HistReturn h : res)
-		{
-			probable_keys[h.key] += h.value;
-		}
+		KF_LOG_VERY("input diff: %04hx (%04hx)\n", prev_round_in_diff, Mask(prev_round_in_diff));
+		KF_LOG_VERY("output diff: %04hx\n", u);
+		KF_LOG_VERY("probability: %lf\n", probability);
+		KF_LOG_VERY("-------------\n");
 
-		++processed;
+		paths.push_back(Path(prev_round_in_diff, u, probability));
 	}
 
-	if (m_verbose)
-	{
-		fprintf(stderr, "processed: %zd/%zd\n", processed, paths.size());
-	}
-	
-	return probable_keys;
+	return paths;
 }
 
 
-std::vector<KeyFinder::Path> KeyFinder::genPath(size_t from_round, const SboxState& wanted_sbox, bool forward) const
+std::set<uint16_t> KeyFinder::genActiveValues(const SboxState& wanted_sbox) const
 {
 	std::set<uint16_t> wanted_round_in_diffs;
 	// Go through all possible values of input differences in the wanted round where only wanted sboxes are active
@@ -468,35 +1381,7 @@ std::vector<KeyFinder::Path> KeyFinder::genPath(size_t from_round, const SboxSta
 		wanted_round_in_diffs.insert(u);
 	}
 
-	std::vector<Path> paths;
-	for (uint16_t u : wanted_round_in_diffs)
-	{
-		if (m_verbose == VERBOSE_VERY)
-		{
-			fprintf(stderr, "v%zd=%04hx u%zd=%04hx\n", from_round - 1, m_spn.itransp(u), from_round, u);
-		}
-
-		uint16_t prev_round_in_diff = u;
-		double probability = 1.0f;
-		// from_round - 1 because we already did one round
-		for (size_t r = from_round - 1; r >= 1; --r)
-		{
-			uint16_t round_in_diff = findPathForRound(r, prev_round_in_diff, probability, forward);
-			prev_round_in_diff = round_in_diff;
-		}
-
-		if (m_verbose == VERBOSE_VERY)
-		{
-			fprintf(stderr, "input diff: %04hx (%04hx)\n", prev_round_in_diff, Mask(prev_round_in_diff));
-			fprintf(stderr, "output diff: %04hx\n", u);
-			fprintf(stderr, "probability: %lf\n", probability);
-			std::cerr << "-------------\n";
-		}
-
-		paths.push_back(Path(prev_round_in_diff, u, probability));
-	}
-
-	return paths;
+	return wanted_round_in_diffs;
 }
 
 
@@ -504,14 +1389,19 @@ uint16_t KeyFinder::findPathForRound(size_t round_num, uint16_t prev_round_in_di
 {
 	const auto& diff_table = forward ? m_spn.getTransposedDiffTable() : m_spn.getDiffTable();
 
-	uint16_t round_out_diff = m_spn.itransp(prev_round_in_diff);
+	// Differences go through the permutation the same way the bits do
+	uint16_t round_out_diff = forward ? m_spn.transp(prev_round_in_diff) : m_spn.itransp(prev_round_in_diff);
 	uint16_t round_in_diff = 0;
 
-	if (m_verbose == VERBOSE_VERY)
+	uint32_t cache_key = PathCacheKey(false, forward, prev_round_in_diff);
+	if (cachedRound(cache_key, round_in_diff, probability))
 	{
-		fprintf(stderr, "round %zd:\n", round_num);
-		fprintf(stderr, "\tv%zd=%04hx\n", round_num, round_out_diff);
+		return round_in_diff;
 	}
+	CachedRound searched{};
+
+	KF_LOG_VERY("round %zd:\n", round_num);
+	KF_LOG_VERY("\tv%zd=%04hx\n", round_num, round_out_diff);
 
 	for (uint16_t sbox_index : FindSbox(round_out_diff))
 	{
@@ -528,6 +1418,8 @@ uint16_t KeyFinder::findPathForRound(size_t round_num, uint16_t prev_round_in_di
 		}
 
 		probability *= (max_distrib / 16.0f);
+		searched.factors[searched.sbox_count++] = max_distrib / 16.0f;
+		searched.lines |= TableLine(false, forward, SboxValue(sbox_index, round_out_diff));
 
 		for (uint16_t dx = 1; dx <= 0xf; ++dx)
 		{
@@ -561,12 +1453,10 @@ uint16_t KeyFinder::findPathForRound(size_t round_num, uint16_t prev_round_in_di
 		for (uint16_t dx : new_dxs)
 		{
 			uint16_t potential_round_in_diff = round_in_diff | MakeSbox(sbox_index, dx);
-			uint16_t next_round_out_diff = m_spn.itransp(potential_round_in_diff);
+			uint16_t next_round_out_diff = forward ? m_spn.transp(potential_round_in_diff) : m_spn.itransp(potential_round_in_diff);
 			size_t next_out_active_count = SboxCount(next_round_out_diff);
 
-			if (m_verbose == VERBOSE_VERY)
-			{
-				fprintf(stderr, "\tsbox=%d, dx=%d, dy=%d, distrib=%d, round_in_diff=%04hx, next_out_diff=%04hx, active_count_in_next=%zd\n",
+			KF_LOG_VERY("\tsbox=%d, dx=%d, dy=%d, distrib=%d, round_in_diff=%04hx, next_out_diff=%04hx, active_count_in_next=%zd\n",
 					sbox_index,
 					dx,
 					SboxValue(sbox_index, round_out_diff),
@@ -574,7 +1464,6 @@ uint16_t KeyFinder::findPathForRound(size_t round_num, uint16_t prev_round_in_di
 					potential_round_in_diff,
 					next_round_out_diff,
 					next_out_active_count);
-			}
 
 			if (next_out_active_count < lowest_active_count)
 			{
@@ -583,237 +1472,336 @@ uint16_t KeyFinder::findPathForRound(size_t round_num, uint16_t prev_round_in_di
 			}
 		}
 
-		if (m_verbose == VERBOSE_VERY)
+		KF_LOG_VERY("\tusing lowest count %zd for sbox=%d\n", lowest_active_count, sbox_index);
+	}
+	
+	KF_LOG_VERY("\tu%zd=%04hx\n", round_num, round_in_diff);
+
+	searched.round_in = round_in_diff;
+	cacheRound(cache_key, searched);
+
+	return round_in_diff;
+}
+
+
+KeyFinder::PairFilter KeyFinder::makePairFilter(const Path& path, uint16_t equal_mask, bool forward, bool permuted, const SubkeyCandidates& candidates) const
+{
+	const auto& diff_table = m_spn.getDiffTable();
+	uint16_t output_mask = Mask(path.output_diff);
+
+	PairFilter filter;
+	filter.finder = this;
+	filter.input_diff = path.input_diff;
+	filter.output_diff = path.output_diff;
+	filter.equal_mask = equal_mask;
+	filter.forward = forward;
+	filter.permuted = permuted;
+
+	// feasible[j] bit d set = text difference d in nibble j can become the path's difference there, the nibble
+	// difference is the sbox input going forward and its output going backward
+	for (size_t j = 0; j < 4; ++j)
+	{
+		filter.feasible[j] = 0xffff;
+	}
+	for (uint16_t j : FindSbox(output_mask))
+	{
+		uint16_t out = SboxValue(j, path.output_diff);
+
+		filter.feasible[j] = 0;
+		for (uint16_t d = 0; d <= 0xf; ++d)
 		{
-			fprintf(stderr, "\tusing lowest count %zd for sbox=%d\n", lowest_active_count, sbox_index);
+			if ((forward ? diff_table[d][out] : diff_table[out][d]) != 0)
+			{
+				filter.feasible[j] |= 1 << d;
+			}
 		}
 	}
-	
-	if (m_verbose == VERBOSE_VERY)
+
+	// Nibbles with a single candidate subkey (recountAmbiguous) decide the pair alone, unless the subkey goes
+	// through the permutation before the sboxes
+	filter.fixed_key = 0;
+	filter.fixed_mask = 0;
+	if (!permuted && !candidates.permuted)
 	{
-		fprintf(stderr, "\tu%zd=%04hx\n", round_num, round_in_diff);
+		for (uint16_t j : FindSbox(output_mask))
+		{
+			if (candidates.count(j) == 1)
+			{
+				uint16_t k = 0;
+				while ((candidates.nibble[j] & (1 << k)) == 0)
+				{
+					++k;
+				}
+
+				filter.fixed_key |= MakeSbox(j, k);
+				filter.fixed_mask |= SboxMask(j);
+			}
+		}
 	}
 
-	return round_in_diff;
+	return filter;
 }
 
 
-std::map<uint16_t, size_t> KeyFinder::getProbableFirstSubkey(const Path& path) const
+bool KeyFinder::PairFilter::accepts(uint16_t text1, uint16_t text2) const
 {
-	std::vector<uint16_t> pc2 = genPCPair(path.input_diff, true); // Change 1
-	uint16_t output_mask = Mask(path.output_diff);
-	const auto subkeys = genSubkeysSet(output_mask);
+	uint16_t diff = text1 ^ text2;
+	if ((diff & equal_mask) != 0)
+	{
+		return false;
+	}
 
-	std::map<uint16_t, size_t> hist;
-	size_t num = 0;
-	for (size_t i = 0; i < m_pc1_forward.size(); ++i) // Change 2
+	if (permuted)
 	{
-		uint16_t ct1 = m_pc1_forward[i]; // Change 3
-		uint16_t ct2 = pc2[i];
+		diff = finder->m_spn.itransp(diff);
+	}
 
-		if ((ct1 & (~output_mask)) != (ct2 & (~output_mask)))
+	for (size_t j = 0; j < 4; ++j)
+	{
+		if ((feasible[j] & (1 << SboxValue(j, diff))) == 0)
 		{
-			continue;
+			return false;
+		}
+	}
+
+	if (fixed_mask != 0)
+	{
+		uint16_t u1 = forward ? finder->substBlock(text1 ^ fixed_key) : finder->isubstBlock(text1 ^ fixed_key);
+		uint16_t u2 = forward ? finder->substBlock(text2 ^ fixed_key) : finder->isubstBlock(text2 ^ fixed_key);
+		return ((u1 ^ u2) & fixed_mask) == (output_diff & fixed_mask);
+	}
+
+	return true;
+}
+
+
+template <typename Texts>
+KeyFinder::PackedPairs KeyFinder::genPairs(const Texts& texts, const PairFilter& filter) const
+{
+	PackedPairs pairs;
+	for (uint32_t i = 0; i < texts.size(); ++i)
+	{
+		uint32_t other = i ^ filter.input_diff;
+		if (other > i && filter.accepts(texts[i], texts[other]))
+		{
+			pairs.push_back(static_cast<uint16_t>(i));
+		}
+	}
+	pairs.finish();
+
+	KF_LOG(VERBOSE_MEDIUM, "pair indices: %zd pairs in %zd bytes\n", pairs.size(), pairs.bytes());
+
+	return pairs;
+}
+
+
+template <typename Texts, typename F>
+size_t KeyFinder::forEachPair(const Texts& texts, const PairFilter& filter, F f) const
+{
+	if (m_memory_plan.pair_indices)
+	{
+		const auto pairs = genPairs(texts, filter);
+		pairs.forEach(0, pairs.blocks(), f);
+		return pairs.size();
+	}
+
+	size_t count = 0;
+	for (uint32_t i = 0; i < texts.size(); ++i)
+	{
+		uint32_t other = i ^ filter.input_diff;
+		if (other > i && filter.accepts(texts[i], texts[other]))
+		{
+			f(static_cast<uint16_t>(i));
+			++count;
 		}
+	}
+	return count;
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::getProbableFirstSubkey(const Path& path, const SubkeyCandidates& candidates) const
+{
+	uint16_t output_mask = Mask(path.output_diff);
+	const auto subkeys = genCandidateSubkeys(output_mask, 0, candidates);
+	const auto filter = makePairFilter(path, static_cast<uint16_t>(~output_mask), true, false, candidates); // Change 1
 
-		++num;
+	Histogram counts(histogramBackend(subkeys.size() * m_pc1_forward.size() / 2));
+	size_t pair_count = forEachPair(m_pc1_forward, filter, [&](uint16_t i)
+	{
+		uint16_t ct1 = m_pc1_forward[i]; // Change 2
+		uint16_t ct2 = m_pc1_forward[i ^ path.input_diff];
 
 		for (uint16_t sk : subkeys)
 		{
 			uint16_t v1 = ct1 ^ sk;
 			uint16_t v2 = ct2 ^ sk;
-			uint16_t u1 = m_spn.subst(v1); // Change 4
-			uint16_t u2 = m_spn.subst(v2); // Change 5
+			uint16_t u1 = substBlock(v1); // Change 3
+			uint16_t u2 = substBlock(v2); // Change 4
 
 			if (((u1 ^ u2) & output_mask) == path.output_diff)
 			{
-				hist[sk] += 1;
+				counts.add(sk);
 			}
 		}
-	}
+	});
 
-	if (m_verbose >= VERBOSE_MEDIUM)
-	{
-		fprintf(stderr, "valid pc pairs: %zd\n", num);
-	}
+	KF_LOG(VERBOSE_MEDIUM, "valid pc pairs: %zd\n", pair_count);
 
+	std::map<uint16_t, size_t> hist;
+	counts.addTo(hist);
 	return hist;
 }
 
 
-std::map<uint16_t, size_t> KeyFinder::getProbableLastSubkey(const Path& path) const
+std::map<uint16_t, size_t> KeyFinder::getProbableLastSubkey(const Path& path, const SubkeyCandidates& candidates) const
 {
-	std::vector<uint16_t> pc2 = genPCPair(path.input_diff);
 	uint16_t output_mask = Mask(path.output_diff);
-	const auto subkeys = genSubkeysSet(output_mask);
+	const auto subkeys = genCandidateSubkeys(output_mask, SPN::Nr, candidates);
+	const auto filter = makePairFilter(path, static_cast<uint16_t>(~output_mask), false, false, candidates);
 
-	std::map<uint16_t, size_t> hist;
-	size_t num = 0;
-	for (size_t i = 0; i < m_pc1.size(); ++i)
+	Histogram counts(histogramBackend(subkeys.size() * m_pc1.size() / 2));
+	size_t pair_count = forEachPair(m_pc1, filter, [&](uint16_t i)
 	{
 		uint16_t ct1 = m_pc1[i];
-		uint16_t ct2 = pc2[i];
-
-		if ((ct1 & (~output_mask)) != (ct2 & (~output_mask)))
-		{
-			continue;
-		}
-
-		++num;
+		uint16_t ct2 = m_pc1[i ^ path.input_diff];
 
 		for (uint16_t sk : subkeys)
 		{
 			uint16_t v1 = ct1 ^ sk;
 			uint16_t v2 = ct2 ^ sk;
-			uint16_t u1 = m_spn.isubst(v1);
-			uint16_t u2 = m_spn.isubst(v2);
+			uint16_t u1 = isubstBlock(v1);
+			uint16_t u2 = isubstBlock(v2);
 
 			if (((u1 ^ u2) & output_mask) == path.output_diff)
 			{
-				hist[sk] += 1;
+				counts.add(sk);
 			}
 		}
-	}
+	});
 
-	if (m_verbose >= VERBOSE_MEDIUM)
-	{
-		fprintf(stderr, "valid pc pairs: %zd\n", num);
-	}
+	KF_LOG(VERBOSE_MEDIUM, "valid pc pairs: %zd\n", pair_count);
 
+	std::map<uint16_t, size_t> hist;
+	counts.addTo(hist);
 	return hist;
 }
 
 
-std::map<uint16_t, size_t> KeyFinder::getProbableMiddleSubkey(size_t round_num, const Path& path, bool forward) const
+std::map<uint16_t, size_t> KeyFinder::getProbableMiddleSubkey(size_t round_num, const Path& path, bool forward, const SubkeyCandidates& candidates) const
 {
-	std::vector<uint16_t> pc2 = genPCPair(path.input_diff, forward);
 	uint16_t output_mask = Mask(path.output_diff);
-	const auto subkeys = genSubkeysSet(output_mask);
+	const auto subkeys = genCandidateSubkeys(output_mask, round_num, candidates);
 
-	std::map<uint16_t, size_t> hist;
-	const auto& main_pc = forward ? m_pc1_forward : m_pc1;
+	// The subkey is XORed in before the inverse permutation, so the sboxes see the difference moved through it
+	const auto filter = makePairFilter(path, static_cast<uint16_t>(~output_mask), forward, true, candidates);
 
-	size_t n_threads = m_num_of_threads;
-	size_t start = 0;
-	size_t per_thread_work = main_pc.size() / n_threads;
-	size_t end = per_thread_work;
-	std::mutex mutex;
+	std::map<uint16_t, size_t> hist;
 
-	std::vector<std::thread> workers;
-	for (size_t i = 0; i < n_threads; ++i)
+	// The pairs are only indices into the peeled texts, with pair indices the threads split the blocks of pairs,
+	// without them the texts and every thread filters its own
+	auto count = [&](const auto& peeled)
 	{
-		std::thread t(
-			[this, &mutex, main_pc, pc2, subkeys, path, round_num, forward, start, end, &hist]
-			{
-				uint16_t output_mask = Mask(path.output_diff);
-				std::map<uint16_t, size_t> my_hist;
+		PackedPairs pairs;
+		if (m_memory_plan.pair_indices)
+		{
+			pairs = genPairs(peeled, filter);
+		}
+		size_t total = m_memory_plan.pair_indices ? pairs.blocks() : peeled.size();
 
-				// WARNING: it's broken if forward = true
-				//
-				//
-				if (forward)
-				{
-					for (size_t i = start; i < end; ++i)
-					{
-						uint16_t ct1 = m_spn.subst(main_pc[i] ^ m_subkeys[SPN::Nr]);
-						uint16_t ct2 = m_spn.subst(pc2[i] ^ m_subkeys[SPN::Nr]);
+		size_t n_threads = m_num_of_threads;
+		std::mutex mutex;
 
-						//for (size_t i = SPN::Nr - 1; i > round_num; --i)
-						//{
-						//	ct1 ^= m_subkeys[i];
-						//	ct1 = m_spn.itransp(ct1);
-						//	ct1 = m_spn.subst(ct1);
+		// Chunks of blocks or texts taken one by one, so the threads that happen to get less work take more of it
+		// and the elastic workers can stop or come back in between
+		size_t chunk = std::max<size_t>(1, total / (n_threads * WORKER_CHUNKS));
+		std::atomic<size_t> next{ 0 };
 
-						//	ct2 ^= m_subkeys[i];
-						//	ct2 = m_spn.itransp(ct2);
-						//	ct2 = m_spn.subst(ct2);
-						//}
+		// Without the indices every text but half of them is the first of a pair
+		HistogramBackend backend = histogramBackend(subkeys.size() * (m_memory_plan.pair_indices ? pairs.size() : peeled.size() / 2));
 
-						if ((ct1 & ~output_mask) != (ct2 & ~output_mask))
-						{
-							continue;
-						}
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < n_threads; ++t)
+		{
+			workers.push_back(std::thread(
+				[this, &mutex, &peeled, &pairs, &filter, &subkeys, &path, output_mask, forward, backend, total, chunk, t, &next, &hist]
+				{
+					Histogram my_hist(backend);
+
+					auto count_pair = [&](uint16_t i)
+					{
+						uint16_t ct1 = peeled[i];
+						uint16_t ct2 = peeled[i ^ path.input_diff];
 
 						for (uint16_t sk : subkeys)
 						{
-							uint16_t u1 = m_spn.subst(m_spn.itransp(ct1 ^ sk));
-							uint16_t u2 = m_spn.subst(m_spn.itransp(ct2 ^ sk));
+							uint16_t u1 = forward ? m_spn.subst(m_spn.itransp(ct1 ^ sk)) : isubstItransp(ct1 ^ sk);
+							uint16_t u2 = forward ? m_spn.subst(m_spn.itransp(ct2 ^ sk)) : isubstItransp(ct2 ^ sk);
 
 							if (((u1 ^ u2) & output_mask) == path.output_diff)
 							{
-								my_hist[sk] += 1;
+								my_hist.add(sk);
 							}
 						}
-					}
-				}
-				else
-				{
-					for (size_t i = start; i < end; ++i)
-					{
-						uint16_t ct1 = m_spn.isubst(main_pc[i] ^ m_subkeys[SPN::Nr]);
-						uint16_t ct2 = m_spn.isubst(pc2[i] ^ m_subkeys[SPN::Nr]);
+					};
 
-						for (size_t i = SPN::Nr - 1; i > round_num; --i)
+					for (;;)
+					{
+						if (m_elastic && !m_elastic->admit(t, [&] { return next.load() < total; }))
 						{
-							ct1 ^= m_subkeys[i];
-							ct1 = m_spn.isubst(m_spn.itransp(ct1));
-
-							ct2 ^= m_subkeys[i];
-							ct2 = m_spn.isubst(m_spn.itransp(ct2));
+							break;
 						}
 
-						if ((ct1 & ~output_mask) != (ct2 & ~output_mask))
+						size_t start = next.fetch_add(chunk);
+						if (start >= total)
 						{
-							continue;
+							break;
 						}
+						size_t end = std::min(total, start + chunk);
 
-						for (uint16_t sk : subkeys)
+						if (m_memory_plan.pair_indices)
 						{
-							uint16_t u1 = m_spn.isubst(m_spn.itransp(ct1 ^ sk));
-							uint16_t u2 = m_spn.isubst(m_spn.itransp(ct2 ^ sk));
-
-							if (((u1 ^ u2) & output_mask) == path.output_diff)
+							pairs.forEach(start, end, count_pair);
+						}
+						else
+						{
+							for (size_t p = start; p < end; ++p)
 							{
-								my_hist[sk] += 1;
+								uint16_t i = static_cast<uint16_t>(p);
+								if ((i ^ path.input_diff) > i && filter.accepts(peeled[i], peeled[i ^ path.input_diff]))
+								{
+									count_pair(i);
+								}
 							}
 						}
 					}
-				}
-
-				mutex.lock();
-				for (const auto& p : my_hist)
-				{
-					hist[p.first] += p.second;
-				}
-				mutex.unlock();
-			});
 
+					mutex.lock();
+					my_hist.addTo(hist);
+					mutex.unlock();
+				}));
+		}
 
-		workers.push_back(std::move(t));
-		start = end;
-		end += per_thread_work;
-	}
+		for (std::thread& t : workers)
+		{
+			t.join();
+		}
+	};
 
-	for (std::thread& t : workers)
+	if (!forward)
 	{
-		t.join();
+		count(peeledTexts(round_num));
+		return hist;
 	}
 
-	return hist;
-}
-
-
-std::vector<uint16_t> KeyFinder::genPCPair(uint16_t input_diff, bool forward) const
-{
-	const auto& main = forward ? m_pc1_forward : m_pc1;
-
-	std::vector<uint16_t> pc;
-	for (size_t i = 0; i < main.size(); ++i)
+	// WARNING: it's broken if forward = true
+	std::vector<uint16_t> peeled(m_pc1_forward.size());
+	for (size_t i = 0; i < m_pc1_forward.size(); ++i)
 	{
-		pc.push_back(main[static_cast<uint16_t>(i) ^ input_diff]);
+		peeled[i] = m_spn.subst(m_pc1_forward[i] ^ m_subkeys[SPN::Nr]);
 	}
+	count(peeled);
 
-	return pc;
+	return hist;
 }
 
 
@@ -9,8 +9,13 @@
 #include <set>
 #include <map>
 #include <bitset>
+#include <memory>
+#include <unordered_map>
 
 #include "spn.hpp"
+#include "log.hpp"
+#include "calibration.hpp"
+#include "elastic.hpp"
 
 
 class KeyFinder
@@ -49,28 +54,202 @@ public:
 		}
 	};
 
-	enum VerboseLevel : int
+	// How the histograms for a round are counted
+	//
+	// ENGINE_DIFFERENTIAL - right pairs of differential paths (genPath), the original attack
+	// ENGINE_LINEAR - Matsui's algorithm 2 with linear approximations (genLinearPath) over the known plaintexts
+	// ENGINE_INTEGRAL - balanced (or affine) nibbles over plaintext structures (integral.cpp), only for the outer rounds
+	// ENGINE_TRUNCATED - truncated differentials predicting only the active sboxes (truncated.cpp), going backward
+	// ENGINE_JOINT - differential and linear paths of every nibble ranked by their joint likelihood (joint.cpp), only
+	//		for the outer rounds
+	// ENGINE_BYPASS - differential paths of rounds 2 and 3 only, plaintext structures get through round 1 for every
+	//		key[0] guess (bypass.cpp), only for key[4]
+	// ENGINE_AUTO - pick the one that needs less data for the round, see planRound
+	enum Engine : int
+	{
+		ENGINE_DIFFERENTIAL = 0,
+		ENGINE_LINEAR,
+		ENGINE_AUTO,
+		ENGINE_INTEGRAL,
+		ENGINE_TRUNCATED,
+		ENGINE_JOINT,
+		ENGINE_BYPASS
+	};
+
+	// Values the subkey nibbles can still have, bit v of nibble[i] set = sbox i can be v (pruneImpossible, recountAmbiguous)
+	// On top of that the known bits and the whole subkeys it can be (empty = any) from --constraint/--candidates.
+	// If permuted, for the middle rounds these are the nibbles of itransp(subkey), same as the linear engine guesses
+	struct SubkeyCandidates
+	{
+		uint16_t nibble[4];
+		uint16_t known_mask;
+		uint16_t known_value;
+		std::vector<uint16_t> subkeys;
+		bool permuted;
+		SubkeyCandidates() : nibble{ 0xffff, 0xffff, 0xffff, 0xffff }, known_mask{ 0 }, known_value{ 0 }, permuted{ false } {}
+
+		// Only the nibbles under mask are checked
+		bool allows(uint16_t subkey, uint16_t mask) const
+		{
+			for (size_t i = 0; i < 4; ++i)
+			{
+				if ((mask & SboxMask(i)) != 0 && (nibble[i] & (1 << SboxValue(i, subkey))) == 0)
+				{
+					return false;
+				}
+			}
+
+			if (((subkey ^ known_value) & known_mask & mask) != 0)
+			{
+				return false;
+			}
+
+			if (subkeys.empty())
+			{
+				return true;
+			}
+
+			for (uint16_t k : subkeys)
+			{
+				if (((k ^ subkey) & mask) == 0)
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		size_t count(size_t i) const { return std::bitset<16>(nibble[i]).count(); }
+
+		// Drop the subkeys that aren't allowed from a histogram
+		void filter(std::map<uint16_t, size_t>& hist, uint16_t mask) const
+		{
+			for (auto it = hist.begin(); it != hist.end();)
+			{
+				it = allows(it->first, mask) ? std::next(it) : hist.erase(it);
+			}
+		}
+
+		// Add known bits / a list of whole subkeys (intersected with the one there is), the nibbles follow.
+		// false if it contradicts what's already known, nothing is changed then
+		bool constrain(uint16_t mask, uint16_t value);
+		bool restrict(const std::vector<uint16_t>& list);
+	};
+
+	// What recoverRoundSubkey is going to count for a round, see planRound
+	struct RoundPlan
+	{
+		Engine engine;
+		// States with up to this many active sboxes are counted (2 = default, 3 = heur3, 4 = heur4)
+		size_t max_active_sboxes;
+		// stop_margin[n] - stop after the states with n active sboxes if every nibble's margin is above it, < 0 = never
+		double stop_margin[5];
+		// Drop subkeys with impossible differentials before counting, see pruneImpossible
+		bool prune_impossible;
+	};
+
+	// What the integral engine checks on the partially decrypted nibbles of a structure
+	enum IntegralProperty : int
+	{
+		INTEGRAL_ZERO_SUM = 0,
+		INTEGRAL_AFFINE
+	};
+
+	// Predicted cost of attacking every round -a does (Nr down to 2, then 0) with one engine, see estimateAttack
+	struct AttackEstimate
+	{
+		// Best single sbox path of each round (correlation^2 for linear), 0 = none, key[1] is never attacked
+		double probability[SPN::Nr + 1];
+		// Texts the hardest round needs for AUTO_ENGINE_MIN_RIGHT_PAIRS right pairs (texts for linear), INFINITY if none
+		double data;
+		// Partial decryptions of all the rounds with that much data, same model planRound uses for ENGINE_AUTO
+		double work;
+	};
+
+	// What the counting kernels keep in memory, see planMemory
+	struct MemoryPlan
 	{
-		VERBOSE_NONE = 0,
-		VERBOSE_INFO,
-		VERBOSE_MEDIUM,
-		VERBOSE_VERY
+		// 64K tables of subst, isubst and isubst(itransp(x)) over the whole block, shared by every kernel
+		bool composite_tables;
+		// Codebook with the known rounds peeled off, kept for the current round instead of peeled again for every path
+		bool peeled_cache;
+		// Pairs are enumerated into an index vector first (genPairs), otherwise they're filtered while counting
+		bool pair_indices;
+		// Per-thread histograms are 64K counters instead of maps
+		bool dense_histograms;
+		// The counters don't fit into the L2 next to the tables (or setPartitionedHistograms says so), big kernels
+		// partition the keys (see Histogram)
+		bool partitioned_histograms;
+		// What all of the above takes together with the codebook
+		size_t bytes;
 	};
 
+	using VerboseLevel = ::VerboseLevel;
+
 	explicit KeyFinder(
 		const std::string& ct_file,
 		SPN& spn,
 		size_t num_of_threads = DEFAULT_NUM_OF_THREADS,
 		bool compute_3_sboxes = false,
-		bool compute_4_sboxes = false);
+		bool compute_4_sboxes = false,
+		bool shared_cache = false);
+	// The same with the codebook already in memory, ciphertexts[pt] = encryption of pt
+	explicit KeyFinder(
+		const std::vector<uint16_t>& ciphertexts,
+		SPN& spn,
+		size_t num_of_threads = DEFAULT_NUM_OF_THREADS,
+		bool compute_3_sboxes = false,
+		bool compute_4_sboxes = false,
+		bool shared_cache = false);
 
 	std::vector<uint16_t> &getSubkeys() { return m_subkeys; }
 	const std::vector<std::vector<uint16_t>>& getDiffTable() const { return m_spn.getDiffTable(); }
-	void setVerbose(int level) { m_verbose = static_cast<VerboseLevel>(level); }
+	void setVerbose(int level) { Log::setLevel(level); }
+	void setCalibration(const Calibration& calibration) { m_calibration = calibration; }
+	void setEngine(Engine engine);
+	// 0 = no limit, see planMemory
+	void setMemoryBudget(size_t bytes);
+	// Overrides what planMemory picks from the L2 size for the partitioned histograms (see Histogram)
+	void setPartitionedHistograms(bool partitioned);
+	// -t becomes the most counting threads, how many run follows the CPU quota and the load (see ElasticWorkers)
+	void setElastic(bool elastic);
+	// Limits and throttling of the elastic workers, nothing without setElastic
+	void logElastic() const;
+	const MemoryPlan& getMemoryPlan() const { return m_memory_plan; }
 	std::string getKeyStr() const;
 
 	bool testKey(const std::string& key) const;
 
+	// Keep every round findPathForRound and findLinearPathForRound search until forgetPaths says a table line it read
+	// changed, for the sbox optimizer swapping outputs of m_spn under the finder (optimize.cpp). Not for more threads at once.
+	void setPathCache(bool enabled);
+	// changed has the TableLine bit of every line whose highest entry or the inputs having it changed. The dropped
+	// rounds are kept until the next call, restorePaths puts them back when the sbox is swapped back.
+	size_t forgetPaths(uint64_t changed);
+	void restorePaths(uint64_t changed);
+	// Rounds asked for and actually searched for since setPathCache
+	size_t getPathLookups() const { return m_path_lookups; }
+	size_t getPathSearches() const { return m_path_searches; }
+	// The line findPathForRound (findLinearPathForRound if linear) reads for the sbox output out, a DDT/LAT column
+	// going backwards and a row going forwards. Only the highest entry of it and where it is matter.
+	static constexpr uint64_t TableLine(bool linear, bool forward, uint16_t out) { return 1ull << ((linear ? 32 : 0) + (forward ? 16 : 0) + out); }
+
+	// Partially known subkeys (constraints.cpp)
+	//
+	// Every enumerator and counting kernel only goes over the subkeys these allow, a subkey they fix completely
+	// isn't counted at all. Returns false if it contradicts an earlier constraint of the same subkey.
+	bool addConstraint(size_t round_num, uint16_t mask, uint16_t value);
+	bool addCandidates(size_t round_num, const std::vector<uint16_t>& subkeys);
+	// The constraints of a round, moved through itransp if permuted (middle rounds only)
+	SubkeyCandidates getConstraints(size_t round_num, bool permuted) const;
+	bool isAllowedSubkey(size_t round_num, uint16_t subkey) const { return m_constraints[round_num].allows(subkey, 0xffff); }
+
+	// Use a recovered subkey (sets it in getSubkeys()), every bit of the other subkeys the key schedule gives
+	// with the subkeys learned so far becomes a constraint. false if it contradicts them.
+	bool learnSubkey(size_t round_num, uint16_t subkey);
+	// Only once the subkeys learned give every master key bit
+	bool getMasterKey(KeySchedule::Row& master) const;
+
 	// Subkey recovery functions
 	//
 	// recoverFirstSubkey - uses recoverRoundSubkey(0)
@@ -82,10 +261,48 @@ public:
 	// 
 	// recoverRoundSubkey - "main worker" function that recovers a subkey nibble after nibble combining
 	//		histograms from multiple best paths
-	uint16_t recoverFirstSubkey();
+	//		- false if some nibble has no value left to guess, subkey isn't touched then
+	bool recoverFirstSubkey(uint16_t& subkey);
 	uint16_t recoverSecondSubkey() const;
-	uint16_t recoverRoundSubkey(size_t round_num) const;
-	uint16_t recoverLastSubkey();
+	bool recoverRoundSubkey(size_t round_num, uint16_t& subkey) const;
+	bool recoverLastSubkey(uint16_t& subkey);
+	// All of the above in the order -a uses, every subkey is learned (learnSubkey) right after it's recovered.
+	// false if a round failed, the rounds after it aren't attacked.
+	bool recoverAllSubkeys();
+
+	// Calibration with a known key (e.g. the one given to Generator)
+	//
+	// For every round the attack recovers (4 down to 2, then 0) and every path it selects, measure the real
+	// number of right pairs in the codebook against path.probability * pairs, where the correct subkey ends up
+	// in the histogram and how the counts of the wrong subkeys are distributed. States are counted in order
+	// of active sboxes up to max_active_sboxes (key[4] and key[0] are capped at 2 like in the real attack)
+	// and after each level we note whether every nibble would be guessed right and with what margin.
+	Calibration calibrate(const std::vector<uint16_t>& real_subkeys, size_t max_active_sboxes);
+
+	// Decide what to count for a round, from --heur3/--heur4 or the loaded calibration. The engine is setEngine's
+	// unless given.
+	RoundPlan planRound(size_t round_num) const { return planRound(round_num, m_engine); }
+	RoundPlan planRound(size_t round_num, Engine engine) const;
+
+	// Cost model of ENGINE_AUTO, shared with estimateAttack so rankings agree with the planner. Texts a path of the
+	// engine needs for AUTO_ENGINE_MIN_RIGHT_PAIRS right pairs (INFINITY if p = 0) and partial decryptions of
+	// counting a round on that many texts with states of up to max_active_sboxes sboxes.
+	static double AttackData(Engine engine, double probability);
+	static double AttackWork(Engine engine, double texts, size_t max_active_sboxes);
+
+	// Only looks at the S-box and the paths, not at the codebook (sweep.cpp). The middle rounds count states with up
+	// to max_active_sboxes active sboxes, key[4] and key[0] with 2 like recoverLastSubkey/recoverFirstSubkey.
+	AttackEstimate estimateAttack(Engine engine, size_t max_active_sboxes) const;
+
+	// Whether the codebook plausibly comes from this SPN at all, before spending minutes on it (triage.cpp). Logs the
+	// characteristics it checked and what estimateAttack says the attack costs.
+	enum TriageVerdict : int
+	{
+		TRIAGE_PLAUSIBLE = 0,
+		TRIAGE_IMPLAUSIBLE,
+		TRIAGE_INCONCLUSIVE
+	};
+	TriageVerdict triage() const;
 	
 	// Helper functions
 	//
@@ -150,16 +367,248 @@ public:
 	}
 
 	static const size_t DEFAULT_NUM_OF_THREADS{ 1 };
+	// The counting threads take the work in chunks, this many per thread, elastic ones grow or shrink between them
+	static const size_t WORKER_CHUNKS{ 8 };
+	// ENGINE_AUTO only considers an engine whose best path is expected to have at least this many right pairs (texts)
+	static constexpr double AUTO_ENGINE_MIN_RIGHT_PAIRS{ 8.0 };
+	// Structures the integral engine sums over per nibble and random keys prepareIntegral checks the property on
+	static const size_t INTEGRAL_STRUCTURES{ 32 };
+	static const size_t INTEGRAL_CHECK_KEYS{ 16 };
+	// recountAmbiguous - nibbles below this margin get counted again, at most this many at once per state
+	static constexpr double RECOUNT_MIN_MARGIN{ 0.1 };
+	static const size_t RECOUNT_MAX_GUESSED{ 2 };
+	// checkSubkey - minimal observed / predicted right pairs, values per nibble (every one tied with the best on top
+	// of that) and subkeys tried on a failure, enough for two nibbles where all 16 values tie
+	static constexpr double CHECK_MIN_RATIO{ 0.75 };
+	static const size_t CHECK_NIBBLE_VALUES{ 3 };
+	static const size_t CHECK_MAX_TRIES{ 256 };
+	// Best scoring truncated paths counted per nibble
+	static const size_t TRUNCATED_PATHS{ 4 };
+
+	// Joint histograms have this much per nat of log likelihood ratio, a wrong differential value is expected to
+	// get at least JOINT_MIN_WRONG_PAIRS right pairs
+	static constexpr double JOINT_SCALE{ 1000.0 };
+	static constexpr double JOINT_MIN_WRONG_PAIRS{ 0.5 };
+
+	// Triage counts the TRIAGE_PATHS best characteristics of rounds 1 to Nr - 1 on TRIAGE_PAIRS pairs each (more if
+	// that's less than TRIAGE_MIN_RIGHT_PAIRS right pairs). The codebook doesn't fit if TRIAGE_MAX_MISSES
+	// characteristics have fewer right pairs than TRIAGE_MAX_MISS_PROBABILITY allows or the log likelihood ratio
+	// against a random permutation of all of them is below -TRIAGE_DECISION_LLR (nats). It fits if neither, the ratio
+	// is above TRIAGE_DECISION_LLR and the pairs differing only in the active sbox split by their difference like the
+	// sbox predicts: deviance over the Poisson noise at most TRIAGE_MAX_MISFIT per pair, otherwise it's inconclusive.
+	static const size_t TRIAGE_PATHS{ 8 };
+	static const size_t TRIAGE_PAIRS{ 4096 };
+	static constexpr double TRIAGE_MIN_RIGHT_PAIRS{ 64.0 };
+	static constexpr double TRIAGE_DECISION_LLR{ 10.0 };
+	static constexpr double TRIAGE_MAX_MISS_PROBABILITY{ 1e-8 };
+	static const size_t TRIAGE_MAX_MISSES{ 2 };
+	static constexpr double TRIAGE_MAX_MISFIT{ 0.6 };
+
+	// The first round bypass guesses the key[0] nibbles of every sbox active in round 1, paths with more are skipped
+	static const size_t BYPASS_MAX_FIRST_SBOXES{ 3 };
+
+	// What planMemory counts for each structure, the codebook and its inverse are always there
+	static const size_t CODEBOOK_BYTES{ 2 * 0x10000 * sizeof(uint16_t) };
+	static const size_t COMPOSITE_TABLES_BYTES{ 3 * 0x10000 * sizeof(uint16_t) };
+	static const size_t PEELED_CACHE_BYTES{ 0x10000 * sizeof(uint16_t) };
+	// Pair indices are packed in blocks of PAIR_BLOCK (see PackedPairs). There are 0x8000 pairs at most and with all
+	// the gaps adding up to less than 64K, every block can't need more than 8 bits per gap
+	static const size_t PAIR_BLOCK{ 128 };
+	static const size_t PAIR_INDICES_BYTES{ 0x8000 / PAIR_BLOCK * (PAIR_BLOCK + 8) };
+	// Partitioned histograms buffer this many keys and split them by the top bits into buckets whose counters fit
+	// into L1, once the subkeys times the pairs of a kernel reach PARTITIONED_MIN_WORK
+	static const size_t PARTITION_BUFFER_KEYS{ 8192 };
+	static const size_t PARTITION_BITS{ 4 };
+	static const size_t PARTITIONED_MIN_WORK{ 1 << 24 };
+	// How long to wait for another process building the shared cache before building the tables here, and for the
+	// process that created the segment to size it and write its pid, which it does right away
+	static const size_t SHARED_CACHE_WAIT_SECONDS{ 60 };
+	static const size_t SHARED_CACHE_CLAIM_MS{ 1000 };
+	// Per thread, the partitioned histograms use the same counters and two buffers
+	static const size_t DENSE_HISTOGRAM_BYTES{ 0x10000 * sizeof(uint32_t) + 2 * PARTITION_BUFFER_KEYS * sizeof(uint16_t) };
 
 private:
+	// One hhhh ciphertext per line, exits if the file can't be read
+	static std::vector<uint16_t> ReadCodebook(const std::string& ct_file);
+
 	SPN& m_spn;
 	std::vector<uint16_t> m_pc1;
 	std::vector<uint16_t> m_pc1_forward;
 	std::vector<uint16_t> m_subkeys;
-	VerboseLevel m_verbose{ VERBOSE_NONE };
 	bool m_compute_3_sboxes{ false };
 	bool m_compute_4_sboxes{ false };
 	size_t m_num_of_threads{ DEFAULT_NUM_OF_THREADS };
+	std::unique_ptr<ElasticWorkers> m_elastic;
+	Calibration m_calibration;
+	Engine m_engine{ ENGINE_DIFFERENTIAL };
+	struct IntegralStructure
+	{
+		// Sbox states of the active plaintext nibbles, empty = no structure works
+		std::vector<uint16_t> states;
+		IntegralProperty property{ INTEGRAL_ZERO_SUM };
+	};
+
+	// m_constraints[round] - what's known about each subkey, never permuted
+	std::vector<SubkeyCandidates> m_constraints;
+	// Equations master key bits . row = value from learnSubkey, reduced so every pivot is only in its own row
+	struct KeyEquation
+	{
+		KeySchedule::Row row;
+		bool value;
+		size_t pivot;
+	};
+	std::vector<KeyEquation> m_key_equations;
+
+	// Memory budget (memory.cpp)
+	//
+	// planMemory goes over the structures in the order they pay off: the composite tables are used on every path of
+	// every round, the peeled codebook on every path of a round, the pair indices only save filtering the pairs twice
+	// and the dense histograms (one per thread) only beat maps when a lot of subkeys get counted. Whatever doesn't fit
+	// into the budget (after the codebook) is streamed or recomputed instead.
+	size_t m_memory_budget{ 0 };
+	// setPartitionedHistograms was called, m_partition_histograms is what it said
+	bool m_partition_forced{ false };
+	bool m_partition_histograms{ false };
+	MemoryPlan m_memory_plan;
+	// subst, isubst and isubst(itransp(x)) one after another, m_composite points to them or into the shared cache
+	std::vector<uint16_t> m_composite_tables;
+	const uint16_t* m_composite{ nullptr };
+	// Peeled codebook of m_peeled_round with the subkeys after it as they were in m_peeled_subkeys, see peeledTexts
+	mutable std::vector<uint16_t> m_peeled;
+	mutable size_t m_peeled_round{ 0 };
+	mutable std::vector<uint16_t> m_peeled_subkeys;
+
+	void planMemory();
+	std::vector<uint16_t> buildCompositeTables() const;
+
+	// Shared cache (shared.cpp)
+	//
+	// Everything that only depends on the sbox and the permutation (impossible differentials, truncated patterns,
+	// integral structures and the composite tables) in a POSIX shared memory segment. The first process with the
+	// sbox builds it, the others map it read-only, m_shared keeps the mapping alive.
+	std::shared_ptr<const char> m_shared;
+	const uint16_t* m_shared_composite{ nullptr };
+
+	bool attachSharedCache();
+	std::vector<char> serializeShared() const;
+	// False if the segment doesn't hold together, nothing is loaded then
+	bool loadShared(const char* segment);
+
+	// Path cache (optimize.cpp)
+	//
+	// A round of the search only depends on the difference (mask) it starts from and the tables, not on which round
+	// it is, so the characteristics of key[4], key[3] and key[2] share them. factors are what the sboxes multiplied
+	// the probability by in order, a cached round gives the very same doubles the search would.
+	struct CachedRound
+	{
+		uint16_t round_in;
+		size_t sbox_count;
+		double factors[4];
+		uint64_t lines;
+	};
+
+	bool m_path_cache_enabled{ false };
+	mutable std::unordered_map<uint32_t, CachedRound> m_path_cache;
+	std::vector<std::pair<uint32_t, CachedRound>> m_forgotten_paths;
+	mutable size_t m_path_lookups{ 0 };
+	mutable size_t m_path_searches{ 0 };
+
+	static constexpr uint32_t PathCacheKey(bool linear, bool forward, uint16_t prev_round_in)
+	{
+		return (linear ? 1u << 17 : 0) | (forward ? 1u << 16 : 0) | prev_round_in;
+	}
+	// false if the cache is off or doesn't have it, otherwise probability is multiplied like the search would
+	bool cachedRound(uint32_t key, uint16_t& round_in, double& probability) const;
+	void cacheRound(uint32_t key, const CachedRound& round) const;
+
+	uint16_t substBlock(uint16_t x) const { return m_memory_plan.composite_tables ? m_composite[x] : m_spn.subst(x); }
+	uint16_t isubstBlock(uint16_t x) const { return m_memory_plan.composite_tables ? m_composite[0x10000 + x] : m_spn.isubst(x); }
+	// One middle round backward without the key
+	uint16_t isubstItransp(uint16_t x) const { return m_memory_plan.composite_tables ? m_composite[0x20000 + x] : m_spn.isubst(m_spn.itransp(x)); }
+
+	// Codebook texts with the rounds after round_num peeled off, from the cache if the plan has one, computed on the
+	// fly otherwise. [] is what getProbableMiddleSubkey XORs the subkey into, permuted() undoes the permutation too:
+	// itransp(x ^ k) = itransp(x) ^ itransp(k), so the nibbles of permuted() ^ itransp(key[round_num]) are the sbox
+	// outputs of round_num, each depending on its own subkey nibble (for the last round it's just the ciphertext).
+	class PeeledTexts
+	{
+	public:
+		PeeledTexts(const KeyFinder& finder, size_t round_num, const std::vector<uint16_t>* cache) :
+			m_finder{ finder }, m_round_num{ round_num }, m_cache{ cache } {}
+
+		uint16_t operator[](size_t pt) const { return m_cache != nullptr ? (*m_cache)[pt] : m_finder.peelText(m_finder.m_pc1[pt], m_round_num); }
+		uint16_t permuted(size_t pt) const { return m_round_num == SPN::Nr ? m_finder.m_pc1[pt] : m_finder.m_spn.itransp((*this)[pt]); }
+		size_t size() const { return m_finder.m_pc1.size(); }
+
+	private:
+		const KeyFinder& m_finder;
+		size_t m_round_num;
+		const std::vector<uint16_t>* m_cache;
+	};
+	PeeledTexts peeledTexts(size_t round_num) const;
+
+	enum HistogramBackend
+	{
+		HISTOGRAM_MAP,
+		HISTOGRAM_DENSE,
+		HISTOGRAM_PARTITIONED
+	};
+
+	// A map without dense histograms in the plan, partitioned if the plan says so and the work (subkeys x pairs) of the
+	// kernel is big enough to pay for the buffers
+	HistogramBackend histogramBackend(size_t work) const;
+
+	// Subkey counts of one kernel (thread)
+	//
+	// With a lot of subkeys the increments of the 64K counters land all over them and most miss the cache. The
+	// partitioned backend only appends the keys to a buffer and once it's full, sorts them by the top PARTITION_BITS
+	// into buckets (one counting pass, one scatter pass) and counts one bucket at a time, each one hitting only
+	// 64K >> PARTITION_BITS counters.
+	class Histogram
+	{
+	public:
+		explicit Histogram(HistogramBackend backend);
+
+		void add(uint16_t key)
+		{
+			switch (m_backend)
+			{
+			case HISTOGRAM_MAP:
+				++m_sparse[key];
+				break;
+			case HISTOGRAM_DENSE:
+				++m_dense[key];
+				break;
+			case HISTOGRAM_PARTITIONED:
+				m_buffer[m_buffered++] = key;
+				if (m_buffered == m_buffer.size())
+				{
+					flush();
+				}
+				break;
+			}
+		}
+
+		// Only the keys counted at least once end up in hist, same as with a map
+		void addTo(std::map<uint16_t, size_t>& hist);
+
+	private:
+		HistogramBackend m_backend;
+		std::vector<uint32_t> m_dense;
+		std::map<uint16_t, size_t> m_sparse;
+		std::vector<uint16_t> m_buffer;
+		std::vector<uint16_t> m_partitioned;
+		size_t m_buffered{ 0 };
+
+		void flush();
+	};
+
+	// m_integral_structures[round][nibble], see prepareIntegral
+	std::vector<std::vector<IntegralStructure>> m_integral_structures;
+	// m_impossible_diffs[round][input_diff][nibble] - bit d set = nibble difference d can't happen, see prepareImpossible
+	std::vector<std::map<uint16_t, std::vector<uint16_t>>> m_impossible_diffs;
+	// m_truncated_patterns[round][input_diff][pattern] - probability the sboxes of round - 1 active are exactly pattern
+	std::vector<std::map<uint16_t, std::vector<double>>> m_truncated_patterns;
 
 	// This is a bit of a "magic function", so bear with me
 	//
@@ -194,16 +643,61 @@ private:
 	//
 	// This gives a better statistic that is pretty good(tm).
 	std::vector<HistReturn> getProbableSboxBits(size_t sbox_index, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist) const;
+	std::map<uint16_t, size_t> combineSboxBits(size_t sbox_index, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist) const;
+
+	// recoverRoundSubkey with the round planned already, planned again with the differential engine if the
+	// integral structures don't decide every nibble of this codebook
+	bool recoverPlannedSubkey(size_t round_num, const RoundPlan& plan, uint16_t& subkey) const;
+
+	// Second phase of recoverRoundSubkey for the differential engine
+	//
+	// Nibbles with a single best value and margin of at least RECOUNT_MIN_MARGIN are fixed, the paths of the states
+	// touching the other (ambiguous) ones are counted again with only the ambiguous nibbles guessed and only the
+	// pairs that go through the fixed nibbles right (genPairs). bits of the ambiguous nibbles are replaced.
+	void recountAmbiguous(size_t round_num, const SubkeyCandidates& candidates, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist, std::vector<std::vector<HistReturn>>& bits) const;
+
+	// Sanity check of a chosen subkey before the next round builds on it
+	//
+	// measureSubkey peels the subkey off and returns observed / predicted right pairs of the path (only the full
+	// 16-bit difference counts). checkSubkey measures the best characteristic with every sbox of the round active
+	// (from a single sbox of the round before) and returns the subkey if the ratio is at least CHECK_MIN_RATIO, otherwise the best scoring combination of the top
+	// nibble values that passes.
+	double measureSubkey(size_t round_num, uint16_t subkey, const Path& path, bool forward) const;
+	uint16_t checkSubkey(size_t round_num, uint16_t subkey, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist, const std::vector<std::vector<HistReturn>>& bits, bool permuted) const;
+
+	// (best - second best) / best of the combined histogram of a nibble, 0 if it's a tie
+	double getSboxMargin(size_t sbox_index, const std::map<uint16_t, std::map<uint16_t, size_t>>& sbox_state_to_key_hist) const;
+
+	// Measure a single path for calibrate
+	Calibration::PathStats measurePath(size_t round_num, const Path& path, bool forward, const std::map<uint16_t, size_t>& hist, uint16_t real_subkey) const;
 
 	// This function does the following:
 	//		- generate path to the round we want (using genPath function)
 	//		- direction of the path is based on round_num (0 - forward, 1 - FORBIDDEN, 2 to 4 - backward)
 	//		- there may be multiple paths with the same probability => it combines their histograms into one
-	std::map<uint16_t, size_t> getProbableSubkey(size_t round_num, const SboxState& wanted_sbox) const;
+	std::map<uint16_t, size_t> getProbableSubkey(size_t round_num, const SboxState& wanted_sbox, Engine engine = ENGINE_DIFFERENTIAL, const SubkeyCandidates& candidates = SubkeyCandidates()) const;
+
+	// Paths getProbableSubkey counts for a given round and state, sets direction and round the paths are generated for
+	std::vector<Path> selectPaths(size_t round_num, const SboxState& wanted_sbox, bool& forward, size_t& path_round_num, Engine engine = ENGINE_DIFFERENTIAL) const;
+
+	// Run the decryption function fitting the round on a single path
+	std::map<uint16_t, size_t> countPath(size_t round_num, size_t path_round_num, const Path& path, bool forward, Engine engine = ENGINE_DIFFERENTIAL, const SubkeyCandidates& candidates = SubkeyCandidates()) const;
+
+	// Partially decrypt (encrypt if forward) a text with the subkeys in m_subkeys and the given one for round_num,
+	// returns the input of the sbox layer of round_num (or output of the first one if forward)
+	uint16_t peelToRound(uint16_t text, size_t round_num, uint16_t round_subkey, bool forward) const;
+
+	// Partially decrypt a ciphertext with the subkeys after round_num, result ^ key[round_num] is the sbox output
+	// of round_num permuted (only for round_num < Nr, the last round has no permutation)
+	uint16_t peelText(uint16_t text, size_t round_num) const;
 
 	// Generate input differences for the round we want that satisfy the wanted_sbox mask.
 	// Then we work backwards/forwards using findPathForRound.
 	std::vector<Path> genPath(size_t round_num, const SboxState& wanted_sbox, bool forward = false) const;
+	std::vector<Path> genPath(size_t round_num, const std::set<uint16_t>& output_diffs, bool forward = false) const;
+
+	// All differences (masks for the linear engine) that have exactly the wanted sboxes active
+	std::set<uint16_t> genActiveValues(const SboxState& wanted_sbox) const;
 
 	// Given an input difference, find the best possible input difference for the round up (when going backwards) or down (forwards).
 	// This is achieved by looking through the diff table (normal - when going backwards, transposed - forwards) and looking for
@@ -212,14 +706,175 @@ private:
 	
 	// Decryption functions that are looking for the most probable subkey for a given path
 	//		- generate PC pairs with the given path input difference
+	//		- try only the subkeys candidates allows
 	//		- return a histogram of key: count
 	//
 	// Only getProbableMiddleSubkey is multi-threaded for a very, very good reason.
-	std::map<uint16_t, size_t> getProbableFirstSubkey(const Path& path) const;
-	std::map<uint16_t, size_t> getProbableLastSubkey(const Path& path) const;
-	std::map<uint16_t, size_t> getProbableMiddleSubkey(size_t round_num, const Path& path, bool forward = false) const;
+	std::map<uint16_t, size_t> getProbableFirstSubkey(const Path& path, const SubkeyCandidates& candidates) const;
+	std::map<uint16_t, size_t> getProbableLastSubkey(const Path& path, const SubkeyCandidates& candidates) const;
+	std::map<uint16_t, size_t> getProbableMiddleSubkey(size_t round_num, const Path& path, bool forward, const SubkeyCandidates& candidates) const;
 
-	std::vector<uint16_t> genPCPair(uint16_t input_diff, bool forward = false) const;
+	// Pair enumerator for the decryption functions
+	//
+	// Every unordered pair (i, i ^ path.input_diff) once, returns the smaller i. Pairs whose texts differ under
+	// equal_mask are skipped and so are the ones where some active nibble of the text difference (moved through
+	// itransp if permuted) can't become path.output_diff through the sbox according to the DDT, no subkey
+	// would count them. Without permuted, nibbles with a single candidate drop the pairs they don't decrypt right.
+	//
+	// PairFilter is the check of a single pair, the kernels use it directly when the memory plan has no pair indices.
+	struct PairFilter
+	{
+		const KeyFinder* finder;
+		uint16_t input_diff;
+		uint16_t output_diff;
+		uint16_t equal_mask;
+		bool forward;
+		bool permuted;
+		uint16_t feasible[4];
+		uint16_t fixed_key;
+		uint16_t fixed_mask;
+
+		bool accepts(uint16_t text1, uint16_t text2) const;
+	};
+	PairFilter makePairFilter(const Path& path, uint16_t equal_mask, bool forward, bool permuted, const SubkeyCandidates& candidates) const;
+
+	// Pair indices genPairs found (memory.cpp)
+	//
+	// They're sorted, so only the gaps between them are kept: every block of PAIR_BLOCK indices has the first one and
+	// the gaps - 1 after it packed with as many bits as the biggest of them needs. Index j of a block goes into lane
+	// j % 4, each lane is a stream of 32-bit words and the lanes are interleaved word by word, so decoding does the
+	// same shifts on 4 words next to each other and the compiler can do them with SIMD. Dense lists take a few
+	// bits per pair instead of 16, sparse ones about log2 of the average gap. A short last block can take more than
+	// its indices would with the lanes padded to whole words, it keeps them as they are then (RAW_WIDTH).
+	class PackedPairs
+	{
+	public:
+		void push_back(uint16_t i);
+		// Packs the last block, the pairs can be read after that
+		void finish();
+
+		size_t size() const { return m_size; }
+		size_t blocks() const { return m_blocks.size(); }
+		size_t bytes() const { return m_words.size() * sizeof(uint32_t) + m_blocks.size() * sizeof(Block); }
+
+		// Indices of block b into out (PAIR_BLOCK of them at most), returns how many there are
+		size_t decode(size_t b, uint16_t* out) const;
+
+		// f(i) for every index in blocks [first_block, last_block)
+		template <typename F>
+		void forEach(size_t first_block, size_t last_block, F f) const
+		{
+			uint16_t indices[PAIR_BLOCK];
+			for (size_t b = first_block; b < last_block; ++b)
+			{
+				size_t count = decode(b, indices);
+				for (size_t j = 0; j < count; ++j)
+				{
+					f(indices[j]);
+				}
+			}
+		}
+
+	private:
+		struct Block
+		{
+			uint32_t offset;
+			uint16_t first;
+			uint8_t width;
+			uint8_t count;
+		};
+
+		// Block width of raw indices, two per word, low half first
+		static const uint8_t RAW_WIDTH{ 0xff };
+
+		std::vector<Block> m_blocks;
+		std::vector<uint32_t> m_words;
+		std::vector<uint16_t> m_pending;
+		size_t m_size{ 0 };
+
+		void pack();
+	};
+
+	template <typename Texts>
+	PackedPairs genPairs(const Texts& texts, const PairFilter& filter) const;
+	// f(i) for every pair genPairs would return, through the index vector or streamed depending on the memory plan
+	template <typename Texts, typename F>
+	size_t forEachPair(const Texts& texts, const PairFilter& filter, F f) const;
+
+	// Linear engine (linear.cpp)
+	//
+	// Linear paths reuse Path: input_diff is the mask on the plaintext (ciphertext if forward), output_diff the mask
+	// on the sbox input of the round we want (sbox output of the first round if forward) and probability is the
+	// absolute correlation of the approximation (2 * bias), so the attack needs roughly 1 / probability^2 texts.
+	//
+	// genLinearPath/findLinearPathForRound are the genPath/findPathForRound counterparts going through the LAT.
+	//
+	// getLinearSubkey counts the correlation of the approximation over the whole codebook for every candidate subkey
+	// under the output mask at once with the fast Walsh-Hadamard transform and returns key: |correlation|.
+	// For the middle rounds the subkey is moved through the inverse permutation so the nibbles are independent,
+	// the keys in the histogram are itransp(subkey), recoverRoundSubkey takes care of it.
+	std::vector<Path> genLinearPath(size_t from_round, const SboxState& wanted_sbox, bool forward = false) const;
+	uint16_t findLinearPathForRound(size_t round_num, uint16_t prev_round_in_mask, double& correlation, bool forward = false) const;
+	std::map<uint16_t, size_t> getLinearSubkey(size_t round_num, const Path& path) const;
+
+	// Best single sbox path probability of an engine for the round (correlation^2 for linear), used by planRound
+	double bestPathProbability(size_t round_num, Engine engine) const;
+
+	// Integral engine (integral.cpp)
+	//
+	// prepareIntegral checks on random keys which structure (active plaintext nibbles) and property make each
+	// nibble of the sbox input of a round hold for the right subkey only, isIntegralRound tells if every nibble
+	// has one.
+	//
+	// getIntegralSubkey returns key: number of structures in which the property held, only for a single wanted
+	// sbox. Middle round keys are itransp(subkey), same as with the linear engine. The structures only hold on
+	// average over random keys, so unless exactly one allowed value holds in every structure of this codebook the
+	// histogram is empty and recoverRoundSubkey counts the round with the differential engine.
+	void prepareIntegral();
+	bool isIntegralRound(size_t round_num) const;
+	std::map<uint16_t, size_t> getIntegralSubkey(size_t round_num, const SboxState& wanted_sbox, const SubkeyCandidates& candidates) const;
+
+	// Truncated differential engine (truncated.cpp)
+	//
+	// Truncated paths reuse Path: input_diff is the plaintext difference (one active sbox), output_diff has the
+	// bits of the wanted nibble of the sbox input of round_num that are allowed to differ, probability is the sum
+	// over every characteristic keeping the rest of the bits equal.
+	//
+	// prepareTruncated pushes the difference distribution of every such input difference through the DDT,
+	// genTruncatedPath picks the paths that separate the right subkey the most and getTruncatedSubkey counts
+	// key: pairs where no forbidden bit differs. Middle round keys are itransp(subkey), same as with the linear engine.
+	void prepareTruncated();
+	std::vector<Path> genTruncatedPath(size_t round_num, const SboxState& wanted_sbox) const;
+	std::map<uint16_t, size_t> getTruncatedSubkey(size_t round_num, const Path& path) const;
+
+	// Joint engine (joint.cpp)
+	//
+	// getJointSubkey counts the differential and the linear paths of a single wanted sbox and returns
+	// key: the sum of the log likelihood ratios of both (scaled, the lowest one is 0). Only the outer rounds
+	// (isJointRound) have both engines guess the same nibbles, middle rounds go through the differential engine.
+	bool isJointRound(size_t round_num) const;
+	std::map<uint16_t, size_t> getJointSubkey(size_t round_num, const SboxState& wanted_sbox, const SubkeyCandidates& candidates) const;
+
+	// First round bypass (bypass.cpp)
+	//
+	// Bypass paths reuse Path: input_diff is the sbox output difference of round 1, output_diff the difference at
+	// the sbox input of the last round and probability only counts rounds 2 and 3. genBypassPath picks the best
+	// ones with at most BYPASS_MAX_FIRST_SBOXES sboxes active in round 1, getBypassSubkey counts key[4] values on
+	// the pairs of every key[0] guess and returns key: count under the best guess.
+	std::vector<Path> genBypassPath(const SboxState& wanted_sbox) const;
+	std::map<uint16_t, size_t> getBypassSubkey(const Path& path, const SubkeyCandidates& candidates) const;
+
+	// Impossible differential pruning (impossible.cpp)
+	//
+	// prepareImpossible finds for every single sbox plaintext difference (ciphertext difference for key[0]) the
+	// nibble differences at the sbox input of a round (output of the first one) no pair can have, using only
+	// which DDT entries are zero. pruneImpossible drops every subkey nibble that decrypts a pair of the codebook
+	// into one of them, starting from the given candidates (the constraints), and genCandidateSubkeys is
+	// genSubkeysSet without the dropped subkeys (middle rounds only filter whole subkeys by the nibbles, their
+	// candidates are nibbles of itransp(subkey), known bits and listed subkeys are moved back through transp).
+	void prepareImpossible();
+	SubkeyCandidates pruneImpossible(size_t round_num, const SubkeyCandidates& start) const;
+	std::set<uint16_t> genCandidateSubkeys(uint16_t mask, size_t round_num, const SubkeyCandidates& candidates) const;
 	// Thanks PeterM, my vector function was worse
 	std::set<uint16_t> genSubkeysSet(uint16_t mask) const;
 	std::vector<Path> findBestPaths(const std::vector<Path>& paths) const;
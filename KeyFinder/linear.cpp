@@ -0,0 +1,245 @@
+// linear.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+// Linear cryptanalysis (Matsui's algorithm 2) as described in http://www.engr.mun.ca/~howard/PAPERS/ldc_tutorial.pdf
+//
+#include "keyfinder.hpp"
+
+#include <cmath>
+#include <cstdlib>
+
+
+namespace
+{
+	int Parity(uint16_t x)
+	{
+		x ^= x >> 8;
+		x ^= x >> 4;
+		x ^= x >> 2;
+		x ^= x >> 1;
+		return x & 1;
+	}
+
+	// In-place fast Walsh-Hadamard transform, v.size() has to be a power of 2
+	void Fwht(std::vector<int64_t>& v)
+	{
+		for (size_t len = 1; len < v.size(); len <<= 1)
+		{
+			for (size_t i = 0; i < v.size(); i += len << 1)
+			{
+				for (size_t j = i; j < i + len; ++j)
+				{
+					int64_t a = v[j];
+					int64_t b = v[j + len];
+					v[j] = a + b;
+					v[j + len] = a - b;
+				}
+			}
+		}
+	}
+}
+
+
+std::vector<KeyFinder::Path> KeyFinder::genLinearPath(size_t from_round, const SboxState& wanted_sbox, bool forward) const
+{
+	std::vector<Path> paths;
+	for (uint16_t u : genActiveValues(wanted_sbox))
+	{
+		KF_LOG_VERY("linear v%zd=%04hx u%zd=%04hx\n", from_round - 1, m_spn.itransp(u), from_round, u);
+
+		uint16_t prev_round_in_mask = u;
+		double correlation = 1.0;
+		// from_round - 1 because we already did one round
+		for (size_t r = from_round - 1; r >= 1; --r)
+		{
+			prev_round_in_mask = findLinearPathForRound(r, prev_round_in_mask, correlation, forward);
+		}
+
+		KF_LOG_VERY("input mask: %04hx (%04hx)\n", prev_round_in_mask, Mask(prev_round_in_mask));
+		KF_LOG_VERY("output mask: %04hx\n", u);
+		KF_LOG_VERY("correlation: %lf\n", correlation);
+		KF_LOG_VERY("-------------\n");
+
+		paths.push_back(Path(prev_round_in_mask, u, correlation));
+	}
+
+	return paths;
+}
+
+
+uint16_t KeyFinder::findLinearPathForRound(size_t round_num, uint16_t prev_round_in_mask, double& correlation, bool forward) const
+{
+	const auto& linear_table = forward ? m_spn.getTransposedLinearTable() : m_spn.getLinearTable();
+
+	// Masks go through the permutation the same way the bits do
+	uint16_t round_out_mask = forward ? m_spn.transp(prev_round_in_mask) : m_spn.itransp(prev_round_in_mask);
+	uint16_t round_in_mask = 0;
+
+	uint32_t cache_key = PathCacheKey(true, forward, prev_round_in_mask);
+	if (cachedRound(cache_key, round_in_mask, correlation))
+	{
+		return round_in_mask;
+	}
+	CachedRound searched{};
+
+	KF_LOG_VERY("round %zd:\n", round_num);
+	KF_LOG_VERY("\tv%zd=%04hx\n", round_num, round_out_mask);
+
+	for (uint16_t sbox_index : FindSbox(round_out_mask))
+	{
+		uint16_t out = SboxValue(sbox_index, round_out_mask);
+
+		int max_abs = 0;
+		for (uint16_t a = 1; a <= 0xf; ++a)
+		{
+			max_abs = std::max(max_abs, std::abs(static_cast<int>(linear_table[a][out])));
+		}
+
+		correlation *= max_abs / 8.0;
+		searched.factors[searched.sbox_count++] = max_abs / 8.0;
+		searched.lines |= TableLine(true, forward, out);
+
+		// Same as with differences, pick the mask that activates the fewest sboxes in the next round
+		size_t lowest_active_count = 5;
+		for (uint16_t a = 1; a <= 0xf; ++a)
+		{
+			if (std::abs(static_cast<int>(linear_table[a][out])) != max_abs)
+			{
+				continue;
+			}
+
+			uint16_t potential_round_in_mask = round_in_mask | MakeSbox(sbox_index, a);
+			uint16_t next_round_out_mask = forward ? m_spn.transp(potential_round_in_mask) : m_spn.itransp(potential_round_in_mask);
+			size_t next_out_active_count = SboxCount(next_round_out_mask);
+
+			KF_LOG_VERY("\tsbox=%d, a=%d, b=%d, lat=%d, round_in_mask=%04hx, next_out_mask=%04hx, active_count_in_next=%zd\n",
+				sbox_index,
+				a,
+				out,
+				linear_table[a][out],
+				potential_round_in_mask,
+				next_round_out_mask,
+				next_out_active_count);
+
+			if (next_out_active_count < lowest_active_count)
+			{
+				lowest_active_count = next_out_active_count;
+				round_in_mask = potential_round_in_mask;
+			}
+		}
+	}
+
+	KF_LOG_VERY("\tu%zd=%04hx\n", round_num, round_in_mask);
+
+	searched.round_in = round_in_mask;
+	cacheRound(cache_key, searched);
+
+	return round_in_mask;
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::getLinearSubkey(size_t round_num, const Path& path) const
+{
+	bool forward = round_num == 0;
+	auto sboxes = FindSbox(Mask(path.output_diff));
+	size_t bits = 4 * sboxes.size();
+
+	// Active nibbles packed next to each other and back
+	auto compress = [&sboxes](uint16_t x)
+	{
+		uint16_t r = 0;
+		for (uint16_t sbox_index : sboxes)
+		{
+			r = (r << 4) | SboxValue(sbox_index, x);
+		}
+		return r;
+	};
+
+	auto expand = [&sboxes](uint16_t r)
+	{
+		uint16_t x = 0;
+		for (size_t i = 0; i < sboxes.size(); ++i)
+		{
+			x |= MakeSbox(sboxes[i], r >> (4 * (sboxes.size() - 1 - i)));
+		}
+		return x;
+	};
+
+	// f[x] = sum of (-1)^(input mask . text) over texts whose keyed side has x in the active nibbles
+	// g[x] = (-1)^(output mask . sbox(x))
+	//
+	// The correlation for key k is sum over x of f[x] * g[x ^ k], which is a dyadic convolution, so
+	// C = W(W(f) * W(g)) / 2^bits
+	const PeeledTexts peeled = peeledTexts(forward ? SPN::Nr : round_num);
+	std::vector<int64_t> f(static_cast<size_t>(1) << bits, 0);
+	std::vector<int64_t> g(static_cast<size_t>(1) << bits, 0);
+
+	for (uint32_t i = 0; i <= 0xffff; ++i)
+	{
+		uint16_t text;
+		uint16_t keyed;
+
+		if (forward)
+		{
+			// Ciphertext is the known side, plaintext goes into the first round
+			text = static_cast<uint16_t>(i);
+			keyed = m_pc1_forward[i];
+		}
+		else
+		{
+			text = static_cast<uint16_t>(i);
+			keyed = peeled.permuted(i);
+		}
+
+		f[compress(keyed)] += Parity(text & path.input_diff) ? -1 : 1;
+	}
+
+	for (uint32_t x = 0; x < g.size(); ++x)
+	{
+		uint16_t v = expand(static_cast<uint16_t>(x));
+		uint16_t u = forward ? m_spn.subst(v) : m_spn.isubst(v);
+		g[x] = Parity(u & path.output_diff) ? -1 : 1;
+	}
+
+	Fwht(f);
+	Fwht(g);
+	for (size_t x = 0; x < f.size(); ++x)
+	{
+		f[x] *= g[x];
+	}
+	Fwht(f);
+
+	std::map<uint16_t, size_t> hist;
+	for (size_t k = 0; k < f.size(); ++k)
+	{
+		int64_t c = f[k] / static_cast<int64_t>(f.size());
+		hist[expand(static_cast<uint16_t>(k))] = static_cast<size_t>(c < 0 ? -c : c);
+	}
+
+	return hist;
+}
+
+
+double KeyFinder::bestPathProbability(size_t round_num, Engine engine) const
+{
+	double best = 0.0;
+
+	for (uint16_t state = 1; state <= 0xf; ++state)
+	{
+		SboxState s(state);
+		if (s.active.count() != 1)
+		{
+			continue;
+		}
+
+		bool forward = false;
+		size_t path_round_num = round_num;
+		for (const Path& path : selectPaths(round_num, s, forward, path_round_num, engine))
+		{
+			double p = engine == ENGINE_LINEAR ? path.probability * path.probability : path.probability;
+			best = std::max(best, p);
+		}
+	}
+
+	return best;
+}
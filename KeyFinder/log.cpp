@@ -0,0 +1,263 @@
+// log.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+#include "log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+std::atomic<int> Log::s_level{ VERBOSE_NONE };
+
+
+namespace
+{
+	struct Message
+	{
+		uint64_t seq;
+		size_t len;
+		char text[Log::MESSAGE_SIZE];
+	};
+
+	// Single producer (the owning thread), single consumer (the drainer)
+	struct Ring
+	{
+		Message slots[Log::RING_SIZE];
+		std::atomic<size_t> head{ 0 };
+		std::atomic<size_t> tail{ 0 };
+		std::atomic<bool> retired{ false };
+	};
+
+	class Drainer
+	{
+	public:
+		// Never destroyed on purpose, threads may still log while static objects are being torn down
+		static Drainer& instance()
+		{
+			static Drainer* drainer = new Drainer();
+			return *drainer;
+		}
+
+		Ring* registerRing()
+		{
+			Ring* ring = new Ring();
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_rings.push_back(ring);
+
+			return ring;
+		}
+
+		uint64_t nextSeq() { return m_next_seq.fetch_add(1, std::memory_order_relaxed); }
+		bool stopped() const { return m_stopped.load(std::memory_order_acquire); }
+
+		void wake()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_pending = true;
+			}
+			m_cv.notify_one();
+		}
+
+		void flush()
+		{
+			uint64_t target = m_next_seq.load(std::memory_order_relaxed);
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_stopped.load(std::memory_order_relaxed))
+			{
+				return;
+			}
+
+			m_pending = true;
+			m_cv.notify_one();
+			m_done_cv.wait(lock, [this, target] { return m_written >= target || m_stopped.load(std::memory_order_relaxed); });
+		}
+
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_stop)
+				{
+					return;
+				}
+				m_stop = true;
+			}
+			m_cv.notify_one();
+
+			if (m_thread.joinable())
+			{
+				m_thread.join();
+			}
+		}
+
+	private:
+		Drainer()
+		{
+			m_thread = std::thread([this] { run(); });
+			atexit([] { Drainer::instance().stop(); });
+		}
+
+		// Called with m_mutex held
+		void collect(std::vector<Message>& batch)
+		{
+			for (auto it = m_rings.begin(); it != m_rings.end();)
+			{
+				Ring* ring = *it;
+				bool retired = ring->retired.load(std::memory_order_acquire);
+
+				size_t tail = ring->tail.load(std::memory_order_relaxed);
+				size_t head = ring->head.load(std::memory_order_acquire);
+				for (size_t i = tail; i != head; ++i)
+				{
+					batch.push_back(ring->slots[i % Log::RING_SIZE]);
+				}
+				ring->tail.store(head, std::memory_order_release);
+
+				// The owner is gone and everything it wrote is collected
+				if (retired)
+				{
+					delete ring;
+					it = m_rings.erase(it);
+				}
+				else
+				{
+					++it;
+				}
+			}
+		}
+
+		void run()
+		{
+			std::vector<Message> batch;
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			for (;;)
+			{
+				m_cv.wait_for(lock, std::chrono::milliseconds(20), [this] { return m_pending || m_stop; });
+				m_pending = false;
+
+				batch.clear();
+				collect(batch);
+
+				if (!batch.empty())
+				{
+					lock.unlock();
+
+					std::sort(batch.begin(), batch.end(), [](const Message& a, const Message& b) { return a.seq < b.seq; });
+					for (const Message& m : batch)
+					{
+						fwrite(m.text, 1, m.len, stderr);
+					}
+					fflush(stderr);
+
+					lock.lock();
+					m_written += batch.size();
+					m_done_cv.notify_all();
+				}
+
+				// Writers that already took a sequence number may not have published it yet
+				if (m_stop && m_written >= m_next_seq.load(std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+
+			m_stopped.store(true, std::memory_order_release);
+			m_done_cv.notify_all();
+		}
+
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		std::condition_variable m_done_cv;
+		std::vector<Ring*> m_rings;
+		std::thread m_thread;
+		std::atomic<uint64_t> m_next_seq{ 0 };
+		std::atomic<bool> m_stopped{ false };
+		uint64_t m_written{ 0 };
+		bool m_pending{ false };
+		bool m_stop{ false };
+	};
+
+	// Marks the ring as retired when its thread exits, the drainer frees it
+	struct RingHolder
+	{
+		Ring* ring{ nullptr };
+
+		Ring* get()
+		{
+			if (ring == nullptr)
+			{
+				ring = Drainer::instance().registerRing();
+			}
+			return ring;
+		}
+
+		~RingHolder()
+		{
+			if (ring != nullptr)
+			{
+				ring->retired.store(true, std::memory_order_release);
+			}
+		}
+	};
+
+	thread_local RingHolder t_ring;
+}
+
+
+void Log::write(const char* fmt, ...)
+{
+	Drainer& drainer = Drainer::instance();
+
+	va_list args;
+	va_start(args, fmt);
+
+	// Too late for the background thread, just write it out directly
+	if (drainer.stopped())
+	{
+		vfprintf(stderr, fmt, args);
+		va_end(args);
+		return;
+	}
+
+	Ring* ring = t_ring.get();
+
+	size_t head = ring->head.load(std::memory_order_relaxed);
+	while (head - ring->tail.load(std::memory_order_acquire) >= RING_SIZE)
+	{
+		drainer.wake();
+		std::this_thread::yield();
+	}
+
+	Message& m = ring->slots[head % RING_SIZE];
+	int len = vsnprintf(m.text, sizeof(m.text), fmt, args);
+	va_end(args);
+
+	m.len = len < 0 ? 0 : std::min(static_cast<size_t>(len), sizeof(m.text) - 1);
+	m.seq = drainer.nextSeq();
+	ring->head.store(head + 1, std::memory_order_release);
+
+	// The drainer polls anyway, only poke it when we are getting close to blocking
+	if (head + 1 - ring->tail.load(std::memory_order_relaxed) >= RING_SIZE / 2)
+	{
+		drainer.wake();
+	}
+}
+
+
+void Log::flush()
+{
+	Drainer::instance().flush();
+}
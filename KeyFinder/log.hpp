@@ -0,0 +1,76 @@
+// log.hpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Low-overhead logging for the attack code.
+//
+// Every thread formats its messages into its own ring buffer, a single background thread drains
+// all the rings (ordered by a global sequence number) and is the only one that ever touches stderr.
+// This way the worker threads never block on stderr and their output doesn't get interleaved.
+//
+// VERBOSE_VERY sites are compiled out completely in release builds (NDEBUG), define
+// KEYFINDER_LOG_VERY to keep them.
+//
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+
+enum VerboseLevel : int
+{
+	VERBOSE_NONE = 0,
+	VERBOSE_INFO,
+	VERBOSE_MEDIUM,
+	VERBOSE_VERY
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KF_PRINTF_FORMAT(fmt_index, args_index) __attribute__((format(printf, fmt_index, args_index)))
+#else
+#define KF_PRINTF_FORMAT(fmt_index, args_index)
+#endif
+
+
+class Log
+{
+public:
+	static void setLevel(int level) { s_level.store(level, std::memory_order_relaxed); }
+	static int level() { return s_level.load(std::memory_order_relaxed); }
+	static bool enabled(int level) { return level <= s_level.load(std::memory_order_relaxed); }
+
+	// Format the message into the ring buffer of the calling thread. Never writes to stderr itself.
+	static void write(const char* fmt, ...) KF_PRINTF_FORMAT(1, 2);
+
+	// Block until everything written so far (by any thread) is on stderr.
+	static void flush();
+
+	// Size of a single message slot, longer messages are truncated
+	static const size_t MESSAGE_SIZE{ 248 };
+	// Number of slots in a per-thread ring
+	static const size_t RING_SIZE{ 256 };
+
+private:
+	static std::atomic<int> s_level;
+};
+
+
+// Usage: KF_LOG(VERBOSE_INFO, "processed: %zd/%zd\n", processed, total);
+//
+// The arguments are not evaluated at all if the level is not enabled.
+#define KF_LOG(lvl, ...) \
+	do \
+	{ \
+		if (Log::enabled(lvl)) \
+		{ \
+			Log::write(__VA_ARGS__); \
+		} \
+	} while (0)
+
+#if defined(NDEBUG) && !defined(KEYFINDER_LOG_VERY)
+#define KF_LOG_VERY_ENABLED 0
+#define KF_LOG_VERY(...) do {} while (0)
+#else
+#define KF_LOG_VERY_ENABLED 1
+#define KF_LOG_VERY(...) KF_LOG(VERBOSE_VERY, __VA_ARGS__)
+#endif
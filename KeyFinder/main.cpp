@@ -4,8 +4,13 @@
 // Last subkey recovery algorithm by http://www.engr.mun.ca/~howard/PAPERS/ldc_tutorial.pdf
 //
 #include "keyfinder.hpp"
+#include "sweep.hpp"
+#include "optimize.hpp"
 #include "cxxopts.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -23,6 +28,15 @@ int main(int argc, char** argv)
 	bool compute_4_sboxes = false;
 
 	size_t num_of_threads = KeyFinder::DEFAULT_NUM_OF_THREADS;
+	std::string memory_budget = "0";
+	bool shared_cache = false;
+	std::string partition_histograms = "auto";
+	bool elastic = false;
+	std::string engine = "differential";
+	std::string key_schedule_name = "independent";
+	std::string permutation_spec = "transpose";
+	std::vector<std::string> constraints;
+	std::vector<std::string> candidate_lists;
 
 	// Mode
 	bool first_subkey_only = false;
@@ -31,7 +45,14 @@ int main(int argc, char** argv)
 	std::vector<std::string> backward_subkeys;
 	bool find_all_subkeys = false;
 	bool print_diff_table = false;
+	bool triage = false;
+	std::string sweep_filename;
+	bool sweep_attack = false;
+	size_t optimize_steps = 0;
+	size_t optimize_chains = 0;
 	std::string given_key;
+	std::string calibration_key;
+	std::string calibration_filename;
 	
 	int verbose = KeyFinder::VerboseLevel::VERBOSE_NONE;
 
@@ -54,7 +75,7 @@ int main(int argc, char** argv)
 			("h,help", "Print help")
 			("v,verbose",
 				"Print more descriptive messages."
-				" 1 = more info, 2 = medium info, 3 = VERY detailed",
+				" 1 = more info, 2 = medium info, 3 = VERY detailed (debug builds only)",
 				cxxopts::value<int>(verbose), "N")
 			("ciphertext_list",
 				"List of ciphertexts, each line in hhhh format.",
@@ -65,6 +86,23 @@ int main(int argc, char** argv)
 			("t,threads",
 				"Number of threads to use (default: " + std::to_string(num_of_threads) + ")",
 				cxxopts::value<size_t>(num_of_threads), "N")
+			("elastic",
+				"Take -t as the most threads and run only as many as the cgroup v2 CPU quota (cpu.max) and the other"
+				" tasks on the cores it may run on leave room for, checked again while counting",
+				cxxopts::value<bool>(elastic))
+			("memory-budget",
+				"Keep at most this many MiB of lookup tables, cached texts, pair lists and histograms,"
+				" recomputing or streaming the rest (default: 0, no limit). Fractions like 0.5 or a K or M suffix"
+				" (512K) work for the budgets under 1 MiB.",
+				cxxopts::value<std::string>(memory_budget), "MiB")
+			("partition-histograms",
+				"Count kernels with a lot of subkeys one bucket of keys at a time: on, off or auto (default, on when the L2"
+				" cache of a core can't hold the histogram next to the tables). Without a value it's on.",
+				cxxopts::value<std::string>(partition_histograms)->implicit_value("on"), "when")
+			("shared-cache",
+				"Share the tables that only depend on the sbox and the permutation with other KeyFinder processes through"
+				" POSIX shared memory, the first one builds them and the rest map them (not on Windows)",
+				cxxopts::value<bool>(shared_cache))
 			("heur3",
 				"Use 3 sboxes for subkey computation when generating best paths."
 				" More accurate than just 2 sboxes (default), but ~10x slower.",
@@ -73,7 +111,30 @@ int main(int argc, char** argv)
 				"Use 4 sboxes for subkey computation when generating best paths."
 				" Best accuracy, but takes ~5x longer than 3 sboxes."
 				" This enables --heur3 as well.",
-				cxxopts::value<bool>(compute_4_sboxes));
+				cxxopts::value<bool>(compute_4_sboxes))
+			("engine",
+				"How to count the subkey histograms: differential, linear (Matsui's algorithm 2 over the known plaintexts),"
+				" integral (outer subkeys from plaintext structures), truncated (truncated differentials),"
+				" joint (outer subkeys ranked by differential and linear paths together), bypass (key[4] with a trail one"
+				" round shorter, plaintext structures get through round 1) or auto (whichever needs less data for each round)",
+				cxxopts::value<std::string>(engine), "name")
+			("key-schedule",
+				"Key schedule the ciphertexts were made with: independent (80-bit key = the 5 subkeys, default), rotate (32-bit key,"
+				" key[i] = top 16 bits of it rotated left by 4i) or a file with the GF(2) matrix (see README). Bits of recovered subkeys"
+				" are pushed through it and only the free bits of the other subkeys are counted.",
+				cxxopts::value<std::string>(key_schedule_name), "name")
+			("permutation",
+				"Bit permutation between the sbox layers: transpose (default), 16 positions where bits 0-15 go (numbered from"
+				" the most significant one, e.g. \"0 4 8 12 1 5 9 13 2 6 10 14 3 7 11 15\" is the transpose) or a file with them",
+				cxxopts::value<std::string>(permutation_spec), "positions")
+			("constraint",
+				"Known bits of a subkey, comma-separated, e.g. key[2]=f00f:a003 for key[2] = a??3 (mask:value in hex)."
+				" Only subkeys matching them are counted.",
+				cxxopts::value<std::vector<std::string>>(constraints), "key[i]=mask:value")
+			("candidates",
+				"Subkeys a subkey can be, comma-separated, e.g. key[3]=list.txt with one hhhh per line."
+				" Only subkeys from the list are counted.",
+				cxxopts::value<std::vector<std::string>>(candidate_lists), "key[i]=filename");
 
 		options.add_options("Mode")
 			("f,first", "Calculate first subkey only", cxxopts::value<bool>(first_subkey_only))
@@ -86,12 +147,39 @@ int main(int argc, char** argv)
 				cxxopts::value<std::vector<std::string>>(), "key5,key4,..")
 			("a,find-all",
 				"Try to find all subkeys. This enables Heur3 and Heur4. CAUTION: THIS TAKES A LONG TIME!", cxxopts::value<bool>(find_all_subkeys))
+			("triage",
+				"Only check in milliseconds whether the ciphertexts plausibly come from this SPN (the right pairs of the best"
+				" characteristics against a random permutation) and what the attack would cost. Exits with 0 if they do,"
+				" 1 if they don't, 2 if it can't tell",
+				cxxopts::value<bool>(triage))
 			("test-key",
 				"Given a key in aaaabbbbccccddddeeee format, test if encrypting plaintexts results in given ciphertexts",
 				cxxopts::value<std::string>(given_key), "key")
+			("calibrate",
+				"Given the real key in aaaabbbbccccddddeeee format, measure how the selected paths perform on the ciphertexts."
+				" Counts up to the sboxes allowed by --heur3/--heur4. Saved to --calibration-file if given.",
+				cxxopts::value<std::string>(calibration_key), "key")
+			("calibration-file",
+				"File the calibration is saved to (with --calibrate) or loaded from (otherwise) to decide"
+				" how many sboxes to count, when to stop early and which paths to use",
+				cxxopts::value<std::string>(calibration_filename), "filename")
 			("d,diff-table",
 				"Print diff table for the given sbox",
-				cxxopts::value<bool>(print_diff_table));
+				cxxopts::value<bool>(print_diff_table))
+			("sweep",
+				"Rank the S-boxes in the file (one per line like <SBOX>) by the predicted cost of the differential and linear attacks,"
+				" -t of them at a time. No <CIPHERTEXT_LIST> or <SBOX> needed.",
+				cxxopts::value<std::string>(sweep_filename), "filename")
+			("sweep-attack",
+				"With --sweep, also run -a with --engine on every S-box under a random key",
+				cxxopts::value<bool>(sweep_attack))
+			("optimize",
+				"Hill climb from random S-boxes towards the ones the differential and linear attacks cost the most, swapping"
+				" two outputs per step, and rank the best S-box of every chain like --sweep. No <CIPHERTEXT_LIST> or <SBOX> needed.",
+				cxxopts::value<size_t>(optimize_steps), "steps")
+			("optimize-chains",
+				"Chains to climb with --optimize, -t of them at a time (default: -t)",
+				cxxopts::value<size_t>(optimize_chains), "count");
 
 		options.parse_positional({ "ciphertext_list", "sbox" });
 		auto result = options.parse(argc, argv);
@@ -102,13 +190,13 @@ int main(int argc, char** argv)
 			exit(0);
 		}
 
-		if (!result.count("ciphertext_list"))
+		if (!result.count("ciphertext_list") && !result.count("sweep") && !result.count("optimize"))
 		{
 			std::cerr << options.help() << '\n';
 			exit(0);
 		}
 
-		if (!result.count("sbox"))
+		if (!result.count("sbox") && !result.count("sweep") && !result.count("optimize"))
 		{
 			std::cerr << options.help() << '\n';
 			exit(0);
@@ -151,40 +239,321 @@ int main(int argc, char** argv)
 
 	SPN spn;
 	spn.setSboxes(const_cast<char*>(sbox.c_str()));
+
+	KeySchedule key_schedule;
+	if (!key_schedule.load(key_schedule_name))
+	{
+		std::cout << "Error: could not load key schedule " << key_schedule_name << '\n';
+		return EXIT_FAILURE;
+	}
+	spn.setKeySchedule(key_schedule);
+
+	BitPermutation permutation;
+	if (!permutation.load(permutation_spec))
+	{
+		std::cout << "Error: could not load permutation " << permutation_spec << '\n';
+		return EXIT_FAILURE;
+	}
+	spn.setPermutation(permutation);
+
 	spn.calculateDiffTable();
+	spn.calculateLinearTable();
+
+	KeyFinder::Engine engine_value = KeyFinder::ENGINE_DIFFERENTIAL;
+	if (engine == "differential")
+	{
+		engine_value = KeyFinder::ENGINE_DIFFERENTIAL;
+	}
+	else if (engine == "linear")
+	{
+		engine_value = KeyFinder::ENGINE_LINEAR;
+	}
+	else if (engine == "integral")
+	{
+		engine_value = KeyFinder::ENGINE_INTEGRAL;
+	}
+	else if (engine == "truncated")
+	{
+		engine_value = KeyFinder::ENGINE_TRUNCATED;
+	}
+	else if (engine == "joint")
+	{
+		engine_value = KeyFinder::ENGINE_JOINT;
+	}
+	else if (engine == "bypass")
+	{
+		engine_value = KeyFinder::ENGINE_BYPASS;
+	}
+	else if (engine == "auto")
+	{
+		engine_value = KeyFinder::ENGINE_AUTO;
+	}
+	else
+	{
+		KF_LOG(VERBOSE_NONE, "unknown engine %s\n", engine.c_str());
+		return EXIT_FAILURE;
+	}
+
+	// MiB unless it says otherwise
+	size_t memory_budget_bytes = 0;
+	{
+		double amount = 0.0;
+		int length = 0;
+		std::string unit;
+		if (sscanf(memory_budget.c_str(), "%lf%n", &amount, &length) == 1)
+		{
+			unit = memory_budget.substr(length);
+		}
+
+		double factor = 0.0;
+		if (unit.empty() || unit == "M" || unit == "m" || unit == "MiB")
+		{
+			factor = 1024.0 * 1024.0;
+		}
+		else if (unit == "K" || unit == "k" || unit == "KiB")
+		{
+			factor = 1024.0;
+		}
+
+		if (length == 0 || factor == 0.0 || !(amount >= 0.0) || amount * factor > static_cast<double>(SIZE_MAX))
+		{
+			KF_LOG(VERBOSE_NONE, "cant parse memory budget: %s\n", memory_budget.c_str());
+			return EXIT_FAILURE;
+		}
+
+		memory_budget_bytes = static_cast<size_t>(amount * factor);
+	}
+
+	if (partition_histograms != "auto" && partition_histograms != "on" && partition_histograms != "off")
+	{
+		KF_LOG(VERBOSE_NONE, "--partition-histograms takes on, off or auto, not %s\n", partition_histograms.c_str());
+		return EXIT_FAILURE;
+	}
+
+	Log::setLevel(verbose);
+
+	if (!sweep_filename.empty())
+	{
+		Sweep sweep;
+		if (!sweep.load(sweep_filename))
+		{
+			return EXIT_FAILURE;
+		}
+
+		KF_LOG(VERBOSE_NONE, "sweeping %zd sboxes on %zd thread(s)%s\n", sweep.entries.size(), num_of_threads, sweep_attack ? " with attacks" : "");
+		auto start = std::chrono::steady_clock::now();
+
+		sweep.run(spn, engine_value, num_of_threads, sweep_attack);
+		sweep.rank();
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+		KF_LOG(VERBOSE_NONE, "took: %gs\n", elapsed.count() / 1000.0f);
+		Log::flush();
+
+		sweep.print(stdout);
+		return EXIT_SUCCESS;
+	}
+
+	if (optimize_steps != 0)
+	{
+		Optimizer optimizer;
+		size_t chains = optimize_chains != 0 ? optimize_chains : num_of_threads;
+
+		KF_LOG(VERBOSE_NONE, "optimizing %zd chains of %zd steps on %zd thread(s)\n", chains, optimize_steps, num_of_threads);
+		auto start = std::chrono::steady_clock::now();
+
+		optimizer.run(spn, chains, optimize_steps, num_of_threads);
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+		double seconds = std::max(elapsed.count() / 1000.0, 0.001);
+		KF_LOG(VERBOSE_NONE, "took: %gs, %zd candidates (%.0f per hour), %zd of %zd rounds of characteristics searched for\n",
+			seconds, optimizer.candidates, optimizer.candidates / seconds * 3600, optimizer.path_searches, optimizer.path_lookups);
+
+		Sweep sweep = optimizer.toSweep();
+		sweep.run(spn, engine_value, num_of_threads, false);
+		sweep.rank();
+		Log::flush();
+
+		sweep.print(stdout);
+		return EXIT_SUCCESS;
+	}
 
-	KeyFinder finder(ciphertext_list_filename, spn, num_of_threads, compute_3_sboxes, compute_4_sboxes);
+	KeyFinder finder(ciphertext_list_filename, spn, num_of_threads, compute_3_sboxes, compute_4_sboxes, shared_cache);
 	finder.setVerbose(verbose);
+	finder.setEngine(engine_value);
+
+	if (memory_budget_bytes != 0)
+	{
+		finder.setMemoryBudget(memory_budget_bytes);
+	}
+
+	if (partition_histograms != "auto")
+	{
+		finder.setPartitionedHistograms(partition_histograms == "on");
+	}
+
+	if (elastic)
+	{
+		finder.setElastic(true);
+	}
 
-	std::cerr << "will use " << num_of_threads << " thread(s)\n";
+	for (const auto& c : constraints)
+	{
+		size_t round_num = 0;
+		uint16_t mask = 0;
+		uint16_t value = 0;
+		int length = 0;
+		if (sscanf(c.c_str(), "key[%zd]=%hx:%hx%n", &round_num, &mask, &value, &length) != 3 || static_cast<size_t>(length) != c.size() || round_num > SPN::Nr)
+		{
+			KF_LOG(VERBOSE_NONE, "cant parse constraint: %s\n", c.c_str());
+			return EXIT_FAILURE;
+		}
+
+		if (!finder.addConstraint(round_num, mask, value))
+		{
+			KF_LOG(VERBOSE_NONE, "constraint %s contradicts the ones before it\n", c.c_str());
+			return EXIT_FAILURE;
+		}
+
+		KF_LOG(VERBOSE_NONE, "using a constraint key[%zd] & %04hx = %04hx\n", round_num, mask, static_cast<uint16_t>(value & mask));
+	}
+
+	for (const auto& c : candidate_lists)
+	{
+		size_t round_num = 0;
+		int offset = 0;
+		if (sscanf(c.c_str(), "key[%zd]=%n", &round_num, &offset) != 1 || offset == 0 || round_num > SPN::Nr)
+		{
+			KF_LOG(VERBOSE_NONE, "cant parse candidates: %s\n", c.c_str());
+			return EXIT_FAILURE;
+		}
+
+		std::ifstream list(c.substr(offset));
+		if (!list.is_open())
+		{
+			KF_LOG(VERBOSE_NONE, "could not open file %s\n", c.substr(offset).c_str());
+			return EXIT_FAILURE;
+		}
+
+		std::vector<uint16_t> subkeys;
+		std::string line;
+		size_t line_num = 0;
+		while (std::getline(list, line))
+		{
+			++line_num;
+			size_t start = line.find_first_not_of(" \t\r");
+			if (start == std::string::npos || line[start] == '#')
+			{
+				continue;
+			}
+
+			uint16_t key = 0;
+			int length = 0;
+			if (!isxdigit(static_cast<unsigned char>(line[start])) || sscanf(line.c_str(), " %4hx %n", &key, &length) != 1 ||
+				static_cast<size_t>(length) != line.size())
+			{
+				KF_LOG(VERBOSE_NONE, "cant parse candidate in %s:%zd: %s\n", c.substr(offset).c_str(), line_num, line.c_str());
+				return EXIT_FAILURE;
+			}
+
+			subkeys.push_back(key);
+		}
+
+		if (!finder.addCandidates(round_num, subkeys))
+		{
+			KF_LOG(VERBOSE_NONE, "none of the candidates in %s are allowed by the constraints\n", c.c_str());
+			return EXIT_FAILURE;
+		}
+
+		KF_LOG(VERBOSE_NONE, "using %zd candidates for key[%zd]\n", subkeys.size(), round_num);
+	}
+
+	if (!calibration_filename.empty() && calibration_key.empty())
+	{
+		Calibration calibration;
+		if (!calibration.load(calibration_filename))
+		{
+			KF_LOG(VERBOSE_NONE, "could not load calibration from %s\n", calibration_filename.c_str());
+			return EXIT_FAILURE;
+		}
+
+		if (calibration.sbox != spn.getSbox())
+		{
+			KF_LOG(VERBOSE_NONE, "calibration in %s was done for a different sbox\n", calibration_filename.c_str());
+			return EXIT_FAILURE;
+		}
+
+		if (calibration.permutation != spn.getPermutation().getPositions())
+		{
+			KF_LOG(VERBOSE_NONE, "calibration in %s was done for a different permutation\n", calibration_filename.c_str());
+			return EXIT_FAILURE;
+		}
+
+		finder.setCalibration(calibration);
+		KF_LOG(VERBOSE_NONE, "using calibration from %s\n", calibration_filename.c_str());
+	}
+
+	KF_LOG(VERBOSE_NONE, "will use %zd thread(s)\n", num_of_threads);
+	KF_LOG(VERBOSE_INFO, "permutation uses %s%s\n", spn.getPermutation().getKindName(),
+		spn.getPermutation().isInvolution() ? "" : ", not an involution");
+	if (spn.getCircuit().usesTable() || spn.getInverseCircuit().usesTable())
+	{
+		KF_LOG(VERBOSE_NONE, "no sbox circuit found, looking the sbox up in a table (slower)\n");
+	}
+	KF_LOG(VERBOSE_INFO, "sbox circuit has %zd gates, the inverse %zd\n", spn.getCircuit().size(), spn.getInverseCircuit().size());
 
 	if (compute_3_sboxes)
 	{
-		std::cerr << "will use 3 sboxes!\n";
+		KF_LOG(VERBOSE_NONE, "will use 3 sboxes!\n");
 	}
 
 	if (compute_4_sboxes)
 	{
-		std::cerr << "will use 4 sboxes!\n";
+		KF_LOG(VERBOSE_NONE, "will use 4 sboxes!\n");
+	}
+
+	if (triage)
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		KeyFinder::TriageVerdict verdict = finder.triage();
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		KF_LOG(VERBOSE_NONE, "took: %gs\n", elapsed.count() / 1e6);
+		Log::flush();
+
+		return verdict;
 	}
 
 	if (first_subkey_only)
 	{
-		uint16_t k0 = finder.recoverFirstSubkey();
+		uint16_t k0 = 0;
+		if (!finder.recoverFirstSubkey(k0))
+		{
+			Log::flush();
+			return EXIT_FAILURE;
+		}
+		Log::flush();
 		printf("%04hx\n", k0);
-		finder.getSubkeys()[0] = k0;
+		finder.learnSubkey(0, k0);
 	}
 	else if (last_subkey_only)
 	{
-		uint16_t k4 = finder.recoverLastSubkey();
+		uint16_t k4 = 0;
+		if (!finder.recoverLastSubkey(k4))
+		{
+			Log::flush();
+			return EXIT_FAILURE;
+		}
+		Log::flush();
 		printf("%04hx\n", k4);
-		finder.getSubkeys()[SPN::Nr] = k4;
+		finder.learnSubkey(SPN::Nr, k4);
 	}
 	else if (!subkeys_for_second.empty())
 	{
 		if (subkeys_for_second.size() != 5)
 		{
-			std::cerr << "wrong number of keys\n";
+			KF_LOG(VERBOSE_NONE, "wrong number of keys\n");
 			return EXIT_FAILURE;
 		}
 
@@ -199,19 +568,20 @@ int main(int argc, char** argv)
 			uint16_t key = 0;
 			if (sscanf(subkeys_for_second[i].c_str(), "%04hx", &key) != 1)
 			{
-				std::cerr << "cant parse key in list: " << subkeys_for_second[i] << '\n';
+				KF_LOG(VERBOSE_NONE, "cant parse key in list: %s\n", subkeys_for_second[i].c_str());
 				return EXIT_FAILURE;
 			}
 
-			finder.getSubkeys()[i] = key;
-			fprintf(stderr, "using a given key[%zd]=%04hx\n", i, key);
+			finder.learnSubkey(i, key);
+			KF_LOG(VERBOSE_NONE, "using a given key[%zd]=%04hx\n", i, key);
 		}
 
 		uint16_t k1 = finder.recoverSecondSubkey();
-		finder.getSubkeys()[1] = k1;
+		finder.learnSubkey(1, k1);
 
 		std::string key = finder.getKeyStr();
-		std::cerr << "full key: " << key << '\n';
+		KF_LOG(VERBOSE_NONE, "full key: %s\n", key.c_str());
+		Log::flush();
 
 		std::cout << key << '\n';
 		std::cout << "key is " << (finder.testKey(key) ? "ok" : "wrong") << '\n';
@@ -225,87 +595,112 @@ int main(int argc, char** argv)
 			uint16_t key = 0;
 			if (sscanf(backward_subkeys[i].c_str(), "%04hx", &key) != 1)
 			{
-				std::cerr << "cant parse key in list: " << backward_subkeys[i] << '\n';
+				KF_LOG(VERBOSE_NONE, "cant parse key in list: %s\n", backward_subkeys[i].c_str());
 				return EXIT_FAILURE;
 			}
 
-			finder.getSubkeys()[SPN::Nr - i] = key;
-			fprintf(stderr, "using a given key[%zd]=%04hx\n", SPN::Nr - i, key);
+			finder.learnSubkey(SPN::Nr - i, key);
+			KF_LOG(VERBOSE_NONE, "using a given key[%zd]=%04hx\n", SPN::Nr - i, key);
 		}
 
 		auto start = std::chrono::steady_clock::now();
 
 		size_t wanted_key_index = SPN::Nr - i;
-		fprintf(stderr, "wanted key[%zd]\n", wanted_key_index);
+		KF_LOG(VERBOSE_NONE, "wanted key[%zd]\n", wanted_key_index);
 
 		if (wanted_key_index <= 1)
 		{
-			std::cerr << "this does not work for key[0], key[1] properly, use another method\n";
+			KF_LOG(VERBOSE_NONE, "this does not work for key[0], key[1] properly, use another method\n");
 			return EXIT_FAILURE;
 		}
 
-		fprintf(stderr, "starting key[%zd] recovery\n", wanted_key_index);
-		uint16_t key = finder.recoverRoundSubkey(wanted_key_index);
-		finder.getSubkeys()[wanted_key_index] = key;
+		KF_LOG(VERBOSE_NONE, "starting key[%zd] recovery\n", wanted_key_index);
+		uint16_t key = 0;
+		if (!finder.recoverRoundSubkey(wanted_key_index, key))
+		{
+			Log::flush();
+			return EXIT_FAILURE;
+		}
+		finder.learnSubkey(wanted_key_index, key);
+		Log::flush();
 		printf("key[%zd] = %04hx\n", wanted_key_index, key);
 
 		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
-		std::cerr << "took: " << elapsed.count() / 1000.0f << "s\n";
+		KF_LOG(VERBOSE_NONE, "took: %gs\n", elapsed.count() / 1000.0f);
 	}
 	else if (find_all_subkeys)
 	{
 		auto start = std::chrono::steady_clock::now();
 
-		std::cerr << "starting full key recovery..\n";
+		KF_LOG(VERBOSE_NONE, "starting full key recovery..\n");
 
-		uint16_t key4 = finder.recoverLastSubkey();
-		finder.getSubkeys()[SPN::Nr] = key4;
+		if (!finder.recoverAllSubkeys())
+		{
+			Log::flush();
+			return EXIT_FAILURE;
+		}
 
-		fprintf(stderr, "key[%zd]=%04hx\n", SPN::Nr, key4);
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+		KF_LOG(VERBOSE_NONE, "took: %gs\n", elapsed.count() / 1000.0f);
 
-		// Dont ever do round >= 1 here
-		for (size_t round = SPN::Nr - 1; round > 1; --round)
+		std::string key = finder.getKeyStr();
+		KF_LOG(VERBOSE_NONE, "full key: %s\n", key.c_str());
+		Log::flush();
+
+		std::cout << key << '\n';
+		std::cout << "key is " << (finder.testKey(key) ? "ok" : "wrong") << '\n';
+	}
+	else if (!calibration_key.empty())
+	{
+		SPN real_spn = spn;
+		if (!real_spn.keysched(calibration_key.c_str()))
 		{
-			uint16_t subkey = finder.recoverRoundSubkey(round);
-			finder.getSubkeys()[round] = subkey;
-			fprintf(stderr, "key[%zd]=%04hx\n", round, subkey);
+			KF_LOG(VERBOSE_NONE, "bad key for calibration: %s\n", calibration_key.c_str());
+			return EXIT_FAILURE;
 		}
 
-		uint16_t key0 = finder.recoverFirstSubkey();
-		finder.getSubkeys()[0] = key0;
-
-		fprintf(stderr, "key[0]=%04hx\n", key0);
+		if (!finder.testKey(calibration_key))
+		{
+			KF_LOG(VERBOSE_NONE, "key %s does not produce the given ciphertexts\n", calibration_key.c_str());
+			return EXIT_FAILURE;
+		}
 
-		uint16_t key1 = finder.recoverSecondSubkey();
-		finder.getSubkeys()[1] = key1;
+		auto start = std::chrono::steady_clock::now();
 
-		fprintf(stderr, "key[1]=%04hx\n", key1);
+		size_t max_active_sboxes = compute_4_sboxes ? 4 : (compute_3_sboxes ? 3 : 2);
+		Calibration calibration = finder.calibrate(real_spn.getSubkeys(), max_active_sboxes);
 
 		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
-		std::cerr << "took: " << elapsed.count() / 1000.0f << "s\n";
+		KF_LOG(VERBOSE_NONE, "took: %gs\n", elapsed.count() / 1000.0f);
 
-		std::string key = finder.getKeyStr();
-		std::cerr << "full key: " << key << '\n';
+		if (!calibration_filename.empty())
+		{
+			if (!calibration.save(calibration_filename))
+			{
+				KF_LOG(VERBOSE_NONE, "could not save calibration to %s\n", calibration_filename.c_str());
+				return EXIT_FAILURE;
+			}
 
-		std::cout << key << '\n';
-		std::cout << "key is " << (finder.testKey(key) ? "ok" : "wrong") << '\n';
+			KF_LOG(VERBOSE_NONE, "calibration saved to %s\n", calibration_filename.c_str());
+		}
 	}
 	else if (!given_key.empty())
 	{
 		bool ok = finder.testKey(given_key);
 		if (ok)
 		{
-			std::cerr << "key is ok\n";
+			KF_LOG(VERBOSE_NONE, "key is ok\n");
 		}
 		else
 		{
-			std::cerr << "key is wrong\n";
+			KF_LOG(VERBOSE_NONE, "key is wrong\n");
 			return EXIT_FAILURE;
 		}
 	}
 	else if (print_diff_table)
 	{
 		const auto& diff_table = finder.getDiffTable();
+		Log::flush();
 
 		for (auto x : diff_table)
 		{
@@ -319,8 +714,10 @@ int main(int argc, char** argv)
 	}
 	else
 	{
-		std::cerr << "Nothing to do.. use -h\n";
+		KF_LOG(VERBOSE_NONE, "Nothing to do.. use -h\n");
 	}
 
+	finder.logElastic();
+
 	return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,420 @@
+// memory.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Memory budget (--memory-budget).
+//
+// None of the structures the kernels can keep is needed, each one has a streaming or recomputing alternative:
+// the composite tables go back to the nibble sboxes and the permutation, the peeled codebook is peeled again text
+// by text, the pairs are filtered while counting and the histograms are maps. Many jobs per node under a cgroup
+// memory limit (or a lot of threads) is when that's worth it, by default everything is kept.
+//
+// Whether the dense histograms get partitioned depends on the cache instead: with the tables a kernel reads they
+// have to fit into the L2 of a core, otherwise the increments go to memory and the big kernels partition them.
+// --partition-histograms overrides it.
+//
+#include "keyfinder.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+
+namespace
+{
+	// L2 of a core, 0 if it can't be found out
+	size_t CacheBytes()
+	{
+#ifdef _SC_LEVEL2_CACHE_SIZE
+		long bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		return bytes > 0 ? static_cast<size_t>(bytes) : 0;
+#else
+		return 0;
+#endif
+	}
+
+	const size_t LANES = 4;
+
+	// Value k of every lane of a PackedPairs block starts at bit k * W of the lane, W is known at compile time so
+	// the loops unroll into straight shifts and the lanes go together
+	template <unsigned W>
+	void Unpack(const uint32_t* words, uint32_t* out)
+	{
+		const uint32_t mask = (1u << W) - 1;
+		for (unsigned k = 0; k < KeyFinder::PAIR_BLOCK / LANES; ++k)
+		{
+			const unsigned word = k * W / 32;
+			const unsigned shift = k * W % 32;
+			for (unsigned l = 0; l < LANES; ++l)
+			{
+				uint32_t v = words[word * LANES + l] >> shift;
+				if (shift + W > 32)
+				{
+					v |= words[(word + 1) * LANES + l] << (32 - shift);
+				}
+				out[k * LANES + l] = v & mask;
+			}
+		}
+	}
+
+	template <>
+	void Unpack<0>(const uint32_t*, uint32_t* out)
+	{
+		std::fill(out, out + KeyFinder::PAIR_BLOCK, 0);
+	}
+
+	// The last block of a list has only as many words as its values need, read one value at a time
+	void UnpackPartial(const uint32_t* words, unsigned width, size_t count, uint32_t* out)
+	{
+		const uint32_t mask = (1u << width) - 1;
+		for (size_t j = 0; j < count; ++j)
+		{
+			const size_t word = j / LANES * width / 32;
+			const size_t shift = j / LANES * width % 32;
+			const size_t l = j % LANES;
+			uint32_t v = width == 0 ? 0 : words[word * LANES + l] >> shift;
+			if (shift + width > 32)
+			{
+				v |= words[(word + 1) * LANES + l] << (32 - shift);
+			}
+			out[j] = v & mask;
+		}
+	}
+
+	using UnpackFunction = void(*)(const uint32_t*, uint32_t*);
+	const UnpackFunction UNPACK[17] =
+	{
+		Unpack<0>, Unpack<1>, Unpack<2>, Unpack<3>, Unpack<4>, Unpack<5>, Unpack<6>, Unpack<7>, Unpack<8>,
+		Unpack<9>, Unpack<10>, Unpack<11>, Unpack<12>, Unpack<13>, Unpack<14>, Unpack<15>, Unpack<16>
+	};
+}
+
+
+void KeyFinder::setMemoryBudget(size_t bytes)
+{
+	m_memory_budget = bytes;
+	planMemory();
+}
+
+
+void KeyFinder::setPartitionedHistograms(bool partitioned)
+{
+	m_partition_forced = true;
+	m_partition_histograms = partitioned;
+	planMemory();
+}
+
+
+void KeyFinder::planMemory()
+{
+	MemoryPlan plan;
+	plan.bytes = CODEBOOK_BYTES;
+
+	size_t budget = m_memory_budget == 0 ? SIZE_MAX : m_memory_budget;
+	auto take = [&plan, budget](size_t bytes)
+	{
+		if (plan.bytes + bytes > budget)
+		{
+			return false;
+		}
+		plan.bytes += bytes;
+		return true;
+	};
+
+	plan.composite_tables = take(COMPOSITE_TABLES_BYTES);
+	plan.peeled_cache = take(PEELED_CACHE_BYTES);
+	plan.pair_indices = take(PAIR_INDICES_BYTES);
+	plan.dense_histograms = take(DENSE_HISTOGRAM_BYTES * m_num_of_threads);
+
+	size_t working_set = DENSE_HISTOGRAM_BYTES + (plan.composite_tables ? COMPOSITE_TABLES_BYTES : 0) + (plan.peeled_cache ? PEELED_CACHE_BYTES : 0);
+	size_t cache = CacheBytes();
+	plan.partitioned_histograms = plan.dense_histograms && (m_partition_forced ? m_partition_histograms : cache != 0 && working_set > cache);
+
+	if (CODEBOOK_BYTES > budget)
+	{
+		KF_LOG(VERBOSE_NONE, "memory: the codebook alone takes %zd KiB, more than the budget\n", CODEBOOK_BYTES / 1024);
+	}
+
+	KF_LOG(VERBOSE_INFO, "memory: %zd KiB, composite tables %s, peeled codebook %s, pair indices %s, dense histograms %s\n",
+		plan.bytes / 1024,
+		plan.composite_tables ? "on" : "off",
+		plan.peeled_cache ? "on" : "off",
+		plan.pair_indices ? "on" : "off",
+		plan.dense_histograms ? (plan.partitioned_histograms ? "partitioned" : "on") : "off");
+
+	if (plan.composite_tables && m_shared_composite != nullptr)
+	{
+		m_composite = m_shared_composite;
+	}
+	else if (plan.composite_tables)
+	{
+		if (m_composite_tables.empty())
+		{
+			m_composite_tables = buildCompositeTables();
+		}
+		m_composite = m_composite_tables.data();
+	}
+	else
+	{
+		std::vector<uint16_t>().swap(m_composite_tables);
+		m_composite = nullptr;
+	}
+
+	if (!plan.peeled_cache)
+	{
+		std::vector<uint16_t>().swap(m_peeled);
+	}
+
+	m_memory_plan = plan;
+}
+
+
+std::vector<uint16_t> KeyFinder::buildCompositeTables() const
+{
+	std::vector<uint16_t> tables(3 * 0x10000);
+	for (uint32_t x = 0; x <= 0xffff; ++x)
+	{
+		tables[x] = m_spn.subst(static_cast<uint16_t>(x));
+		tables[0x10000 + x] = m_spn.isubst(static_cast<uint16_t>(x));
+		tables[0x20000 + x] = m_spn.isubst(m_spn.itransp(static_cast<uint16_t>(x)));
+	}
+
+	return tables;
+}
+
+
+KeyFinder::PeeledTexts KeyFinder::peeledTexts(size_t round_num) const
+{
+	if (round_num == SPN::Nr)
+	{
+		return PeeledTexts(*this, round_num, &m_pc1);
+	}
+
+	if (!m_memory_plan.peeled_cache)
+	{
+		return PeeledTexts(*this, round_num, nullptr);
+	}
+
+	// Only the subkeys after the round are peeled off
+	bool valid = !m_peeled.empty() && m_peeled_round == round_num && m_peeled_subkeys.size() == m_subkeys.size() &&
+		std::equal(m_subkeys.begin() + round_num + 1, m_subkeys.end(), m_peeled_subkeys.begin() + round_num + 1);
+
+	if (!valid)
+	{
+		m_peeled.resize(m_pc1.size());
+		for (size_t i = 0; i < m_pc1.size(); ++i)
+		{
+			m_peeled[i] = peelText(m_pc1[i], round_num);
+		}
+		m_peeled_round = round_num;
+		m_peeled_subkeys = m_subkeys;
+	}
+
+	return PeeledTexts(*this, round_num, &m_peeled);
+}
+
+
+KeyFinder::HistogramBackend KeyFinder::histogramBackend(size_t work) const
+{
+	if (!m_memory_plan.dense_histograms)
+	{
+		return HISTOGRAM_MAP;
+	}
+
+	return m_memory_plan.partitioned_histograms && work >= PARTITIONED_MIN_WORK ? HISTOGRAM_PARTITIONED : HISTOGRAM_DENSE;
+}
+
+
+KeyFinder::Histogram::Histogram(HistogramBackend backend) :
+	m_backend{ backend }
+{
+	if (backend != HISTOGRAM_MAP)
+	{
+		m_dense.assign(0x10000, 0);
+	}
+
+	if (backend == HISTOGRAM_PARTITIONED)
+	{
+		m_buffer.resize(PARTITION_BUFFER_KEYS);
+		m_partitioned.resize(PARTITION_BUFFER_KEYS);
+	}
+}
+
+
+void KeyFinder::Histogram::flush()
+{
+	const size_t shift = 16 - PARTITION_BITS;
+	const size_t buckets = static_cast<size_t>(1) << PARTITION_BITS;
+
+	size_t next[(1 << PARTITION_BITS) + 1] = { 0 };
+	for (size_t i = 0; i < m_buffered; ++i)
+	{
+		++next[(m_buffer[i] >> shift) + 1];
+	}
+
+	for (size_t b = 1; b <= buckets; ++b)
+	{
+		next[b] += next[b - 1];
+	}
+
+	for (size_t i = 0; i < m_buffered; ++i)
+	{
+		m_partitioned[next[m_buffer[i] >> shift]++] = m_buffer[i];
+	}
+
+	for (size_t i = 0; i < m_buffered; ++i)
+	{
+		++m_dense[m_partitioned[i]];
+	}
+
+	m_buffered = 0;
+}
+
+
+void KeyFinder::Histogram::addTo(std::map<uint16_t, size_t>& hist)
+{
+	if (m_backend == HISTOGRAM_MAP)
+	{
+		for (const auto& p : m_sparse)
+		{
+			hist[p.first] += p.second;
+		}
+		return;
+	}
+
+	flush();
+
+	for (uint32_t key = 0; key < m_dense.size(); ++key)
+	{
+		if (m_dense[key] != 0)
+		{
+			hist[static_cast<uint16_t>(key)] += m_dense[key];
+		}
+	}
+}
+
+
+void KeyFinder::PackedPairs::push_back(uint16_t i)
+{
+	m_pending.push_back(i);
+	if (m_pending.size() == PAIR_BLOCK)
+	{
+		pack();
+	}
+}
+
+
+void KeyFinder::PackedPairs::finish()
+{
+	if (!m_pending.empty())
+	{
+		pack();
+	}
+	m_words.shrink_to_fit();
+	m_blocks.shrink_to_fit();
+	std::vector<uint16_t>().swap(m_pending);
+}
+
+
+void KeyFinder::PackedPairs::pack()
+{
+	uint32_t gaps[PAIR_BLOCK] = { 0 };
+	uint32_t all = 0;
+	for (size_t j = 1; j < m_pending.size(); ++j)
+	{
+		gaps[j] = static_cast<uint32_t>(m_pending[j] - m_pending[j - 1] - 1);
+		all |= gaps[j];
+	}
+
+	unsigned width = 0;
+	while ((all >> width) != 0)
+	{
+		++width;
+	}
+
+	Block block;
+	block.offset = static_cast<uint32_t>(m_words.size());
+	block.first = m_pending[0];
+	block.width = static_cast<uint8_t>(width);
+	block.count = static_cast<uint8_t>(m_pending.size());
+
+	// A lane of a full block holds PAIR_BLOCK / LANES values of width bits, width words
+	size_t lane_words = ((m_pending.size() + LANES - 1) / LANES * width + 31) / 32;
+	size_t raw_words = (m_pending.size() + 1) / 2;
+	if (raw_words < lane_words * LANES)
+	{
+		block.width = RAW_WIDTH;
+		m_blocks.push_back(block);
+
+		m_words.resize(m_words.size() + raw_words, 0);
+		uint32_t* words = m_words.data() + block.offset;
+		for (size_t j = 0; j < m_pending.size(); ++j)
+		{
+			words[j / 2] |= static_cast<uint32_t>(m_pending[j]) << (j % 2 * 16);
+		}
+
+		m_size += m_pending.size();
+		m_pending.clear();
+		return;
+	}
+
+	m_blocks.push_back(block);
+
+	m_words.resize(m_words.size() + lane_words * LANES, 0);
+	uint32_t* words = m_words.data() + block.offset;
+	for (size_t j = 0; j < m_pending.size() && width != 0; ++j)
+	{
+		size_t k = j / LANES;
+		size_t l = j % LANES;
+		size_t word = k * width / 32;
+		size_t shift = k * width % 32;
+
+		words[word * LANES + l] |= gaps[j] << shift;
+		if (shift + width > 32)
+		{
+			words[(word + 1) * LANES + l] |= gaps[j] >> (32 - shift);
+		}
+	}
+
+	m_size += m_pending.size();
+	m_pending.clear();
+}
+
+
+size_t KeyFinder::PackedPairs::decode(size_t b, uint16_t* out) const
+{
+	const Block& block = m_blocks[b];
+
+	if (block.width == RAW_WIDTH)
+	{
+		const uint32_t* words = m_words.data() + block.offset;
+		for (size_t j = 0; j < block.count; ++j)
+		{
+			out[j] = static_cast<uint16_t>(words[j / 2] >> (j % 2 * 16));
+		}
+		return block.count;
+	}
+
+	uint32_t gaps[PAIR_BLOCK];
+	if (block.count == PAIR_BLOCK)
+	{
+		UNPACK[block.width](m_words.data() + block.offset, gaps);
+	}
+	else
+	{
+		UnpackPartial(m_words.data() + block.offset, block.width, block.count, gaps);
+	}
+
+	uint32_t i = block.first;
+	out[0] = static_cast<uint16_t>(i);
+	for (size_t j = 1; j < block.count; ++j)
+	{
+		i += gaps[j] + 1;
+		out[j] = static_cast<uint16_t>(i);
+	}
+
+	return block.count;
+}
@@ -0,0 +1,280 @@
+// optimize.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+#include "optimize.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+
+
+void KeyFinder::setPathCache(bool enabled)
+{
+	m_path_cache_enabled = enabled;
+	m_path_cache.clear();
+	m_forgotten_paths.clear();
+	m_path_lookups = 0;
+	m_path_searches = 0;
+}
+
+
+size_t KeyFinder::forgetPaths(uint64_t changed)
+{
+	m_forgotten_paths.clear();
+	for (auto it = m_path_cache.begin(); it != m_path_cache.end();)
+	{
+		if ((it->second.lines & changed) != 0)
+		{
+			m_forgotten_paths.push_back(*it);
+			it = m_path_cache.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	return m_forgotten_paths.size();
+}
+
+
+void KeyFinder::restorePaths(uint64_t changed)
+{
+	// Whatever read the changed lines since was searched with the other sbox, the rest holds for both
+	for (auto it = m_path_cache.begin(); it != m_path_cache.end();)
+	{
+		it = (it->second.lines & changed) != 0 ? m_path_cache.erase(it) : std::next(it);
+	}
+
+	m_path_cache.insert(m_forgotten_paths.begin(), m_forgotten_paths.end());
+	m_forgotten_paths.clear();
+}
+
+
+bool KeyFinder::cachedRound(uint32_t key, uint16_t& round_in, double& probability) const
+{
+	if (!m_path_cache_enabled)
+	{
+		return false;
+	}
+
+	++m_path_lookups;
+	auto it = m_path_cache.find(key);
+	if (it == m_path_cache.end())
+	{
+		++m_path_searches;
+		return false;
+	}
+
+	for (size_t i = 0; i < it->second.sbox_count; ++i)
+	{
+		probability *= it->second.factors[i];
+	}
+	round_in = it->second.round_in;
+	return true;
+}
+
+
+void KeyFinder::cacheRound(uint32_t key, const CachedRound& round) const
+{
+	if (m_path_cache_enabled)
+	{
+		m_path_cache.emplace(key, round);
+	}
+}
+
+
+namespace
+{
+	// Highest entry of every TableLine (|LAT| for the linear ones) in the upper 16 bits, the inputs having it in the lower
+	void LineSummaries(const SPN& spn, uint32_t summaries[64])
+	{
+		for (size_t i = 0; i < 64; ++i)
+		{
+			bool linear = i >= 32;
+			bool forward = (i & 16) != 0;
+			uint16_t out = i & 0xf;
+
+			int values[16] = { 0 };
+			for (uint16_t in = 1; in <= 0xf; ++in)
+			{
+				if (linear)
+				{
+					values[in] = std::abs(forward ? spn.getTransposedLinearTable()[in][out] : spn.getLinearTable()[in][out]);
+				}
+				else
+				{
+					values[in] = forward ? spn.getTransposedDiffTable()[in][out] : spn.getDiffTable()[in][out];
+				}
+			}
+
+			int highest = *std::max_element(values + 1, values + 16);
+			uint32_t having = 0;
+			for (uint16_t in = 1; in <= 0xf; ++in)
+			{
+				if (values[in] == highest)
+				{
+					having |= 1u << in;
+				}
+			}
+
+			summaries[i] = static_cast<uint32_t>(highest) << 16 | having;
+		}
+	}
+
+	std::pair<double, double> Strength(const KeyFinder& finder)
+	{
+		return Sweep::Strength(finder.estimateAttack(KeyFinder::ENGINE_DIFFERENTIAL, 4), finder.estimateAttack(KeyFinder::ENGINE_LINEAR, 4));
+	}
+
+	void Climb(Optimizer::Chain& chain, const SPN& base, size_t steps, size_t& lookups, size_t& searches)
+	{
+		std::mt19937 rng(static_cast<uint32_t>(chain.seed));
+
+		std::vector<uint16_t> sbox(16);
+		std::iota(sbox.begin(), sbox.end(), 0);
+		std::shuffle(sbox.begin(), sbox.end(), rng);
+
+		// Only the structure of the base, its tables belong to another sbox
+		SPN spn;
+		spn.setKeySchedule(base.getKeySchedule());
+		spn.setPermutation(base.getPermutation());
+		std::string sbox_str;
+		for (uint16_t s : sbox)
+		{
+			sbox_str += std::to_string(s) + " ";
+		}
+		spn.setSboxes(&sbox_str[0]);
+		spn.calculateDiffTable();
+		spn.calculateLinearTable();
+
+		KeyFinder finder(std::vector<uint16_t>(), spn);
+		finder.setPathCache(true);
+
+		uint32_t summaries[64];
+		LineSummaries(spn, summaries);
+
+		// Lines whose summary differs, the new summaries are kept
+		auto swap = [&](uint16_t a, uint16_t b)
+		{
+			spn.swapSboxOutputs(a, b);
+
+			uint32_t next[64];
+			LineSummaries(spn, next);
+
+			uint64_t changed = 0;
+			for (size_t i = 0; i < 64; ++i)
+			{
+				if (next[i] != summaries[i])
+				{
+					changed |= 1ull << i;
+				}
+			}
+			std::copy(next, next + 64, summaries);
+
+			return changed;
+		};
+
+		auto current = Strength(finder);
+		chain.sbox = spn.getSbox();
+		chain.strength = current;
+
+		for (size_t step = 0; step < steps; ++step)
+		{
+			uint16_t a = static_cast<uint16_t>(rng() % 16);
+			uint16_t b = static_cast<uint16_t>(rng() % 15);
+			if (b >= a)
+			{
+				++b;
+			}
+
+			uint64_t changed = swap(a, b);
+			finder.forgetPaths(changed);
+			auto strength = Strength(finder);
+
+			// Sideways moves too, most swaps don't change the estimate at all. Swapping back changes the same lines
+			// back, the rounds searched before the swap are good again.
+			if (strength < current)
+			{
+				swap(a, b);
+				finder.restorePaths(changed);
+				continue;
+			}
+
+			current = strength;
+			if (current > chain.strength)
+			{
+				chain.strength = current;
+				chain.sbox = spn.getSbox();
+			}
+		}
+
+		lookups = finder.getPathLookups();
+		searches = finder.getPathSearches();
+	}
+}
+
+
+void Optimizer::run(const SPN& spn, size_t num_of_chains, size_t steps, size_t num_of_threads)
+{
+	chains.assign(num_of_chains, Chain());
+	for (size_t i = 0; i < chains.size(); ++i)
+	{
+		chains[i].seed = i + 1;
+	}
+
+	// The finders would log every path of every candidate
+	int level = Log::level();
+	Log::setLevel(-1);
+
+	std::mutex totals;
+	std::atomic<size_t> next{ 0 };
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < std::max<size_t>(1, num_of_threads); ++t)
+	{
+		workers.push_back(std::thread(
+			[this, &spn, &next, &totals, steps]
+			{
+				for (size_t i = next++; i < chains.size(); i = next++)
+				{
+					size_t lookups = 0;
+					size_t searches = 0;
+					Climb(chains[i], spn, steps, lookups, searches);
+
+					std::lock_guard<std::mutex> lock(totals);
+					candidates += steps + 1;
+					path_lookups += lookups;
+					path_searches += searches;
+				}
+			}));
+	}
+
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+
+	Log::setLevel(level);
+}
+
+
+Sweep Optimizer::toSweep() const
+{
+	Sweep sweep;
+	for (const Chain& chain : chains)
+	{
+		Sweep::Entry entry;
+		entry.line = chain.seed;
+		entry.sbox = chain.sbox;
+		sweep.entries.push_back(entry);
+	}
+
+	return sweep;
+}
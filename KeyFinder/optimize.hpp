@@ -0,0 +1,48 @@
+// optimize.hpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Hill climbing over S-boxes towards the ones attacks cost the most (--optimize).
+//
+// Every chain starts from a random S-box and tries swapping two of its outputs, the swap stays if the S-box isn't
+// weaker than before (Sweep::Strength of estimateAttack with both engines), otherwise it's swapped back. Nothing is
+// built again for a step: the swap fixes up the DDT and the LAT where the two outputs count (swapSboxOutputs) and
+// the finder keeps the rounds of its characteristics (setPathCache) except for the ones that read a table line whose
+// highest entry or the inputs having it changed, which is all the greedy search looks at.
+//
+// The chains are spread over the threads, each one has its own SPN and KeyFinder.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "keyfinder.hpp"
+#include "sweep.hpp"
+
+
+struct Optimizer
+{
+	struct Chain
+	{
+		// Seeds the random S-box and the swaps, same chain = same climb
+		size_t seed;
+		// Strongest S-box the chain got to
+		std::vector<uint16_t> sbox;
+		std::pair<double, double> strength;
+	};
+
+	std::vector<Chain> chains;
+	// Sums over the chains, every step is a candidate, rounds of characteristics as counted by the path cache
+	size_t candidates{ 0 };
+	size_t path_lookups{ 0 };
+	size_t path_searches{ 0 };
+
+	// The SPN gives the permutation, steps swaps per chain
+	void run(const SPN& spn, size_t num_of_chains, size_t steps, size_t num_of_threads);
+
+	// The best S-box of every chain as a sweep (line = chain), to be run and printed the same way
+	Sweep toSweep() const;
+};
@@ -0,0 +1,476 @@
+// shared.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Shared cache (--shared-cache).
+//
+// With dozens of processes on one node attacking ciphertexts of the same sbox, every one of them would spend most
+// of its startup in prepareImpossible and keep its own copy of the tables. Instead the segment is named after the
+// sbox and the permutation and whoever creates it (O_EXCL) builds everything and publishes it:
+//
+//	1. the segment is only the header, state = building, builder = pid
+//	2. the tables are built, the segment is resized and they're copied in after the header
+//	3. state = ready (release)
+//
+// The others map the header read-only and wait for ready (acquire), then map the whole segment. Nothing is ever
+// locked, a builder that died is noticed by its pid and its segment is removed and built again. So is a segment
+// without a header or a pid after SHARED_CACHE_CLAIM_MS, its creator died before step 1 was done, and one that
+// still isn't ready after SHARED_CACHE_WAIT_SECONDS, so the next process doesn't wait for it again. If its builder
+// was only slow, it publishes into the removed segment and the processes waiting on it still get the tables. A
+// segment of another version, sbox or permutation is left alone, so is one owned by another user or one whose
+// sections or records don't fit in it (see loadShared), the tables are built in the process then. Segments stay in
+// /dev/shm until they're removed or the node reboots.
+//
+#include "keyfinder.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// std::chrono takes them by reference
+const size_t KeyFinder::SHARED_CACHE_WAIT_SECONDS;
+const size_t KeyFinder::SHARED_CACHE_CLAIM_MS;
+
+
+namespace
+{
+	// Bump when anything below changes
+	const uint32_t SHARED_CACHE_VERSION = 1;
+
+	enum SharedState : uint32_t
+	{
+		SHARED_BUILDING,
+		SHARED_READY
+	};
+
+	enum SharedSection
+	{
+		SECTION_COMPOSITE,
+		SECTION_IMPOSSIBLE,
+		SECTION_TRUNCATED,
+		SECTION_INTEGRAL,
+		SECTION_COUNT
+	};
+
+	struct SharedLayout
+	{
+		uint32_t version;
+		uint64_t sbox;
+		uint16_t permutation[16];
+		uint64_t bytes;
+		uint64_t offset[SECTION_COUNT];
+		uint64_t count[SECTION_COUNT];
+	};
+
+	struct SharedHeader
+	{
+		std::atomic<uint32_t> state;
+		std::atomic<int64_t> builder;
+		// Only valid once state is ready
+		SharedLayout layout;
+	};
+
+	struct ImpossibleRecord
+	{
+		uint16_t round_num;
+		uint16_t input_diff;
+		uint16_t impossible[4];
+	};
+
+	struct TruncatedRecord
+	{
+		double patterns[16];
+		uint16_t round_num;
+		uint16_t input_diff;
+	};
+
+	struct IntegralRecord
+	{
+		uint16_t round_num;
+		uint16_t nibble;
+		uint16_t property;
+		uint16_t count;
+		uint16_t states[15];
+	};
+
+	uint64_t PackSbox(const std::vector<uint16_t>& sbox)
+	{
+		uint64_t packed = 0;
+		for (uint16_t v : sbox)
+		{
+			packed = (packed << 4) | (v & 0xf);
+		}
+		return packed;
+	}
+
+	std::string SegmentName(const SPN& spn)
+	{
+		// FNV-1a of the positions
+		uint32_t hash = 2166136261u;
+		for (uint16_t p : spn.getPermutation().getPositions())
+		{
+			hash = (hash ^ p) * 16777619u;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "/keyfinder-%u-%016llx-%08x", SHARED_CACHE_VERSION,
+			static_cast<unsigned long long>(PackSbox(spn.getSbox())), hash);
+		return name;
+	}
+
+	template <typename T>
+	size_t AddSection(std::vector<char>& image, SharedLayout& layout, SharedSection section, const std::vector<T>& records)
+	{
+		size_t offset = (image.size() + 7) & ~static_cast<size_t>(7);
+		image.resize(offset + records.size() * sizeof(T));
+		if (!records.empty())
+		{
+			memcpy(&image[offset], records.data(), records.size() * sizeof(T));
+		}
+
+		layout.offset[section] = offset;
+		layout.count[section] = records.size();
+		return offset;
+	}
+
+	// The section lies after the header and inside the segment, overflow of count * sizeof(T) included
+	template <typename T>
+	bool FitsSection(const SharedLayout& layout, SharedSection section)
+	{
+		uint64_t offset = layout.offset[section];
+		return offset >= sizeof(SharedHeader) && offset % alignof(T) == 0 && offset <= layout.bytes &&
+			layout.count[section] <= (layout.bytes - offset) / sizeof(T);
+	}
+}
+
+
+std::vector<char> KeyFinder::serializeShared() const
+{
+	std::vector<char> image(sizeof(SharedHeader), 0);
+	SharedLayout layout;
+	memset(&layout, 0, sizeof(layout));
+
+	layout.version = SHARED_CACHE_VERSION;
+	layout.sbox = PackSbox(m_spn.getSbox());
+	std::copy(m_spn.getPermutation().getPositions().begin(), m_spn.getPermutation().getPositions().end(), layout.permutation);
+
+	AddSection(image, layout, SECTION_COMPOSITE, buildCompositeTables());
+
+	std::vector<ImpossibleRecord> impossible;
+	for (size_t r = 0; r < m_impossible_diffs.size(); ++r)
+	{
+		for (const auto& p : m_impossible_diffs[r])
+		{
+			ImpossibleRecord record{ static_cast<uint16_t>(r), p.first, { 0 } };
+			std::copy(p.second.begin(), p.second.end(), record.impossible);
+			impossible.push_back(record);
+		}
+	}
+	AddSection(image, layout, SECTION_IMPOSSIBLE, impossible);
+
+	std::vector<TruncatedRecord> truncated;
+	for (size_t r = 0; r < m_truncated_patterns.size(); ++r)
+	{
+		for (const auto& p : m_truncated_patterns[r])
+		{
+			TruncatedRecord record;
+			std::copy(p.second.begin(), p.second.end(), record.patterns);
+			record.round_num = static_cast<uint16_t>(r);
+			record.input_diff = p.first;
+			truncated.push_back(record);
+		}
+	}
+	AddSection(image, layout, SECTION_TRUNCATED, truncated);
+
+	std::vector<IntegralRecord> integral;
+	for (size_t r = 0; r < m_integral_structures.size(); ++r)
+	{
+		for (size_t n = 0; n < m_integral_structures[r].size(); ++n)
+		{
+			const IntegralStructure& structure = m_integral_structures[r][n];
+			IntegralRecord record{ static_cast<uint16_t>(r), static_cast<uint16_t>(n), static_cast<uint16_t>(structure.property),
+				static_cast<uint16_t>(structure.states.size()), { 0 } };
+			std::copy(structure.states.begin(), structure.states.end(), record.states);
+			integral.push_back(record);
+		}
+	}
+	AddSection(image, layout, SECTION_INTEGRAL, integral);
+
+	layout.bytes = image.size();
+	memcpy(&image[offsetof(SharedHeader, layout)], &layout, sizeof(layout));
+
+	return image;
+}
+
+
+bool KeyFinder::loadShared(const char* segment)
+{
+	const SharedLayout& layout = reinterpret_cast<const SharedHeader*>(segment)->layout;
+
+	// Nothing in the segment is trusted to index with, a bad one leaves the tables empty to be built here
+	auto corrupt = [this]()
+	{
+		m_shared_composite = nullptr;
+		m_impossible_diffs.clear();
+		m_truncated_patterns.clear();
+		m_integral_structures.clear();
+		return false;
+	};
+
+	if (!FitsSection<uint16_t>(layout, SECTION_COMPOSITE) || layout.count[SECTION_COMPOSITE] * sizeof(uint16_t) != COMPOSITE_TABLES_BYTES ||
+		!FitsSection<ImpossibleRecord>(layout, SECTION_IMPOSSIBLE) || !FitsSection<TruncatedRecord>(layout, SECTION_TRUNCATED) ||
+		!FitsSection<IntegralRecord>(layout, SECTION_INTEGRAL))
+	{
+		return corrupt();
+	}
+
+	m_shared_composite = reinterpret_cast<const uint16_t*>(segment + layout.offset[SECTION_COMPOSITE]);
+
+	m_impossible_diffs.assign(SPN::Nr + 1, std::map<uint16_t, std::vector<uint16_t>>());
+	const ImpossibleRecord* impossible = reinterpret_cast<const ImpossibleRecord*>(segment + layout.offset[SECTION_IMPOSSIBLE]);
+	for (size_t i = 0; i < layout.count[SECTION_IMPOSSIBLE]; ++i)
+	{
+		if (impossible[i].round_num > SPN::Nr)
+		{
+			return corrupt();
+		}
+		m_impossible_diffs[impossible[i].round_num][impossible[i].input_diff].assign(impossible[i].impossible, impossible[i].impossible + 4);
+	}
+
+	m_truncated_patterns.assign(SPN::Nr + 1, std::map<uint16_t, std::vector<double>>());
+	const TruncatedRecord* truncated = reinterpret_cast<const TruncatedRecord*>(segment + layout.offset[SECTION_TRUNCATED]);
+	for (size_t i = 0; i < layout.count[SECTION_TRUNCATED]; ++i)
+	{
+		if (truncated[i].round_num > SPN::Nr)
+		{
+			return corrupt();
+		}
+		m_truncated_patterns[truncated[i].round_num][truncated[i].input_diff].assign(truncated[i].patterns, truncated[i].patterns + 16);
+	}
+
+	m_integral_structures.assign(SPN::Nr + 1, std::vector<IntegralStructure>(4));
+	const IntegralRecord* integral = reinterpret_cast<const IntegralRecord*>(segment + layout.offset[SECTION_INTEGRAL]);
+	for (size_t i = 0; i < layout.count[SECTION_INTEGRAL]; ++i)
+	{
+		if (integral[i].round_num > SPN::Nr || integral[i].nibble >= 4 || integral[i].count > 15 || integral[i].property > INTEGRAL_AFFINE)
+		{
+			return corrupt();
+		}
+		IntegralStructure& structure = m_integral_structures[integral[i].round_num][integral[i].nibble];
+		structure.property = static_cast<IntegralProperty>(integral[i].property);
+		structure.states.assign(integral[i].states, integral[i].states + integral[i].count);
+	}
+
+	return true;
+}
+
+
+#ifdef _WIN32
+
+bool KeyFinder::attachSharedCache()
+{
+	KF_LOG(VERBOSE_NONE, "shared cache: not supported on Windows, building the tables in this process\n");
+	return false;
+}
+
+#else
+
+bool KeyFinder::attachSharedCache()
+{
+	static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "shared state has to be lock-free");
+
+	const std::string name = SegmentName(m_spn);
+
+	// The second try is after removing the segment of a builder that died
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+		if (fd >= 0)
+		{
+			if (ftruncate(fd, sizeof(SharedHeader)) != 0)
+			{
+				KF_LOG(VERBOSE_NONE, "shared cache: could not size %s: %s\n", name.c_str(), strerror(errno));
+				close(fd);
+				shm_unlink(name.c_str());
+				return false;
+			}
+
+			void* header_map = mmap(nullptr, sizeof(SharedHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (header_map != MAP_FAILED)
+			{
+				static_cast<SharedHeader*>(header_map)->builder.store(getpid(), std::memory_order_release);
+				munmap(header_map, sizeof(SharedHeader));
+			}
+
+			KF_LOG(VERBOSE_INFO, "shared cache: building %s\n", name.c_str());
+			auto start = std::chrono::steady_clock::now();
+
+			if (m_impossible_diffs.empty())
+			{
+				prepareImpossible();
+			}
+			if (m_integral_structures.empty())
+			{
+				prepareIntegral();
+			}
+			if (m_truncated_patterns.empty())
+			{
+				prepareTruncated();
+			}
+
+			std::vector<char> image = serializeShared();
+
+			void* map = MAP_FAILED;
+			if (ftruncate(fd, image.size()) == 0)
+			{
+				map = mmap(nullptr, image.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			}
+			close(fd);
+
+			if (map == MAP_FAILED)
+			{
+				KF_LOG(VERBOSE_NONE, "shared cache: could not publish %s: %s\n", name.c_str(), strerror(errno));
+				shm_unlink(name.c_str());
+				return false;
+			}
+
+			// Everything but the state, which goes last
+			SharedHeader* header = static_cast<SharedHeader*>(map);
+			memcpy(static_cast<char*>(map) + sizeof(SharedHeader), image.data() + sizeof(SharedHeader), image.size() - sizeof(SharedHeader));
+			memcpy(&header->layout, &image[offsetof(SharedHeader, layout)], sizeof(SharedLayout));
+			header->state.store(SHARED_READY, std::memory_order_release);
+			munmap(map, image.size());
+
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+			KF_LOG(VERBOSE_INFO, "shared cache: published %zd KiB in %gs\n", image.size() / 1024, elapsed.count() / 1000.0f);
+		}
+		else if (errno != EEXIST)
+		{
+			KF_LOG(VERBOSE_NONE, "shared cache: could not create %s: %s\n", name.c_str(), strerror(errno));
+			return false;
+		}
+
+		fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd < 0)
+		{
+			// Removed in the meantime
+			continue;
+		}
+
+		// The name is predictable, a segment someone else made isn't read at all
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_uid != geteuid())
+		{
+			close(fd);
+			KF_LOG(VERBOSE_NONE, "shared cache: %s belongs to another user, building the tables in this process\n", name.c_str());
+			return false;
+		}
+
+		// The builder may not have sized it yet, the header is all we look at until it's ready
+		auto start = std::chrono::steady_clock::now();
+		auto claim_deadline = start + std::chrono::milliseconds(SHARED_CACHE_CLAIM_MS);
+		auto deadline = start + std::chrono::seconds(SHARED_CACHE_WAIT_SECONDS);
+		bool sized = false;
+		while (fstat(fd, &st) == 0 && !(sized = static_cast<size_t>(st.st_size) >= sizeof(SharedHeader)) && std::chrono::steady_clock::now() < claim_deadline)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		if (!sized)
+		{
+			close(fd);
+			KF_LOG(VERBOSE_NONE, "shared cache: %s never got a header, building it again\n", name.c_str());
+			shm_unlink(name.c_str());
+			continue;
+		}
+
+		void* header_map = mmap(nullptr, sizeof(SharedHeader), PROT_READ, MAP_SHARED, fd, 0);
+		if (header_map == MAP_FAILED)
+		{
+			close(fd);
+			KF_LOG(VERBOSE_NONE, "shared cache: could not map %s: %s\n", name.c_str(), strerror(errno));
+			return false;
+		}
+
+		const SharedHeader* header = static_cast<const SharedHeader*>(header_map);
+		bool dead = false;
+		while (header->state.load(std::memory_order_acquire) != SHARED_READY && std::chrono::steady_clock::now() < deadline)
+		{
+			int64_t builder = header->builder.load(std::memory_order_acquire);
+			bool unclaimed = builder == 0 && std::chrono::steady_clock::now() >= claim_deadline;
+			if (unclaimed || (builder != 0 && kill(static_cast<pid_t>(builder), 0) != 0 && errno == ESRCH))
+			{
+				dead = true;
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		bool ready = header->state.load(std::memory_order_acquire) == SHARED_READY;
+		SharedLayout layout = header->layout;
+		munmap(header_map, sizeof(SharedHeader));
+
+		if (dead)
+		{
+			close(fd);
+			KF_LOG(VERBOSE_NONE, "shared cache: the process building %s died, building it again\n", name.c_str());
+			shm_unlink(name.c_str());
+			continue;
+		}
+
+		if (!ready)
+		{
+			close(fd);
+			KF_LOG(VERBOSE_NONE, "shared cache: %s isn't ready after %zds, removing it and building the tables in this process\n", name.c_str(), SHARED_CACHE_WAIT_SECONDS);
+			shm_unlink(name.c_str());
+			return false;
+		}
+
+		bool same = layout.version == SHARED_CACHE_VERSION && layout.sbox == PackSbox(m_spn.getSbox()) &&
+			std::equal(layout.permutation, layout.permutation + 16, m_spn.getPermutation().getPositions().begin()) &&
+			fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) == layout.bytes;
+		if (!same)
+		{
+			close(fd);
+			KF_LOG(VERBOSE_NONE, "shared cache: %s was made for something else, building the tables in this process\n", name.c_str());
+			return false;
+		}
+
+		void* map = mmap(nullptr, layout.bytes, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+		{
+			KF_LOG(VERBOSE_NONE, "shared cache: could not map %s: %s\n", name.c_str(), strerror(errno));
+			return false;
+		}
+
+		size_t bytes = layout.bytes;
+		m_shared = std::shared_ptr<const char>(static_cast<const char*>(map), [bytes](const char* p) { munmap(const_cast<char*>(p), bytes); });
+		if (!loadShared(m_shared.get()))
+		{
+			m_shared.reset();
+			KF_LOG(VERBOSE_NONE, "shared cache: %s is corrupt, building the tables in this process\n", name.c_str());
+			return false;
+		}
+
+		KF_LOG(VERBOSE_INFO, "shared cache: mapped %s (%zd KiB)\n", name.c_str(), bytes / 1024);
+		return true;
+	}
+
+	return false;
+}
+
+#endif
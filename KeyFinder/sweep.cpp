@@ -0,0 +1,257 @@
+// sweep.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+#include "sweep.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <thread>
+
+
+KeyFinder::AttackEstimate KeyFinder::estimateAttack(Engine engine, size_t max_active_sboxes) const
+{
+	AttackEstimate estimate;
+	std::fill(std::begin(estimate.probability), std::end(estimate.probability), 0.0);
+	estimate.data = 0.0;
+	estimate.work = 0.0;
+
+	for (size_t round_num : { SPN::Nr, SPN::Nr - 1, SPN::Nr - 2, static_cast<size_t>(0) })
+	{
+		double p = bestPathProbability(round_num, engine);
+		estimate.probability[round_num] = p;
+
+		if (p == 0.0)
+		{
+			estimate.data = INFINITY;
+			estimate.work = INFINITY;
+			continue;
+		}
+
+		double texts = AttackData(engine, p);
+		estimate.data = std::max(estimate.data, texts);
+		estimate.work += AttackWork(engine, texts, round_num == 0 || round_num == SPN::Nr ? 2 : max_active_sboxes);
+	}
+
+	return estimate;
+}
+
+
+namespace
+{
+	void Evaluate(Sweep::Entry& entry, const SPN& base, KeyFinder::Engine engine, bool attack)
+	{
+		SPN spn = base;
+		std::string sbox;
+		for (uint16_t s : entry.sbox)
+		{
+			sbox += std::to_string(s) + " ";
+		}
+		spn.setSboxes(&sbox[0]);
+		spn.calculateDiffTable();
+		spn.calculateLinearTable();
+
+		for (uint16_t a = 1; a <= 0xf; ++a)
+		{
+			for (uint16_t b = 1; b <= 0xf; ++b)
+			{
+				entry.differential_uniformity = std::max(entry.differential_uniformity, spn.getDiffTable()[a][b]);
+				entry.linearity = std::max<int16_t>(entry.linearity, static_cast<int16_t>(std::abs(spn.getLinearTable()[a][b])));
+			}
+		}
+
+		{
+			KeyFinder finder(std::vector<uint16_t>(), spn);
+			entry.differential = finder.estimateAttack(KeyFinder::ENGINE_DIFFERENTIAL, 4);
+			entry.linear = finder.estimateAttack(KeyFinder::ENGINE_LINEAR, 4);
+		}
+
+		// Some output bit is an affine function of the input (|LAT| = 8), every path is certain and the attack
+		// drowns in ties of equally good ones, it takes minutes to say what the table already does
+		entry.affine = entry.linearity == 8;
+		if (!attack || entry.affine)
+		{
+			return;
+		}
+
+		// Same key for the same line every time
+		std::mt19937 rng(static_cast<uint32_t>(entry.line));
+		std::string key;
+		for (size_t i = 0; i < spn.getKeySchedule().getKeyBits() / 4; ++i)
+		{
+			key += "0123456789abcdef"[rng() & 0xf];
+		}
+		spn.keysched(key.c_str());
+
+		std::vector<uint16_t> codebook(0x10000);
+		for (uint32_t pt = 0; pt <= 0xffff; ++pt)
+		{
+			codebook[pt] = static_cast<uint16_t>(pt);
+		}
+		spn.encryptBlocks(codebook.data(), codebook.data(), codebook.size());
+
+		auto start = std::chrono::steady_clock::now();
+
+		// -a turns on 3 and 4 sboxes too
+		KeyFinder finder(codebook, spn, 1, true, true);
+		finder.setEngine(engine);
+		bool finished = finder.recoverAllSubkeys();
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+		entry.attack_seconds = elapsed.count() / 1000.0;
+		entry.attacked = true;
+		// A round that failed shows up as a wrong key like any other
+		entry.recovered = finished && finder.testKey(finder.getKeyStr());
+	}
+
+	double Log2(double x)
+	{
+		return x > 0.0 ? log2(x) : -INFINITY;
+	}
+}
+
+
+bool Sweep::load(const std::string& filename)
+{
+	std::ifstream in(filename);
+	if (!in.is_open())
+	{
+		KF_LOG(VERBOSE_NONE, "could not open file %s\n", filename.c_str());
+		return false;
+	}
+
+	entries.clear();
+
+	std::string line;
+	size_t line_num = 0;
+	while (std::getline(in, line))
+	{
+		++line_num;
+
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+		{
+			continue;
+		}
+
+		Entry entry;
+		entry.line = line_num;
+
+		uint32_t seen = 0;
+		const char* p = line.c_str();
+		for (size_t i = 0; i < 16; ++i)
+		{
+			char* end = nullptr;
+			long v = strtol(p, &end, 10);
+			if (end == p || v < 0 || v > 0xf || (seen & (1u << v)) != 0)
+			{
+				break;
+			}
+
+			seen |= 1u << v;
+			entry.sbox.push_back(static_cast<uint16_t>(v));
+			p = end;
+		}
+
+		// Only whitespace or a comment after the 16 values
+		size_t rest = line.find_first_not_of(" \t\r", p - line.c_str());
+		if (entry.sbox.size() != 16 || (rest != std::string::npos && line[rest] != '#'))
+		{
+			KF_LOG(VERBOSE_NONE, "sweep: line %zd of %s is not a permutation of 0-15\n", line_num, filename.c_str());
+			return false;
+		}
+
+		entries.push_back(entry);
+	}
+
+	return true;
+}
+
+
+void Sweep::run(const SPN& spn, KeyFinder::Engine engine, size_t num_of_threads, bool attack)
+{
+	// The finders would log every round of every S-box, only the table is interesting
+	int level = Log::level();
+	Log::setLevel(-1);
+
+	std::atomic<size_t> next{ 0 };
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < std::max<size_t>(1, num_of_threads); ++t)
+	{
+		workers.push_back(std::thread(
+			[this, &spn, &next, engine, attack]
+			{
+				for (size_t i = next++; i < entries.size(); i = next++)
+				{
+					Evaluate(entries[i], spn, engine, attack);
+				}
+			}));
+	}
+
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+
+	Log::setLevel(level);
+}
+
+
+void Sweep::rank()
+{
+	std::stable_sort(entries.begin(), entries.end(),
+		[](const Entry& a, const Entry& b) { return Strength(a.differential, a.linear) > Strength(b.differential, b.linear); });
+}
+
+
+std::pair<double, double> Sweep::Strength(const KeyFinder::AttackEstimate& differential, const KeyFinder::AttackEstimate& linear)
+{
+	const KeyFinder::AttackEstimate& best = linear.data < differential.data ? linear : differential;
+	return std::make_pair(best.data, best.work);
+}
+
+
+void Sweep::print(FILE* out) const
+{
+	// Everything in log2, the rounds are key[4], key[3], key[2] and key[0]
+	fprintf(out, "%4s %5s %3s %3s  %-23s %6s %6s  %-23s %6s %6s  %-13s %s\n",
+		"rank", "line", "du", "lin", "diff log2 p (4,3,2,0)", "texts", "work", "lin log2 c^2 (4,3,2,0)", "texts", "work", "attack", "sbox");
+
+	size_t rank = 1;
+	for (const Entry& e : entries)
+	{
+		fprintf(out, "%4zd %5zd %3hu %3hd ", rank++, e.line, e.differential_uniformity, e.linearity);
+
+		for (const KeyFinder::AttackEstimate* estimate : { &e.differential, &e.linear })
+		{
+			fputc(' ', out);
+			for (size_t round_num : { SPN::Nr, SPN::Nr - 1, SPN::Nr - 2, static_cast<size_t>(0) })
+			{
+				fprintf(out, "%6.1f", Log2(estimate->probability[round_num]));
+			}
+			fprintf(out, " %6.1f %6.1f ", Log2(estimate->data), Log2(estimate->work));
+		}
+
+		char attack[32] = "-";
+		if (e.affine)
+		{
+			snprintf(attack, sizeof(attack), "affine");
+		}
+		else if (e.attacked)
+		{
+			snprintf(attack, sizeof(attack), "%s %.2fs", e.recovered ? "ok" : "wrong", e.attack_seconds);
+		}
+		fprintf(out, " %-13s", attack);
+
+		for (uint16_t s : e.sbox)
+		{
+			fprintf(out, " %hu", s);
+		}
+		fputc('\n', out);
+	}
+}
@@ -0,0 +1,56 @@
+// sweep.hpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Ranking many S-boxes by what attacking them costs (--sweep).
+//
+// Every S-box gets its differential uniformity and linearity, the best path of every round the attack goes for with
+// the differential and the linear engine and what they need in texts and partial decryptions (estimateAttack).
+// With --sweep-attack the whole -a attack also runs on a codebook encrypted in memory under a random key.
+// The S-boxes are spread over the threads, each one gets its own SPN and KeyFinder.
+//
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "keyfinder.hpp"
+
+
+struct Sweep
+{
+	struct Entry
+	{
+		// Line of the file, also seeds the random key of the attack
+		size_t line;
+		std::vector<uint16_t> sbox;
+		// Highest DDT entry and |LAT| entry outside of row and column 0
+		uint16_t differential_uniformity{ 0 };
+		int16_t linearity{ 0 };
+		// Some component is affine (linearity 8), never attacked
+		bool affine{ false };
+		KeyFinder::AttackEstimate differential;
+		KeyFinder::AttackEstimate linear;
+		bool attacked{ false };
+		bool recovered{ false };
+		double attack_seconds{ 0.0 };
+	};
+
+	std::vector<Entry> entries;
+
+	// One S-box per line written like the sbox argument, empty lines and # comments are skipped.
+	// false if the file can't be read or a line isn't a permutation of 0-15, a # comment may follow it
+	bool load(const std::string& filename);
+
+	// The SPN gives the key schedule and the permutation, engine is only used by the attack
+	void run(const SPN& spn, KeyFinder::Engine engine, size_t num_of_threads, bool attack);
+
+	// Strongest first, by the data of the engine that needs less, then by its work
+	void rank();
+	// What rank sorts by, bigger is stronger
+	static std::pair<double, double> Strength(const KeyFinder::AttackEstimate& differential, const KeyFinder::AttackEstimate& linear);
+	void print(FILE* out) const;
+};
@@ -0,0 +1,272 @@
+// triage.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Quick check whether a codebook comes from this SPN (--triage).
+//
+// The best characteristic of rounds 1 to Nr - 1 into a single sbox of the last round is what key[4] is attacked
+// with. No key is needed to see its right pairs: the last round has no permutation, so the ciphertexts of a right
+// pair differ only in the sbox u4 makes active and only by what the DDT allows there. A pair of a random permutation
+// gets such a difference with probability q = allowed / 65535, a pair of this SPN also when it's right:
+//		p + (1 - p) * q
+// Every characteristic counts the filtered pairs in a sample. Against a random permutation the counts are weighed as
+// Poisson (log likelihood ratio, like the joint engine) summed over the characteristics. That alone isn't enough, a
+// codebook of another sbox or permutation is no random permutation either and some difference of it can pass a lot,
+// so each count is also checked against this SPN: getting that few right pairs should be more likely than
+// TRIAGE_MAX_MISS_PROBABILITY. One characteristic can miss, its probability is averaged over the keys and some keys
+// get almost no right pairs, TRIAGE_MAX_MISSES of them don't.
+//
+// The characteristic is only a lower bound of its differential, so neither says whether it's this sbox: a codebook
+// of another sbox can have a lot more pairs there. The pairs whose ciphertexts differ only in the active sbox are
+// split by that difference (15 cells) and compared with the whole distribution of the ciphertext difference for
+// this sbox, averaged over the keys (a Markov chain over the DDT, every round key independent). Too many pairs is as
+// bad as too few. A fixed key spreads the pairs differently from the average too, so the deviance is allowed the 15
+// of Poisson noise plus TRIAGE_MAX_MISFIT per pair counted. Above that the counts don't match the labelled sbox and
+// the codebook is inconclusive, whatever the LLR says.
+//
+#include "keyfinder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+
+// std::max takes it by reference
+const size_t KeyFinder::TRIAGE_PAIRS;
+
+
+namespace
+{
+	// Odd, so i * TRIAGE_STRIDE goes over every plaintext once and the sample is spread over the whole codebook
+	const uint32_t TRIAGE_STRIDE = 40503;
+
+	double Log2(double x)
+	{
+		return x > 0.0 ? log2(x) : -INFINITY;
+	}
+
+	// ln P(X <= count) for X Poisson with mean lambda
+	double PoissonLowerTail(size_t count, double lambda)
+	{
+		double highest = -INFINITY;
+		std::vector<double> terms;
+		for (size_t x = 0; x <= count; ++x)
+		{
+			terms.push_back(-lambda + x * std::log(lambda) - std::lgamma(x + 1.0));
+			highest = std::max(highest, terms.back());
+		}
+
+		double sum = 0.0;
+		for (double t : terms)
+		{
+			sum += std::exp(t - highest);
+		}
+		return highest + std::log(sum);
+	}
+
+	// Distribution of the ciphertext difference of the pairs with plaintext difference input_diff, averaged over the
+	// keys (with independent uniform round keys the SPN is a Markov cipher and every sbox works on its own)
+	std::vector<double> DifferenceDistribution(const SPN& spn, uint16_t input_diff)
+	{
+		const auto& diff_table = spn.getDiffTable();
+		std::vector<double> dist(0x10000, 0.0);
+		std::vector<double> next(0x10000);
+		dist[input_diff] = 1.0;
+
+		for (size_t round = 1; round <= SPN::Nr; ++round)
+		{
+			// One sbox of the layer at a time, the others keep their difference
+			for (uint32_t shift = 0; shift < 16; shift += 4)
+			{
+				std::fill(next.begin(), next.end(), 0.0);
+				for (uint32_t x = 0; x <= 0xffff; ++x)
+				{
+					if (dist[x] == 0.0)
+					{
+						continue;
+					}
+
+					const auto& row = diff_table[(x >> shift) & 0xf];
+					uint32_t rest = x & ~(0xfu << shift);
+					for (uint32_t dy = 0; dy <= 0xf; ++dy)
+					{
+						next[rest | dy << shift] += dist[x] * row[dy] / 16.0;
+					}
+				}
+				dist.swap(next);
+			}
+
+			// The last round has no permutation
+			if (round < SPN::Nr)
+			{
+				for (uint32_t x = 0; x <= 0xffff; ++x)
+				{
+					next[spn.transp(static_cast<uint16_t>(x))] = dist[x];
+				}
+				dist.swap(next);
+			}
+		}
+
+		return dist;
+	}
+}
+
+
+KeyFinder::TriageVerdict KeyFinder::triage() const
+{
+	std::vector<Path> paths;
+	for (uint16_t state = 1; state <= 0xf; ++state)
+	{
+		SboxState s(state);
+		if (s.active.count() != 1)
+		{
+			continue;
+		}
+
+		bool forward = false;
+		size_t path_round_num = SPN::Nr;
+		for (const Path& path : selectPaths(SPN::Nr, s, forward, path_round_num, ENGINE_DIFFERENTIAL))
+		{
+			paths.push_back(path);
+		}
+	}
+
+	std::stable_sort(paths.begin(), paths.end(), [](const Path& a, const Path& b) { return a.probability > b.probability; });
+	if (paths.size() > TRIAGE_PATHS)
+	{
+		paths.erase(paths.begin() + TRIAGE_PATHS, paths.end());
+	}
+
+	const auto& diff_table = m_spn.getDiffTable();
+	std::map<uint16_t, std::vector<double>> distributions;
+	double llr = 0.0;
+	size_t misses = 0;
+	double excess_deviance = 0.0;
+	double fitted_pairs = 0.0;
+
+	for (const Path& path : paths)
+	{
+		uint16_t output_mask = Mask(path.output_diff);
+		const auto sboxes = FindSbox(output_mask);
+
+		double allowed = 1.0;
+		for (uint16_t sbox_index : sboxes)
+		{
+			size_t count = 0;
+			for (uint16_t dy = 1; dy <= 0xf; ++dy)
+			{
+				count += diff_table[SboxValue(sbox_index, path.output_diff)][dy] != 0 ? 1 : 0;
+			}
+			allowed *= static_cast<double>(count);
+		}
+		double q = allowed / 0xffff;
+
+		auto passes = [&](uint16_t ct_diff)
+		{
+			if ((ct_diff & ~output_mask) != 0)
+			{
+				return false;
+			}
+
+			for (uint16_t sbox_index : sboxes)
+			{
+				if (diff_table[SboxValue(sbox_index, path.output_diff)][SboxValue(sbox_index, ct_diff)] == 0)
+				{
+					return false;
+				}
+			}
+			return true;
+		};
+
+		size_t wanted = std::max<size_t>(TRIAGE_PAIRS, static_cast<size_t>(std::ceil(TRIAGE_MIN_RIGHT_PAIRS / path.probability)));
+		size_t sampled = 0;
+		size_t passed = 0;
+		// Pairs differing only in the active sbox by each difference, triage paths have a single one
+		size_t cells[16] = { 0 };
+		const uint32_t shift = (3 - sboxes[0]) * 4;
+		for (uint32_t k = 0; k <= 0xffff && sampled < wanted; ++k)
+		{
+			uint32_t i = (k * TRIAGE_STRIDE) & 0xffff;
+			uint32_t j = i ^ path.input_diff;
+			if (j < i || j >= m_pc1.size())
+			{
+				continue;
+			}
+
+			++sampled;
+			uint16_t ct_diff = m_pc1[i] ^ m_pc1[j];
+			if ((ct_diff & ~output_mask) == 0)
+			{
+				++cells[(ct_diff >> shift) & 0xf];
+			}
+			if (passes(ct_diff))
+			{
+				++passed;
+			}
+		}
+
+		double random = sampled * q;
+		double spn = sampled * (path.probability + (1.0 - path.probability) * q);
+		double path_llr = random > 0.0 ? passed * std::log(spn / random) - (spn - random) : 0.0;
+		double tail = passed < spn ? PoissonLowerTail(passed, spn) : 0.0;
+		llr += path_llr;
+		misses += tail < std::log(TRIAGE_MAX_MISS_PROBABILITY) ? 1 : 0;
+
+		auto found = distributions.find(path.input_diff);
+		if (found == distributions.end())
+		{
+			found = distributions.emplace(path.input_diff, DifferenceDistribution(m_spn, path.input_diff)).first;
+		}
+
+		// Poisson deviance of the cells, a cell this sbox can't reach costs a lot
+		double deviance = 0.0;
+		double seen = 0.0;
+		double predicted = 0.0;
+		for (uint32_t dy = 1; dy <= 0xf; ++dy)
+		{
+			double expected = std::max(1e-9, sampled * found->second[dy << shift]);
+			double count = static_cast<double>(cells[dy]);
+			deviance += 2.0 * ((count > 0.0 ? count * std::log(count / expected) : 0.0) - (count - expected));
+			seen += count;
+			predicted += expected;
+		}
+		excess_deviance += deviance - 15.0;
+		fitted_pairs += std::max(seen, predicted);
+
+		KF_LOG(VERBOSE_NONE, "triage: %04hx -> %04hx, p = 2^%.1f, %zd pairs, %zd pass (%.1f expected, %.1f if random), LLR %.1f, P(this few) = %.2g\n",
+			path.input_diff, path.output_diff, Log2(path.probability), sampled, passed, spn, random, path_llr, std::exp(tail));
+		KF_LOG(VERBOSE_NONE, "triage:     %.0f pairs differ only in sbox %hd (%.1f predicted for this sbox), deviance %.1f\n",
+			seen, sboxes[0], predicted, deviance);
+	}
+
+	AttackEstimate differential = estimateAttack(ENGINE_DIFFERENTIAL, m_compute_4_sboxes ? 4 : (m_compute_3_sboxes ? 3 : 2));
+	AttackEstimate linear = estimateAttack(ENGINE_LINEAR, 4);
+	KF_LOG(VERBOSE_NONE, "triage: differential attack needs 2^%.1f texts and 2^%.1f partial decryptions, linear 2^%.1f and 2^%.1f\n",
+		Log2(differential.data), Log2(differential.work), Log2(linear.data), Log2(linear.work));
+
+	double texts = static_cast<double>(m_pc1.size());
+	if (std::min(differential.data, linear.data) > texts)
+	{
+		KF_LOG(VERBOSE_NONE, "triage: the codebook has only 2^%.1f texts, expect the attack to fail\n", Log2(texts));
+	}
+
+	double misfit = std::max(0.0, excess_deviance) / std::max(1.0, fitted_pairs);
+	bool sbox_fits = misfit <= TRIAGE_MAX_MISFIT;
+
+	TriageVerdict verdict = TRIAGE_INCONCLUSIVE;
+	if (misses >= TRIAGE_MAX_MISSES || llr <= -TRIAGE_DECISION_LLR)
+	{
+		verdict = TRIAGE_IMPLAUSIBLE;
+	}
+	else if (llr >= TRIAGE_DECISION_LLR && sbox_fits)
+	{
+		verdict = TRIAGE_PLAUSIBLE;
+	}
+
+	KF_LOG(VERBOSE_NONE, "triage: LLR %.1f, %zd of %zd characteristics missed, misfit %.2f per pair, %s\n", llr, misses, paths.size(), misfit,
+		verdict == TRIAGE_PLAUSIBLE ? "codebook fits this SPN" :
+		verdict == TRIAGE_IMPLAUSIBLE ? "codebook does not fit this SPN (wrong sbox, permutation or rounds?)" :
+		!sbox_fits ? "inconclusive, the pairs don't split like this sbox says (wrong sbox?)" : "inconclusive");
+
+	return verdict;
+}
@@ -0,0 +1,223 @@
+// truncated.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Truncated differentials.
+//
+// A truncated path only says which sboxes of round_num - 1 are active, not what their differences are.
+// Every sbox output bit goes to a different nibble through the permutation, so if only the sboxes T are active,
+// every nibble of the sbox input of round_num can differ only in the bits coming from T. That's a condition
+// on each nibble alone, so a subkey nibble is counted over every pair without guessing the others.
+//
+// The probability of a pattern is the sum over every characteristic leading to it, computed by pushing the
+// whole difference distribution through the DDT (prepareTruncated), which is a lot more than the single best
+// characteristic genPath finds when no sbox entry stands out.
+//
+#include "keyfinder.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace
+{
+	// Same bits as SboxState uses
+	uint16_t ActivePattern(uint16_t diff)
+	{
+		uint16_t pattern = 0;
+		for (size_t i = 0; i < 4; ++i)
+		{
+			if ((diff & (0x000f << i * 4)) != 0)
+			{
+				pattern |= 1 << i;
+			}
+		}
+		return pattern;
+	}
+
+	int BitCount(uint16_t x)
+	{
+		int count = 0;
+		for (; x != 0; x &= x - 1)
+		{
+			++count;
+		}
+		return count;
+	}
+}
+
+
+void KeyFinder::prepareTruncated()
+{
+	const auto& diff_table = m_spn.getDiffTable();
+
+	m_truncated_patterns.assign(SPN::Nr + 1, std::map<uint16_t, std::vector<double>>());
+
+	for (size_t sbox_index = 0; sbox_index < 4; ++sbox_index)
+	{
+		for (uint16_t dx = 1; dx <= 0xf; ++dx)
+		{
+			uint16_t input_diff = MakeSbox(sbox_index, dx);
+
+			std::vector<double> dist(0x10000, 0.0);
+			dist[input_diff] = 1.0;
+
+			// dist is the distribution of the sbox input difference of round_num, so the pattern of the sbox
+			// outputs of round_num - 1 is the one of the inputs, sboxes are bijective
+			for (size_t round_num = 2; round_num <= SPN::Nr; ++round_num)
+			{
+				std::vector<double> patterns(16, 0.0);
+				for (uint32_t d = 0; d <= 0xffff; ++d)
+				{
+					patterns[ActivePattern(static_cast<uint16_t>(d))] += dist[d];
+				}
+				m_truncated_patterns[round_num][input_diff] = patterns;
+
+				if (round_num == SPN::Nr)
+				{
+					break;
+				}
+
+				// Sbox layer one nibble at a time, then the permutation
+				for (size_t n = 0; n < 4; ++n)
+				{
+					std::vector<double> next(0x10000, 0.0);
+					for (uint32_t d = 0; d <= 0xffff; ++d)
+					{
+						if (dist[d] == 0.0)
+						{
+							continue;
+						}
+
+						uint16_t in = SboxValue(n, static_cast<uint16_t>(d));
+						if (in == 0)
+						{
+							next[d] += dist[d];
+							continue;
+						}
+
+						uint16_t rest = static_cast<uint16_t>(d) & ~SboxMask(n);
+						for (uint16_t out = 1; out <= 0xf; ++out)
+						{
+							if (diff_table[in][out] != 0)
+							{
+								next[rest | MakeSbox(n, out)] += dist[d] * diff_table[in][out] / 16.0;
+							}
+						}
+					}
+					dist.swap(next);
+				}
+
+				std::vector<double> next(0x10000, 0.0);
+				for (uint32_t d = 0; d <= 0xffff; ++d)
+				{
+					next[m_spn.transp(static_cast<uint16_t>(d))] += dist[d];
+				}
+				dist.swap(next);
+			}
+		}
+	}
+}
+
+
+std::vector<KeyFinder::Path> KeyFinder::genTruncatedPath(size_t round_num, const SboxState& wanted_sbox) const
+{
+	size_t sbox_index = FindSbox(wanted_sbox.mask)[0];
+
+	// Score is how far the right subkey should be above the rest: a right pair always passes, any other pair
+	// (and any pair under a wrong subkey) passes about as often as a random difference would, q
+	std::vector<std::pair<double, Path>> scored;
+	for (const auto& p : m_truncated_patterns[round_num])
+	{
+		const std::vector<double>& patterns = p.second;
+
+		// The last pattern has every sbox active, which says nothing
+		for (uint16_t allowed_sboxes = 1; allowed_sboxes < 0xf; ++allowed_sboxes)
+		{
+			double probability = 0.0;
+			for (uint16_t pattern = 1; pattern <= 0xf; ++pattern)
+			{
+				if ((pattern & ~allowed_sboxes) == 0)
+				{
+					probability += patterns[pattern];
+				}
+			}
+
+			uint16_t allowed_bits = SboxValue(sbox_index, m_spn.transp(SboxState(allowed_sboxes).mask));
+			if (allowed_bits == 0 || allowed_bits == 0xf || probability == 0.0)
+			{
+				continue;
+			}
+
+			double q = (1 << BitCount(allowed_bits)) / 16.0;
+			double score = probability * sqrt((1.0 - q) / q);
+
+			scored.push_back(std::make_pair(score, Path(p.first, MakeSbox(sbox_index, allowed_bits), probability)));
+		}
+	}
+
+	std::stable_sort(scored.begin(), scored.end(),
+		[](const std::pair<double, Path>& a, const std::pair<double, Path>& b) { return a.first > b.first; });
+
+	// The best path for each set of allowed bits. With the same forbidden bits, key and key ^ delta can pass for
+	// exactly the same pairs if delta is a linear structure of those bits of the inverse sbox, other bits break the tie
+	std::vector<Path> paths;
+	uint32_t used_bits = 0;
+	for (size_t i = 0; i < scored.size() && paths.size() < TRUNCATED_PATHS; ++i)
+	{
+		uint16_t allowed_bits = SboxValue(sbox_index, scored[i].second.output_diff);
+		if ((used_bits & (1u << allowed_bits)) != 0)
+		{
+			continue;
+		}
+		used_bits |= 1u << allowed_bits;
+
+		KF_LOG(VERBOSE_MEDIUM, "truncated: key[%zd] input=%04hx, allowed bits=%04hx, prob=%lf, score=%lf\n",
+			round_num, scored[i].second.input_diff, scored[i].second.output_diff, scored[i].second.probability, scored[i].first);
+
+		paths.push_back(scored[i].second);
+	}
+
+	return paths;
+}
+
+
+std::map<uint16_t, size_t> KeyFinder::getTruncatedSubkey(size_t round_num, const Path& path) const
+{
+	size_t sbox_index = FindSbox(path.output_diff)[0];
+	uint16_t forbidden = ~SboxValue(sbox_index, path.output_diff) & 0xf;
+
+	const PeeledTexts texts = peeledTexts(round_num);
+	std::vector<uint16_t> peeled(m_pc1.size());
+	for (size_t i = 0; i < m_pc1.size(); ++i)
+	{
+		peeled[i] = SboxValue(sbox_index, texts.permuted(i));
+	}
+
+	size_t counts[16] = { 0 };
+	for (uint32_t i = 0; i < peeled.size(); ++i)
+	{
+		uint32_t j = i ^ path.input_diff;
+		if (j < i)
+		{
+			continue;
+		}
+
+		for (uint16_t k = 0; k <= 0xf; ++k)
+		{
+			uint16_t d = (m_spn.isubst(peeled[i] ^ k) ^ m_spn.isubst(peeled[j] ^ k)) & 0xf;
+			if ((d & forbidden) == 0)
+			{
+				++counts[k];
+			}
+		}
+	}
+
+	std::map<uint16_t, size_t> hist;
+	for (uint16_t k = 0; k <= 0xf; ++k)
+	{
+		hist[MakeSbox(sbox_index, k)] = counts[k];
+	}
+
+	return hist;
+}
@@ -0,0 +1,404 @@
+// circuit.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+#include "circuit.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+
+
+namespace
+{
+	// Bit x of a truth table is the value for the input x
+	const uint16_t INPUT_TABLES[SboxCircuit::INPUTS] = { 0xaaaa, 0xcccc, 0xf0f0, 0xff00 };
+
+	const uint8_t NO_SIGNAL = 0xff;
+
+	uint16_t Apply(SboxCircuit::Op op, uint16_t a, uint16_t b)
+	{
+		switch (op)
+		{
+		case SboxCircuit::OP_XOR: return a ^ b;
+		case SboxCircuit::OP_AND: return a & b;
+		case SboxCircuit::OP_OR: return a | b;
+		case SboxCircuit::OP_ANDN: return a & ~b;
+		case SboxCircuit::OP_NOT: return ~a;
+		}
+		return 0;
+	}
+
+	// Signals computed so far, by value too. Past MAX_GATES gates nothing is added anymore and the builder is only
+	// good for throwing away, the signals have to fit in the evaluate array and below NO_SIGNAL.
+	struct Builder
+	{
+		std::vector<uint16_t> values;
+		std::vector<SboxCircuit::Gate> gates;
+		std::vector<uint8_t> signal;
+		bool overflow{ false };
+
+		Builder() :
+			signal(0x10000, NO_SIGNAL)
+		{
+			for (size_t i = 0; i < SboxCircuit::INPUTS; ++i)
+			{
+				signal[INPUT_TABLES[i]] = static_cast<uint8_t>(values.size());
+				values.push_back(INPUT_TABLES[i]);
+			}
+		}
+
+		uint8_t add(SboxCircuit::Op op, uint8_t a, uint8_t b = 0)
+		{
+			if (overflow)
+			{
+				return 0;
+			}
+
+			uint16_t value = Apply(op, values[a], values[b]);
+			if (signal[value] != NO_SIGNAL)
+			{
+				return signal[value];
+			}
+
+			if (gates.size() >= SboxCircuit::MAX_GATES)
+			{
+				overflow = true;
+				return 0;
+			}
+
+			gates.push_back(SboxCircuit::Gate{ op, a, b });
+			signal[value] = static_cast<uint8_t>(values.size());
+			values.push_back(value);
+			return signal[value];
+		}
+
+		// Gate with t (not a signal yet) as one input and some signal as the other giving target, or NO_SIGNAL
+		bool second(uint16_t t, uint16_t target, SboxCircuit::Op& op, uint8_t& other, bool& t_first) const
+		{
+			t_first = true;
+			if (static_cast<uint16_t>(~t) == target)
+			{
+				op = SboxCircuit::OP_NOT;
+				other = 0;
+				return true;
+			}
+
+			if (signal[t ^ target] != NO_SIGNAL)
+			{
+				op = SboxCircuit::OP_XOR;
+				other = signal[t ^ target];
+				return true;
+			}
+
+			// The rest only works when target and t are in the right subset relation, which is rare
+			bool in_t = (target & ~t) == 0;
+			bool has_t = (t & ~target) == 0;
+			bool outside_t = (target & t) == 0;
+			if (!in_t && !has_t && !outside_t)
+			{
+				return false;
+			}
+
+			for (size_t a = 0; a < values.size(); ++a)
+			{
+				uint16_t v = values[a];
+				other = static_cast<uint8_t>(a);
+				if (in_t && (t & v) == target)
+				{
+					op = SboxCircuit::OP_AND;
+					return true;
+				}
+				if (in_t && (t & ~v) == target)
+				{
+					op = SboxCircuit::OP_ANDN;
+					return true;
+				}
+				if (has_t && (t | v) == target)
+				{
+					op = SboxCircuit::OP_OR;
+					return true;
+				}
+				if (outside_t && (v & ~t) == target)
+				{
+					op = SboxCircuit::OP_ANDN;
+					t_first = false;
+					return true;
+				}
+			}
+
+			return false;
+		}
+	};
+
+	const SboxCircuit::Op BINARY_OPS[] = { SboxCircuit::OP_XOR, SboxCircuit::OP_AND, SboxCircuit::OP_OR, SboxCircuit::OP_ANDN };
+
+	uint8_t Ensure(Builder& builder, uint16_t target);
+
+	// One or two gates on top of the signals, every combination
+	bool SearchGates(Builder& builder, uint16_t target)
+	{
+		size_t n = builder.values.size();
+		for (size_t a = 0; a < n; ++a)
+		{
+			for (size_t b = 0; b < n; ++b)
+			{
+				for (SboxCircuit::Op op : BINARY_OPS)
+				{
+					if (op != SboxCircuit::OP_ANDN && b < a)
+					{
+						continue;
+					}
+
+					if (Apply(op, builder.values[a], builder.values[b]) == target)
+					{
+						builder.add(op, static_cast<uint8_t>(a), static_cast<uint8_t>(b));
+						return true;
+					}
+				}
+			}
+
+			if (static_cast<uint16_t>(~builder.values[a]) == target)
+			{
+				builder.add(SboxCircuit::OP_NOT, static_cast<uint8_t>(a));
+				return true;
+			}
+		}
+
+		for (size_t a = 0; a < n; ++a)
+		{
+			for (size_t b = 0; b < n; ++b)
+			{
+				for (int i = -1; i < 4; ++i)
+				{
+					SboxCircuit::Op op = i < 0 ? SboxCircuit::OP_NOT : BINARY_OPS[i];
+					if ((op == SboxCircuit::OP_NOT && b != 0) || (op != SboxCircuit::OP_ANDN && op != SboxCircuit::OP_NOT && b < a))
+					{
+						continue;
+					}
+
+					uint16_t t = Apply(op, builder.values[a], builder.values[b]);
+					if (builder.signal[t] != NO_SIGNAL)
+					{
+						continue;
+					}
+
+					SboxCircuit::Op op2;
+					uint8_t other;
+					bool t_first;
+					if (builder.second(t, target, op2, other, t_first))
+					{
+						uint8_t s = builder.add(op, static_cast<uint8_t>(a), static_cast<uint8_t>(b));
+						builder.add(op2, t_first ? s : other, t_first ? other : s);
+						return true;
+					}
+				}
+			}
+		}
+
+		return false;
+	}
+
+	// f = f0 ^ (x & (f0 ^ f1)) with the cofactors of the input bit
+	void Split(Builder& builder, uint16_t target, size_t input)
+	{
+		uint16_t x = INPUT_TABLES[input];
+		unsigned shift = 1u << input;
+		uint16_t f0 = target & ~x;
+		f0 |= f0 << shift;
+		uint16_t f1 = target & x;
+		f1 |= f1 >> shift;
+		uint16_t d = f0 ^ f1;
+		uint8_t xs = static_cast<uint8_t>(input);
+
+		if (f0 == 0)
+		{
+			builder.add(SboxCircuit::OP_AND, xs, Ensure(builder, d));
+		}
+		else if (d == 0xffff)
+		{
+			builder.add(SboxCircuit::OP_XOR, Ensure(builder, f0), xs);
+		}
+		else if (f0 == 0xffff)
+		{
+			// ~x | f1
+			uint8_t g = builder.add(SboxCircuit::OP_ANDN, xs, Ensure(builder, f1));
+			builder.add(SboxCircuit::OP_NOT, g);
+		}
+		else
+		{
+			uint8_t a = Ensure(builder, f0);
+			uint8_t t = builder.add(SboxCircuit::OP_AND, xs, Ensure(builder, d));
+			builder.add(SboxCircuit::OP_XOR, a, t);
+		}
+	}
+
+	uint8_t Ensure(Builder& builder, uint16_t target)
+	{
+		if (builder.overflow)
+		{
+			return 0;
+		}
+
+		if (builder.signal[target] != NO_SIGNAL || SearchGates(builder, target))
+		{
+			return builder.signal[target];
+		}
+
+		// Depends on no input bit, every split would skip it
+		if (target == 0 || target == 0xffff)
+		{
+			uint8_t zero = builder.add(SboxCircuit::OP_ANDN, 0, 0);
+			return target == 0 ? zero : builder.add(SboxCircuit::OP_NOT, zero);
+		}
+
+		Builder best;
+		bool found = false;
+		for (size_t input = 0; input < SboxCircuit::INPUTS; ++input)
+		{
+			uint16_t x = INPUT_TABLES[input];
+			unsigned shift = 1u << input;
+			if (((target & x) >> shift) == (target & ~x))
+			{
+				continue;
+			}
+
+			Builder split = builder;
+			Split(split, target, input);
+			if (!found || (best.overflow && !split.overflow) || (best.overflow == split.overflow && split.gates.size() < best.gates.size()))
+			{
+				best = split;
+				found = true;
+			}
+		}
+
+		if (found)
+		{
+			builder = best;
+		}
+		return builder.overflow ? 0 : builder.signal[target];
+	}
+}
+
+
+const SboxCircuit& SboxCircuit::Get(const std::vector<uint16_t>& sbox)
+{
+	static std::mutex mutex;
+	static std::map<uint64_t, SboxCircuit> cache;
+
+	// 16 nibbles, the whole sbox is the key
+	uint64_t key = 0;
+	for (uint16_t v : sbox)
+	{
+		key = (key << 4) | (v & 0xf);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = cache.find(key);
+	if (it == cache.end())
+	{
+		it = cache.emplace(key, Synthesize(sbox)).first;
+	}
+
+	return it->second;
+}
+
+
+SboxCircuit SboxCircuit::Synthesize(const std::vector<uint16_t>& sbox)
+{
+	uint16_t targets[INPUTS] = { 0 };
+	for (size_t i = 0; i < INPUTS; ++i)
+	{
+		for (uint16_t x = 0; x <= 0xf; ++x)
+		{
+			targets[i] |= ((sbox[x] >> i) & 1) << x;
+		}
+	}
+
+	SboxCircuit best;
+	bool found = false;
+
+	// Signals of the outputs done first are there for the later ones
+	size_t order[INPUTS] = { 0, 1, 2, 3 };
+	do
+	{
+		Builder builder;
+		uint8_t outputs[INPUTS];
+		for (size_t i : order)
+		{
+			outputs[i] = Ensure(builder, targets[i]);
+		}
+
+		if (!builder.overflow && (!found || builder.gates.size() < best.m_gates.size()))
+		{
+			best.m_gates = builder.gates;
+			std::copy(outputs, outputs + INPUTS, best.m_outputs);
+			found = true;
+		}
+	} while (std::next_permutation(order, order + INPUTS));
+
+	if (!found || best.size() > MAX_GATES || !best.computes(sbox))
+	{
+		best.m_gates.clear();
+		std::copy(sbox.begin(), sbox.end(), std::back_inserter(best.m_table));
+	}
+
+	return best;
+}
+
+
+bool SboxCircuit::computes(const std::vector<uint16_t>& sbox) const
+{
+	uint64_t in[4][INPUTS];
+	uint64_t out[4][INPUTS];
+	for (size_t n = 0; n < 4; ++n)
+	{
+		for (size_t i = 0; i < INPUTS; ++i)
+		{
+			in[n][i] = INPUT_TABLES[i];
+		}
+	}
+
+	evaluate(in, out);
+
+	for (uint16_t x = 0; x <= 0xf; ++x)
+	{
+		uint16_t y = 0;
+		for (size_t i = 0; i < INPUTS; ++i)
+		{
+			y |= ((out[0][i] >> x) & 1) << i;
+		}
+
+		if (y != sbox[x])
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+void SboxCircuit::evaluateTable(const uint64_t in[4][INPUTS], uint64_t out[4][INPUTS]) const
+{
+	for (size_t n = 0; n < 4; ++n)
+	{
+		uint64_t y[INPUTS] = { 0 };
+		for (size_t block = 0; block < 64; ++block)
+		{
+			uint16_t x = 0;
+			for (size_t i = 0; i < INPUTS; ++i)
+			{
+				x |= static_cast<uint16_t>(((in[n][i] >> block) & 1) << i);
+			}
+
+			for (size_t i = 0; i < INPUTS; ++i)
+			{
+				y[i] |= static_cast<uint64_t>((m_table[x] >> i) & 1) << block;
+			}
+		}
+
+		std::copy(y, y + INPUTS, out[n]);
+	}
+}
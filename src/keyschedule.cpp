@@ -0,0 +1,190 @@
+// keyschedule.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+#include "keyschedule.hpp"
+#include "spn.hpp"
+
+#include <cctype>
+#include <fstream>
+
+
+KeySchedule::KeySchedule()
+{
+	setIndependent();
+}
+
+
+void KeySchedule::setIndependent()
+{
+	m_key_bits = 16 * (SPN::Nr + 1);
+	m_independent = true;
+	m_rows.assign((SPN::Nr + 1) * 16, Row());
+
+	for (size_t r = 0; r <= SPN::Nr; ++r)
+	{
+		for (size_t b = 0; b < 16; ++b)
+		{
+			m_rows[r * 16 + b].set(16 * (SPN::Nr - r) + b);
+		}
+	}
+}
+
+
+void KeySchedule::setRotate()
+{
+	m_key_bits = 32;
+	m_independent = false;
+	m_rows.assign((SPN::Nr + 1) * 16, Row());
+
+	// Bit 16 + b of rotl(K, 4r) is bit 16 + b - 4r of K
+	for (size_t r = 0; r <= SPN::Nr; ++r)
+	{
+		for (size_t b = 0; b < 16; ++b)
+		{
+			m_rows[r * 16 + b].set((16 + b + 32 - 4 * r) % 32);
+		}
+	}
+}
+
+
+bool KeySchedule::parseHex(const std::string& s, size_t bits, Row& out)
+{
+	if (s.size() * 4 != bits)
+	{
+		return false;
+	}
+
+	out.reset();
+	for (size_t i = 0; i < s.size(); ++i)
+	{
+		if (!isxdigit(static_cast<unsigned char>(s[i])))
+		{
+			return false;
+		}
+
+		unsigned digit = isdigit(static_cast<unsigned char>(s[i])) ? s[i] - '0' : tolower(static_cast<unsigned char>(s[i])) - 'a' + 10;
+		size_t low = 4 * (s.size() - 1 - i);
+		for (size_t b = 0; b < 4; ++b)
+		{
+			out[low + b] = ((digit >> b) & 1) != 0;
+		}
+	}
+
+	return true;
+}
+
+
+bool KeySchedule::load(const std::string& name)
+{
+	if (name == "independent")
+	{
+		setIndependent();
+		return true;
+	}
+
+	if (name == "rotate")
+	{
+		setRotate();
+		return true;
+	}
+
+	std::ifstream in(name);
+	if (!in.is_open())
+	{
+		return false;
+	}
+
+	size_t key_bits = 0;
+	std::vector<Row> rows;
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		while (!line.empty() && isspace(static_cast<unsigned char>(line.back())))
+		{
+			line.pop_back();
+		}
+
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		if (key_bits == 0)
+		{
+			if (sscanf(line.c_str(), "bits %zd", &key_bits) != 1 || key_bits == 0 || key_bits > MAX_KEY_BITS || key_bits % 4 != 0)
+			{
+				return false;
+			}
+			continue;
+		}
+
+		Row row;
+		if (!parseHex(line, key_bits, row))
+		{
+			return false;
+		}
+		rows.push_back(row);
+	}
+
+	if (rows.size() != (SPN::Nr + 1) * 16)
+	{
+		return false;
+	}
+
+	// The file goes from the highest bit of every subkey
+	m_key_bits = key_bits;
+	m_independent = false;
+	m_rows.assign(rows.size(), Row());
+	for (size_t r = 0; r <= SPN::Nr; ++r)
+	{
+		for (size_t b = 0; b < 16; ++b)
+		{
+			m_rows[r * 16 + b] = rows[r * 16 + 15 - b];
+		}
+	}
+
+	return true;
+}
+
+
+bool KeySchedule::parseKey(const char* key, Row& master) const
+{
+	return parseHex(key, m_key_bits, master);
+}
+
+
+std::string KeySchedule::keyStr(const Row& master) const
+{
+	std::string key;
+	for (size_t i = m_key_bits / 4; i > 0; --i)
+	{
+		unsigned digit = 0;
+		for (size_t b = 0; b < 4; ++b)
+		{
+			digit |= master[4 * (i - 1) + b] ? 1u << b : 0;
+		}
+		key += "0123456789abcdef"[digit];
+	}
+
+	return key;
+}
+
+
+std::vector<uint16_t> KeySchedule::expand(const Row& master) const
+{
+	std::vector<uint16_t> subkeys(SPN::Nr + 1, 0);
+	for (size_t r = 0; r <= SPN::Nr; ++r)
+	{
+		for (size_t b = 0; b < 16; ++b)
+		{
+			if ((getRow(r, b) & master).count() % 2 != 0)
+			{
+				subkeys[r] |= 1 << b;
+			}
+		}
+	}
+
+	return subkeys;
+}
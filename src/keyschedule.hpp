@@ -0,0 +1,55 @@
+// keyschedule.hpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Linear key schedules: every subkey bit is a XOR of some master key bits, one row of a GF(2) matrix per
+// subkey bit. The default one is the original 80-bit key split into 5 independent subkeys.
+//
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+class KeySchedule
+{
+public:
+	static const size_t MAX_KEY_BITS = 80;
+	using Row = std::bitset<MAX_KEY_BITS>;
+
+	// Independent subkeys, master key bit 16 * (Nr - r) + b = bit b of key[r]
+	explicit KeySchedule();
+
+	// "independent", "rotate" (32-bit master key, key[r] = the top 16 bits of it rotated left by 4r) or a file:
+	//
+	//	bits <master key bits, multiple of 4>
+	//	<hex mask of the master key bits XORed into key[0] bit 15>
+	//	<key[0] bit 14>
+	//	...
+	//	<key[4] bit 0>
+	//
+	// Empty lines and lines starting with # are skipped.
+	bool load(const std::string& name);
+
+	size_t getKeyBits() const { return m_key_bits; }
+	bool isIndependent() const { return m_independent; }
+	// Master key bits that make up bit b (0 = lowest) of key[r]
+	const Row& getRow(size_t round_num, size_t bit) const { return m_rows[round_num * 16 + bit]; }
+
+	// Hex string of getKeyBits() / 4 digits, same bit order as a number
+	bool parseKey(const char* key, Row& master) const;
+	std::string keyStr(const Row& master) const;
+	std::vector<uint16_t> expand(const Row& master) const;
+
+private:
+	size_t m_key_bits;
+	bool m_independent;
+	std::vector<Row> m_rows;
+
+	void setIndependent();
+	void setRotate();
+	static bool parseHex(const std::string& s, size_t bits, Row& out);
+};
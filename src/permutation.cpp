@@ -0,0 +1,187 @@
+// permutation.cpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+#include "permutation.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+
+BitPermutation::BitPermutation()
+{
+	load("transpose");
+}
+
+
+void BitPermutation::Compiled::compile(const uint16_t* to)
+{
+	groups = 0;
+	uint16_t by_rotate[16] = { 0 };
+	for (unsigned bit = 0; bit < 16; ++bit)
+	{
+		by_rotate[(to[bit] + 16 - bit) % 16] |= 1 << bit;
+	}
+
+	for (unsigned r = 0; r < 16; ++r)
+	{
+		if (by_rotate[r] != 0)
+		{
+			mask[groups] = by_rotate[r];
+			rotate[groups] = r;
+			++groups;
+		}
+	}
+
+	for (unsigned x = 0; x < 256; ++x)
+	{
+		low[x] = 0;
+		high[x] = 0;
+		for (unsigned bit = 0; bit < 8; ++bit)
+		{
+			if ((x & (1 << bit)) != 0)
+			{
+				low[x] |= 1 << to[bit];
+				high[x] |= 1 << to[bit + 8];
+			}
+		}
+	}
+
+	bool transpose = true;
+	for (unsigned bit = 0; bit < 16; ++bit)
+	{
+		transpose = transpose && Transpose(1 << bit) == 1 << to[bit];
+	}
+
+	kind = transpose ? KIND_TRANSPOSE : (groups > MAX_ROTATE_GROUPS ? KIND_TABLES : KIND_ROTATE);
+}
+
+
+bool BitPermutation::set(const std::vector<uint16_t>& positions)
+{
+	if (positions.size() != 16)
+	{
+		return false;
+	}
+
+	uint32_t seen = 0;
+	for (uint16_t p : positions)
+	{
+		if (p >= 16 || (seen & (1u << p)) != 0)
+		{
+			return false;
+		}
+		seen |= 1u << p;
+	}
+
+	// positions are numbered from the most significant bit, the compiled ones from the least
+	uint16_t to[16];
+	uint16_t from[16];
+	for (size_t i = 0; i < 16; ++i)
+	{
+		to[15 - i] = 15 - positions[i];
+		from[15 - positions[i]] = static_cast<uint16_t>(15 - i);
+	}
+
+	m_positions = positions;
+	m_forward.compile(to);
+	m_inverse.compile(from);
+
+	return true;
+}
+
+
+bool BitPermutation::load(const std::string& spec)
+{
+	std::string text = spec;
+	if (spec == "transpose")
+	{
+		text = "0 4 8 12 1 5 9 13 2 6 10 14 3 7 11 15";
+	}
+	else
+	{
+		std::ifstream in(spec);
+		if (in.is_open())
+		{
+			std::stringstream ss;
+			ss << in.rdbuf();
+			text = ss.str();
+		}
+	}
+
+	std::vector<uint16_t> positions;
+	const char* p = text.c_str();
+	while (*p != '\0')
+	{
+		if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		{
+			++p;
+			continue;
+		}
+
+		char* end = nullptr;
+		long v = strtol(p, &end, 10);
+		if (end == p || v < 0)
+		{
+			return false;
+		}
+
+		positions.push_back(static_cast<uint16_t>(v));
+		p = end;
+	}
+
+	return set(positions);
+}
+
+
+const char* BitPermutation::getKindName() const
+{
+	switch (m_forward.kind)
+	{
+	case KIND_TRANSPOSE:
+	{
+		return "transpose";
+	}
+	case KIND_ROTATE:
+	{
+		return "mask-rotate";
+	}
+	default:
+	{
+		return "byte tables";
+	}
+	}
+}
+
+
+bool BitPermutation::isInvolution() const
+{
+	for (size_t i = 0; i < 16; ++i)
+	{
+		if (m_positions[m_positions[i]] != i)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+void BitPermutation::applySliced(const uint64_t in[16], uint64_t out[16]) const
+{
+	for (size_t i = 0; i < 16; ++i)
+	{
+		out[m_positions[i]] = in[i];
+	}
+}
+
+
+void BitPermutation::applyInverseSliced(const uint64_t in[16], uint64_t out[16]) const
+{
+	for (size_t i = 0; i < 16; ++i)
+	{
+		out[i] = in[m_positions[i]];
+	}
+}
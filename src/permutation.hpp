@@ -0,0 +1,113 @@
+// permutation.hpp
+// Author: Michal Malik
+// Implemented for 'Design and cryptanalysis of ciphers' at FEI STU, Bratislava, 2019
+//
+// Bit permutation layer of the SPN, the 4x4 transpose by default.
+//
+// The permutation is compiled when it's loaded. The transpose keeps the hand written 7 mask-shift terms (scalar,
+// nothing calling it gets vectorized). Bits of other permutations that move by the same amount are masked and
+// rotated together if that's a single group (a rotation), everything else is done with two 256 entry tables, one
+// per byte: the loop over the groups costs more than the two loads from 2 groups on. Both directions are compiled,
+// so the inverse is right for permutations that aren't involutions.
+//
+// There are no other forms because none of them beat the tables on a single block in a dependency chain. A delta-swap
+// (Benes) network is 7 dependent swaps for 16 bits, 4.5x slower. PEXT/PDEP needs a pair per group of bits that keep
+// their order (4 for the transpose, 5-6 for random permutations), 1.6-2x slower, and BMI2 isn't there on every
+// target the tree builds for.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+class BitPermutation
+{
+public:
+	// Most groups the mask-rotate form is used for, the tables are faster after that
+	static const size_t MAX_ROTATE_GROUPS = 1;
+
+	explicit BitPermutation();
+
+	// "transpose", 16 space or comma separated positions or a file with them. Bits are numbered from the most
+	// significant one like the sboxes, position i is where bit i goes, so the transpose is
+	// "0 4 8 12 1 5 9 13 2 6 10 14 3 7 11 15"
+	bool load(const std::string& spec);
+
+	const std::vector<uint16_t>& getPositions() const { return m_positions; }
+	bool isInvolution() const;
+	// "transpose", "mask-rotate" or "byte tables"
+	const char* getKindName() const;
+
+	uint16_t apply(uint16_t x) const { return m_forward.apply(x); }
+	uint16_t applyInverse(uint16_t x) const { return m_inverse.apply(x); }
+
+	// Bitsliced form, slices[i] holds bit i (from the most significant one) of 64 blocks, it's only moving words
+	void applySliced(const uint64_t in[16], uint64_t out[16]) const;
+	void applyInverseSliced(const uint64_t in[16], uint64_t out[16]) const;
+
+private:
+	enum Kind : int
+	{
+		KIND_TRANSPOSE = 0,
+		KIND_ROTATE,
+		KIND_TABLES
+	};
+
+	struct Compiled
+	{
+		Kind kind{ KIND_TRANSPOSE };
+		size_t groups{ 0 };
+		uint16_t mask[16];
+		unsigned rotate[16];
+		uint16_t low[256];
+		uint16_t high[256];
+
+		// to[i] - where bit i goes, numbered from the least significant bit
+		void compile(const uint16_t* to);
+
+		uint16_t apply(uint16_t x) const
+		{
+			if (kind == KIND_TRANSPOSE)
+			{
+				return Transpose(x);
+			}
+
+			if (kind == KIND_TABLES)
+			{
+				return low[x & 0xff] | high[x >> 8];
+			}
+
+			uint16_t y = 0;
+			for (size_t i = 0; i < groups; ++i)
+			{
+				uint16_t m = x & mask[i];
+				y |= static_cast<uint16_t>((m << rotate[i]) | (m >> ((16 - rotate[i]) & 15)));
+			}
+			return y;
+		}
+	};
+
+	static uint16_t Transpose(uint16_t x)
+	{
+		uint16_t y = 0;
+
+		y ^= ((x) & 0x8421);
+		y ^= ((x) & 0x0842) << 3;
+		y ^= ((x) & 0x0084) << 6;
+		y ^= ((x) & 0x0008) << 9;
+		y ^= ((x) & 0x1000) >> 9;
+		y ^= ((x) & 0x2100) >> 6;
+		y ^= ((x) & 0x4210) >> 3;
+
+		return y;
+	}
+
+	std::vector<uint16_t> m_positions;
+	Compiled m_forward;
+	Compiled m_inverse;
+
+	bool set(const std::vector<uint16_t>& positions);
+};
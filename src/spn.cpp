@@ -4,6 +4,8 @@
 //
 #include "spn.hpp"
 
+#include <algorithm>
+#include <bitset>
 #include <iostream>
 #include <string.h>
 
@@ -13,13 +15,22 @@ SPN::SPN() :
 	m_iSB{ std::vector<uint16_t>(16, 0) },
 	m_subkeys{ std::vector<uint16_t>(SPN::Nr + 1, 0) },
 	m_diff_table{ 16, std::vector<uint16_t>(16) },
-	m_transposed_diff_table{ 16, std::vector<uint16_t>(16) }
+	m_transposed_diff_table{ 16, std::vector<uint16_t>(16) },
+	m_linear_table{ 16, std::vector<int16_t>(16) },
+	m_transposed_linear_table{ 16, std::vector<int16_t>(16) }
 {
 }
 
 
 bool SPN::keysched(const char* key)
 {
+	KeySchedule::Row master;
+	if (strlen(key) * 4 == m_key_schedule.getKeyBits() && m_key_schedule.parseKey(key, master))
+	{
+		m_subkeys = m_key_schedule.expand(master);
+		return true;
+	}
+
 	//PRE: key = 80 bit hexstring -- 20 hex characters
 	if (strlen(key) != 20)
 		return false;
@@ -51,6 +62,13 @@ void SPN::setSboxes(char* sbox)
 
 void SPN::calculateDiffTable()
 {
+	// The entries are counted up, a copy of an SPN still has the table of the sbox it was made with
+	for (size_t i = 0; i <= 0xf; ++i)
+	{
+		std::fill(m_diff_table[i].begin(), m_diff_table[i].end(), 0);
+		std::fill(m_transposed_diff_table[i].begin(), m_transposed_diff_table[i].end(), 0);
+	}
+
 	for (uint16_t x = 0; x <= 0xf; ++x)
 	{
 		uint16_t y = subst(x);
@@ -65,6 +83,82 @@ void SPN::calculateDiffTable()
 }
 
 
+void SPN::calculateLinearTable()
+{
+	for (uint16_t a = 0; a <= 0xf; ++a)
+	{
+		for (uint16_t b = 0; b <= 0xf; ++b)
+		{
+			int16_t matches = 0;
+			for (uint16_t x = 0; x <= 0xf; ++x)
+			{
+				std::bitset<4> parity((a & x) ^ (b & subst(x)));
+				if (parity.count() % 2 == 0)
+				{
+					++matches;
+				}
+			}
+
+			m_linear_table[a][b] = matches - 8;
+			m_transposed_linear_table[b][a] = matches - 8;
+		}
+	}
+}
+
+
+void SPN::swapSboxOutputs(uint16_t a, uint16_t b)
+{
+	// Pairs (x, x ^ dx) with a or b on either side, each one only once
+	auto update_pairs = [this, a, b](int delta)
+	{
+		for (uint16_t dx = 1; dx <= 0xf; ++dx)
+		{
+			uint16_t xs[4] = { a, b, static_cast<uint16_t>(a ^ dx), static_cast<uint16_t>(b ^ dx) };
+			for (size_t i = 0; i < 4; ++i)
+			{
+				if (std::find(xs, xs + i, xs[i]) != xs + i)
+				{
+					continue;
+				}
+
+				uint16_t dy = m_SB[xs[i]] ^ m_SB[xs[i] ^ dx];
+				m_diff_table[dx][dy] += delta;
+				m_transposed_diff_table[dy][dx] += delta;
+			}
+		}
+	};
+
+	auto update_linear = [this, a, b](int delta)
+	{
+		for (uint16_t x : { a, b })
+		{
+			for (uint16_t la = 0; la <= 0xf; ++la)
+			{
+				for (uint16_t lb = 0; lb <= 0xf; ++lb)
+				{
+					std::bitset<4> parity((la & x) ^ (lb & m_SB[x]));
+					if (parity.count() % 2 == 0)
+					{
+						m_linear_table[la][lb] += delta;
+						m_transposed_linear_table[lb][la] += delta;
+					}
+				}
+			}
+		}
+	};
+
+	update_pairs(-1);
+	update_linear(-1);
+
+	std::swap(m_SB[a], m_SB[b]);
+	m_iSB[m_SB[a]] = a;
+	m_iSB[m_SB[b]] = b;
+
+	update_pairs(1);
+	update_linear(1);
+}
+
+
 uint16_t SPN::subst(uint16_t x) const
 {
 	uint16_t y = 0;
@@ -91,28 +185,6 @@ uint16_t SPN::isubst(uint16_t x) const
 }
 
 
-uint16_t SPN::itransp(uint16_t x) const
-{
-	return transp(x);
-}
-
-
-uint16_t SPN::transp(uint16_t x) const
-{
-	uint16_t y = 0;
-
-	y ^= ((x) & 0x8421);
-	y ^= ((x) & 0x0842) << 3;
-	y ^= ((x) & 0x0084) << 6;
-	y ^= ((x) & 0x0008) << 9;
-	y ^= ((x) & 0x1000) >> 9;
-	y ^= ((x) & 0x2100) >> 6;
-	y ^= ((x) & 0x4210) >> 3;
-
-	return y;
-}
-
-
 uint16_t SPN::encrypt(uint16_t pt) const
 {
 	uint16_t x;
@@ -172,3 +244,159 @@ uint16_t SPN::decryptWithKeys(uint16_t ct, const std::vector<uint16_t>& subkeys)
 
 	return x;
 }
+
+
+void SPN::encryptBlocks(const uint16_t* pt, uint16_t* ct, size_t count) const
+{
+	const SboxCircuit& circuit = getCircuit();
+
+	for (size_t start = 0; start < count; start += 64)
+	{
+		size_t n = std::min<size_t>(64, count - start);
+		uint64_t x[16];
+		uint64_t y[16];
+
+		ToSlices(pt + start, n, x);
+		XorKeySliced(x, m_subkeys[0]);
+
+		for (size_t i = 1; i < Nr; i++)
+		{
+			SubstSliced(circuit, x);
+			m_permutation.applySliced(x, y);
+			XorKeySliced(y, m_subkeys[i]);
+			std::copy(y, y + 16, x);
+		}
+
+		SubstSliced(circuit, x);
+		XorKeySliced(x, m_subkeys[Nr]);
+
+		FromSlices(x, ct + start, n);
+	}
+}
+
+
+void SPN::decryptBlocks(const uint16_t* ct, uint16_t* pt, size_t count) const
+{
+	const SboxCircuit& circuit = getInverseCircuit();
+
+	for (size_t start = 0; start < count; start += 64)
+	{
+		size_t n = std::min<size_t>(64, count - start);
+		uint64_t x[16];
+		uint64_t y[16];
+
+		ToSlices(ct + start, n, x);
+		XorKeySliced(x, m_subkeys[Nr]);
+		SubstSliced(circuit, x);
+
+		for (size_t i = Nr - 1; i >= 1; i--)
+		{
+			XorKeySliced(x, m_subkeys[i]);
+			m_permutation.applyInverseSliced(x, y);
+			SubstSliced(circuit, y);
+			std::copy(y, y + 16, x);
+		}
+
+		XorKeySliced(x, m_subkeys[0]);
+
+		FromSlices(x, pt + start, n);
+	}
+}
+
+
+namespace
+{
+	// Swaps bit k of the word index with bit k of the bit index for k = 0..3, it's its own inverse. Four 16 bit
+	// blocks per word become 16 words of one bit each, the order of the blocks inside the words changes but only
+	// FromSlices has to know that
+	void SwapIndexBits(uint64_t w[16])
+	{
+		static const uint64_t masks[4] = { 0x5555555555555555, 0x3333333333333333, 0x0f0f0f0f0f0f0f0f, 0x00ff00ff00ff00ff };
+
+		for (size_t k = 0; k < 4; ++k)
+		{
+			size_t d = static_cast<size_t>(1) << k;
+			for (size_t q = 0; q < 16; ++q)
+			{
+				if ((q & d) != 0)
+				{
+					continue;
+				}
+
+				uint64_t t = ((w[q] >> d) ^ w[q | d]) & masks[k];
+				w[q | d] ^= t;
+				w[q] ^= t << d;
+			}
+		}
+	}
+}
+
+
+void SPN::ToSlices(const uint16_t* blocks, size_t count, uint64_t slices[16])
+{
+	// Block 4q + r at bit 16r of word q
+	uint64_t w[16] = { 0 };
+	for (size_t b = 0; b < count; ++b)
+	{
+		w[b >> 2] |= static_cast<uint64_t>(blocks[b]) << (16 * (b & 3));
+	}
+
+	SwapIndexBits(w);
+
+	// Word j has bit j from the least significant one
+	for (size_t i = 0; i < 16; ++i)
+	{
+		slices[i] = w[15 - i];
+	}
+}
+
+
+void SPN::FromSlices(const uint64_t slices[16], uint16_t* blocks, size_t count)
+{
+	uint64_t w[16];
+	for (size_t i = 0; i < 16; ++i)
+	{
+		w[15 - i] = slices[i];
+	}
+
+	SwapIndexBits(w);
+
+	for (size_t b = 0; b < count; ++b)
+	{
+		blocks[b] = static_cast<uint16_t>(w[b >> 2] >> (16 * (b & 3)));
+	}
+}
+
+
+void SPN::XorKeySliced(uint64_t slices[16], uint16_t key)
+{
+	for (size_t i = 0; i < 16; ++i)
+	{
+		slices[i] ^= ((key >> (15 - i)) & 1) != 0 ? ~static_cast<uint64_t>(0) : 0;
+	}
+}
+
+
+void SPN::SubstSliced(const SboxCircuit& circuit, uint64_t slices[16])
+{
+	// Bit j of nibble n is bit 4n + j from the least significant one
+	uint64_t in[4][SboxCircuit::INPUTS];
+	uint64_t out[4][SboxCircuit::INPUTS];
+	for (size_t n = 0; n < 4; ++n)
+	{
+		for (size_t j = 0; j < SboxCircuit::INPUTS; ++j)
+		{
+			in[n][j] = slices[15 - 4 * n - j];
+		}
+	}
+
+	circuit.evaluate(in, out);
+
+	for (size_t n = 0; n < 4; ++n)
+	{
+		for (size_t j = 0; j < SboxCircuit::INPUTS; ++j)
+		{
+			slices[15 - 4 * n - j] = out[n][j];
+		}
+	}
+}
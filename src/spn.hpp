@@ -4,9 +4,14 @@
 //
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <vector>
 
+#include "circuit.hpp"
+#include "keyschedule.hpp"
+#include "permutation.hpp"
+
 
 class SPN
 {
@@ -15,11 +20,26 @@ public:
 
 	const std::vector<std::vector<uint16_t>>& getDiffTable() const { return m_diff_table; }
 	const std::vector<std::vector<uint16_t>>& getTransposedDiffTable() const { return m_transposed_diff_table; }
+	// LAT[a][b] = #{x : a.x = b.S(x)} - 8
+	const std::vector<std::vector<int16_t>>& getLinearTable() const { return m_linear_table; }
+	const std::vector<std::vector<int16_t>>& getTransposedLinearTable() const { return m_transposed_linear_table; }
 	std::vector<uint16_t>& getSubkeys() { return m_subkeys; }
+	const std::vector<uint16_t>& getSbox() const { return m_SB; }
+
+	const KeySchedule& getKeySchedule() const { return m_key_schedule; }
+	void setKeySchedule(const KeySchedule& key_schedule) { m_key_schedule = key_schedule; }
+
+	const BitPermutation& getPermutation() const { return m_permutation; }
+	void setPermutation(const BitPermutation& permutation) { m_permutation = permutation; }
 
+	// Master key of the key schedule in hex, or the 5 subkeys one after another (aaaabbbbccccddddeeee)
 	bool keysched(const char* key);
 	void setSboxes(char* sbox);
 	void calculateDiffTable();
+	void calculateLinearTable();
+	// Swaps S(a) and S(b) and fixes up both tables (already calculated) only where the two outputs count: the DDT
+	// entries of the pairs with a or b in them and the LAT entries of x = a and x = b
+	void swapSboxOutputs(uint16_t a, uint16_t b);
 
 	uint16_t encrypt(uint16_t pt) const;
 	uint16_t decrypt(uint16_t ct) const;
@@ -27,8 +47,21 @@ public:
 	uint16_t decryptWithKeys(uint16_t ct, const std::vector<uint16_t>& subkeys) const;
 	uint16_t subst(uint16_t x) const;
 	uint16_t isubst(uint16_t x) const;
-	uint16_t itransp(uint16_t x) const;
-	uint16_t transp(uint16_t x) const;
+	uint16_t itransp(uint16_t x) const { return m_permutation.applyInverse(x); }
+	uint16_t transp(uint16_t x) const { return m_permutation.apply(x); }
+
+	// Any number of blocks, 64 at a time bitsliced
+	void encryptBlocks(const uint16_t* pt, uint16_t* ct, size_t count) const;
+	void decryptBlocks(const uint16_t* ct, uint16_t* pt, size_t count) const;
+
+	// Bitsliced, slices[i] holds bit i (from the most significant one) of 64 blocks like in BitPermutation and the
+	// sbox layer runs the circuit of the sbox or its inverse, searched for on first use (see SboxCircuit)
+	const SboxCircuit& getCircuit() const { return SboxCircuit::Get(m_SB); }
+	const SboxCircuit& getInverseCircuit() const { return SboxCircuit::Get(m_iSB); }
+	static void ToSlices(const uint16_t* blocks, size_t count, uint64_t slices[16]);
+	static void FromSlices(const uint64_t slices[16], uint16_t* blocks, size_t count);
+	static void XorKeySliced(uint64_t slices[16], uint16_t key);
+	static void SubstSliced(const SboxCircuit& circuit, uint64_t slices[16]);
 
 	static const size_t Nr = 4;
 
@@ -36,6 +69,10 @@ private:
 	std::vector<uint16_t> m_SB;
 	std::vector<uint16_t> m_iSB;
 	std::vector<uint16_t> m_subkeys;
+	KeySchedule m_key_schedule;
+	BitPermutation m_permutation;
 	std::vector<std::vector<uint16_t>> m_diff_table;
 	std::vector<std::vector<uint16_t>> m_transposed_diff_table;
+	std::vector<std::vector<int16_t>> m_linear_table;
+	std::vector<std::vector<int16_t>> m_transposed_linear_table;
 };
\ No newline at end of file